@@ -0,0 +1,189 @@
+#include "acct.h"
+#include "clock.h"
+#include "cpu.h"
+#include "isr.h"
+#include "kernel.h"
+#include "klog.h"
+#include "percpu.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t last_tsc; /* previous transition */
+    /* Vectors being handled, innermost last; nested IRQs charge the outer one */
+    uint32_t vector_stack[ACCT_MAX_IRQ_DEPTH];
+    int depth;
+} __attribute__((aligned(64))) acct_cpu_t;
+
+static bool acct_enabled = false;
+static acct_cpu_t acct_cpus[SMP_MAX_CPUS];
+static uint64_t reset_tsc;
+static uint64_t vector_cycles[256];
+
+static uint32_t last_sample_tick = 0; /* system_ticks of the last load sample */
+static uint32_t load_average[3]; /* 1, 5 and 15 s, ACCT_FSHIFT fixed point */
+static const uint32_t load_exp[3] = {ACCT_EXP_1, ACCT_EXP_5, ACCT_EXP_15};
+
+void acct_init() {
+    acct_enabled = cpu_has(CPU_FEATURE_TSC);
+    if (!acct_enabled) return;
+    acct_cpus[0].last_tsc = reset_tsc = rdtsc();
+}
+
+void acct_init_cpu() {
+    if (acct_enabled) acct_cpus[this_cpu()->id].last_tsc = rdtsc();
+}
+
+void acct_reset() {
+    uint32_t flags = irq_save();
+    for (int i = 0; i < 256; i++) vector_cycles[i] = 0;
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        processes[i].cpu_cycles = 0;
+        for (int b = 0; b < ACCT_WAIT_BUCKETS; b++) processes[i].wait_histogram[b] = 0;
+    }
+    if (acct_enabled) reset_tsc = acct_cpus[this_cpu()->id].last_tsc = rdtsc();
+    irq_restore(flags);
+}
+
+/* Before sched_init() there is no current thread; the boot code becomes the idle thread */
+static Process *running_thread(cpu_t *cpu) {
+    return cpu->current ? cpu->current : &processes[0];
+}
+
+static void charge(cpu_t *cpu, acct_cpu_t *state, uint64_t now) {
+    uint64_t cycles = now - state->last_tsc;
+    if (state->depth > 0) {
+        int top = state->depth < ACCT_MAX_IRQ_DEPTH ? state->depth : ACCT_MAX_IRQ_DEPTH;
+        vector_cycles[state->vector_stack[top - 1]] += cycles;
+    } else {
+        running_thread(cpu)->cpu_cycles += cycles;
+    }
+    state->last_tsc = now;
+}
+
+void acct_irq_enter(uint32_t vector, uint64_t entry_tsc) {
+    if (!acct_enabled) return;
+    cpu_t *cpu = this_cpu();
+    acct_cpu_t *state = &acct_cpus[cpu->id];
+    charge(cpu, state, entry_tsc);
+    if (state->depth < ACCT_MAX_IRQ_DEPTH) state->vector_stack[state->depth] = vector;
+    state->depth++;
+}
+
+void acct_irq_exit() {
+    if (!acct_enabled) return;
+    cpu_t *cpu = this_cpu();
+    acct_cpu_t *state = &acct_cpus[cpu->id];
+    if (state->depth == 0) return;
+    charge(cpu, state, rdtsc());
+    state->depth--;
+}
+
+void acct_thread_ready(Process *thread) {
+    if (acct_enabled) thread->ready_tsc = rdtsc();
+}
+
+void acct_thread_run(Process *thread) {
+    if (!acct_enabled || thread->ready_tsc == 0) return;
+    uint32_t waited = (uint32_t) ((rdtsc() - thread->ready_tsc) >> ACCT_WAIT_SHIFT);
+    int bucket = waited ? 32 - __builtin_clz(waited) : 0;
+    if (bucket >= ACCT_WAIT_BUCKETS) bucket = ACCT_WAIT_BUCKETS - 1;
+    thread->wait_histogram[bucket]++;
+}
+
+/*
+ * Samples follow system_ticks, not timer interrupts: in tickless idle an
+ * interrupt can stand for many ticks, or for none. Every full period
+ * since the last sample decays the averages once with the current count.
+ */
+void acct_tick() {
+    if (system_ticks - last_sample_tick < ACCT_LOAD_TICKS) return;
+
+    /* Runnable: ready, or running and not an idle thread */
+    uint32_t runnable = 0;
+    for (int i = 1; i < MAX_PROCESSES; i++) {
+        if (processes[i].is_idle) continue;
+        if (processes[i].state == THREAD_READY || processes[i].state == THREAD_RUNNING) runnable++;
+    }
+    while (system_ticks - last_sample_tick >= ACCT_LOAD_TICKS) {
+        last_sample_tick += ACCT_LOAD_TICKS;
+        for (int i = 0; i < 3; i++) {
+            load_average[i] = (load_average[i] * load_exp[i] +
+                               runnable * ACCT_FIXED_1 * (ACCT_FIXED_1 - load_exp[i])) >> ACCT_FSHIFT;
+        }
+    }
+}
+
+uint64_t acct_elapsed_cycles() {
+    return acct_enabled ? rdtsc() - reset_tsc : 0;
+}
+
+uint32_t acct_permille(uint64_t cycles) {
+    uint64_t elapsed = acct_elapsed_cycles();
+    if (elapsed == 0) return 0;
+    /* Scale both down until the elapsed time fits the 32-bit divisor */
+    while (elapsed >> 32) {
+        elapsed >>= 1;
+        cycles >>= 1;
+    }
+    return (uint32_t) udiv64_32(cycles * 1000, (uint32_t) elapsed);
+}
+
+static uint32_t load_hundredths(uint32_t load) {
+    return ((load & (ACCT_FIXED_1 - 1)) * 100) >> ACCT_FSHIFT;
+}
+
+/* Upper bound of a wait histogram bucket in microseconds */
+static uint32_t bucket_limit_us(int bucket, uint32_t khz) {
+    uint64_t cycles = (uint64_t) 1 << (bucket + ACCT_WAIT_SHIFT);
+    return khz ? (uint32_t) udiv64_32(cycles * 1000, khz) : 0;
+}
+
+void acct_report() {
+    if (!acct_enabled) {
+        kprintf(KLOG_CONT, "CPU accounting needs rdtsc\n");
+        return;
+    }
+
+    uint64_t elapsed = acct_elapsed_cycles();
+    uint32_t khz = clock_tsc_khz();
+    uint32_t ms = khz ? (uint32_t) udiv64_32(elapsed, khz) : 0;
+    kprintf(KLOG_CONT, "%u ms accounted at %u MHz; share of CPU in tenths of a percent\n", ms, khz / 1000);
+
+    uint64_t irq_total = 0;
+    for (int v = 0; v < 256; v++) irq_total += vector_cycles[v];
+    kprintf(KLOG_CONT, "  idle %u, interrupts %u\n", acct_permille(processes[0].cpu_cycles),
+            acct_permille(irq_total));
+    for (int c = 1; c < SMP_MAX_CPUS; c++) {
+        if (cpus[c].online) kprintf(KLOG_CONT, "  cpu%d idle %u\n", c, acct_permille(cpus[c].idle->cpu_cycles));
+    }
+
+    for (int v = 0; v < 256; v++) {
+        if (vector_cycles[v] == 0) continue;
+        kprintf(KLOG_CONT, "  vector %3d %5u  (%u interrupts)\n", v, acct_permille(vector_cycles[v]),
+                irq_stats[v].count);
+    }
+
+    for (int i = 1; i < MAX_PROCESSES; i++) {
+        Process *thread = &processes[i];
+        if (thread->is_idle || (thread->cpu_cycles == 0 && thread->state == THREAD_UNUSED)) continue;
+        /* One record per line: the wait buckets are formatted into the line first */
+        char waits[KLOG_MESSAGE_SIZE - 32];
+        int length = 0;
+        waits[0] = '\0';
+        for (int b = 0; b < ACCT_WAIT_BUCKETS && length < (int) sizeof(waits); b++) {
+            if (thread->wait_histogram[b] == 0) continue;
+            length += ksnprintf(waits + length, sizeof(waits) - length, " <%uus:%u",
+                                bucket_limit_us(b, khz), thread->wait_histogram[b]);
+        }
+        kprintf(KLOG_CONT, "  pid %2d %5u %s waits%s\n", thread->pid,
+                acct_permille(thread->cpu_cycles), thread->name, waits);
+    }
+
+    kprintf(KLOG_CONT, "  load average %u.%02u %u.%02u %u.%02u\n",
+            load_average[0] >> ACCT_FSHIFT, load_hundredths(load_average[0]),
+            load_average[1] >> ACCT_FSHIFT, load_hundredths(load_average[1]),
+            load_average[2] >> ACCT_FSHIFT, load_hundredths(load_average[2]));
+}
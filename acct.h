@@ -0,0 +1,58 @@
+#pragma once
+
+#include "sched.h"
+
+#include <stdint.h>
+
+/*
+ * CPU time accounting in rdtsc cycles. Every IRQ entry and exit is a
+ * transition: the cycles since the previous one go to whoever owned the
+ * CPU, i.e. the running thread (the idle thread when nothing is ready)
+ * or the vector being handled. Context switches only happen on the way
+ * out of irq_handler, so these two hooks see every change of owner.
+ * Each CPU keeps its own transition state; the totals are shared.
+ */
+
+/* Wait histogram bucket n > 0 counts waits of [2^(n-1), 2^n) << ACCT_WAIT_SHIFT cycles; bucket 0 is shorter */
+#define ACCT_WAIT_SHIFT 10
+
+/* Load averages: runnable threads sampled every ACCT_LOAD_TICKS, decayed in FSHIFT fixed point */
+#define ACCT_LOAD_TICKS 10 /* 100 ms */
+#define ACCT_FSHIFT 11
+#define ACCT_FIXED_1 (1 << ACCT_FSHIFT)
+/* ACCT_FIXED_1 * exp(-0.1 s / period) for the 1, 5 and 15 second averages */
+#define ACCT_EXP_1 1853
+#define ACCT_EXP_5 2007
+#define ACCT_EXP_15 2034
+
+#define ACCT_MAX_IRQ_DEPTH 8
+
+void acct_init();
+
+/* Starts accounting on a secondary CPU */
+void acct_init_cpu();
+
+/* Zeroes the counters so the next report covers only what follows */
+void acct_reset();
+
+/* irq_handler hooks; entry_tsc is the stub's rdtsc, cpu_t.irq_entry_tsc */
+void acct_irq_enter(uint32_t vector, uint64_t entry_tsc);
+
+void acct_irq_exit();
+
+/* Scheduler hooks: thread queued, and thread picked to run after waiting */
+void acct_thread_ready(Process *thread);
+
+void acct_thread_run(Process *thread);
+
+/* Timer interrupt: samples the run queue length for the load averages every ACCT_LOAD_TICKS of system_ticks */
+void acct_tick();
+
+/* Cycles since acct_reset() (or boot) */
+uint64_t acct_elapsed_cycles();
+
+/* Tenths of a percent of the elapsed cycles */
+uint32_t acct_permille(uint64_t cycles);
+
+/* Per-thread, per-vector and idle shares, load averages and wait histograms */
+void acct_report();
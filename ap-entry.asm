@@ -0,0 +1,8 @@
+; ap-trampoline.bin as data in the kernel; smp_init() copies it to low memory
+[global ap_trampoline]
+[global ap_trampoline_end]
+
+section .rodata
+ap_trampoline:
+    incbin "ap-trampoline.bin"
+ap_trampoline_end:
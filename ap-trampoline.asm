@@ -0,0 +1,70 @@
+; Secondary CPUs start here in real mode, at 0800:0000 after a STARTUP
+; IPI. smp_init() copies this to SMP_TRAMPOLINE_ADDRESS and fills in the
+; parameters first; see smp_trampoline_t.
+[org 0x8000]
+[bits 16]
+
+SMP_MAX_CPUS equ 8     ; see percpu.h
+SMP_STACK_SHIFT equ 13 ; see smp.h
+
+ap_start:
+    jmp short ap_real_mode
+    align 4
+trampoline_cr3:
+    dd 0
+trampoline_cr4:
+    dd 0
+trampoline_cr0:
+    dd 0
+trampoline_stacks:
+    dd 0
+trampoline_entry:
+    dd 0
+trampoline_next_cpu:
+    dd 0
+
+ap_real_mode:
+    cli
+    xor ax, ax
+    mov ds, ax
+    lgdt [gdt_descriptor]
+    mov eax, cr0
+    or eax, 0x1
+    mov cr0, eax
+    jmp CODE_SEG:ap_protected_mode
+
+%include "gdt.asm"
+
+[bits 32]
+ap_protected_mode:
+    mov ax, DATA_SEG
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; The boot CPU's paging and FPU settings; CR3 before CR0 turns paging on
+    mov eax, [trampoline_cr4]
+    mov cr4, eax
+    mov eax, [trampoline_cr3]
+    mov cr3, eax
+    mov eax, [trampoline_cr0]
+    mov cr0, eax
+
+    ; Take the next cpus[] index; CPUs past the table stay parked
+    mov eax, 1
+    lock xadd [trampoline_next_cpu], eax
+    cmp eax, SMP_MAX_CPUS
+    jae .park
+
+    ; Stacks grow down from the end of this CPU's slice
+    lea esp, [eax + 1]
+    shl esp, SMP_STACK_SHIFT
+    add esp, [trampoline_stacks]
+    push eax
+    call [trampoline_entry]
+.park:
+    cli
+    hlt
+    jmp .park
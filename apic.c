@@ -0,0 +1,97 @@
+#include "apic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "idt.h"
+#include "isr.h"
+#include "paging.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+static volatile uint32_t *lapic = 0;
+static uint32_t timer_initial_count; /* counts per tick at divide-by-16 */
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t) high << 32) | low;
+}
+
+/* One-shot from the maximum count over a tick's worth of udelay() */
+static void calibrate_timer() {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_MASKED | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xffffffff);
+    udelay(NSEC_PER_TICK / 1000);
+    timer_initial_count = 0xffffffff - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+bool apic_init() {
+    if (!cpu_has(CPU_FEATURE_APIC | CPU_FEATURE_MSR) || clock_tsc_khz() == 0) return false;
+
+    uint32_t base = (uint32_t) rdmsr(IA32_APIC_BASE_MSR) & APIC_BASE_MASK;
+    if (!vm_map_page(base, base, PAGE_PRESENT | PAGE_WRITE | PAGE_CACHE_DISABLE)) return false;
+    lapic = (volatile uint32_t *) base;
+
+    set_idt_gate(APIC_TIMER_VECTOR, (uint32_t) isr49);
+    set_idt_gate(APIC_RESCHEDULE_VECTOR, (uint32_t) isr50);
+    set_idt_gate(APIC_SPURIOUS_VECTOR, (uint32_t) isr255);
+    apic_enable();
+    calibrate_timer();
+    return true;
+}
+
+void apic_enable() {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+uint32_t apic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void apic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void icr_wait() {
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) asm volatile("pause");
+}
+
+/* The low half sends, so it goes last; interrupts stay off in between */
+static void icr_send(uint32_t high, uint32_t low) {
+    uint32_t flags = irq_save();
+    icr_wait();
+    lapic_write(LAPIC_ICR_HIGH, high);
+    lapic_write(LAPIC_ICR_LOW, low);
+    irq_restore(flags);
+}
+
+void apic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    icr_send(apic_id << 24, vector);
+}
+
+void apic_broadcast_init() {
+    icr_send(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+    icr_wait();
+}
+
+void apic_broadcast_startup(uint32_t address) {
+    icr_send(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_STARTUP | (address >> 12));
+    icr_wait();
+}
+
+void apic_timer_start() {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, timer_initial_count);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Local APIC: one per CPU at the same physical address, each CPU seeing
+ * its own. Used for inter-processor interrupts and a per-CPU timer; the
+ * 8259 PICs still deliver the device IRQs to the boot CPU.
+ */
+#define IA32_APIC_BASE_MSR 0x1b
+#define APIC_BASE_MASK 0xfffff000
+
+/* Register offsets */
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600
+#define LAPIC_ICR_PENDING 0x1000 /* delivery status */
+#define LAPIC_ICR_ASSERT 0x4000
+#define LAPIC_ICR_LEVEL 0x8000
+#define LAPIC_ICR_ALL_BUT_SELF 0xc0000
+#define LAPIC_TIMER_MASKED 0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define APIC_TIMER_VECTOR 49
+#define APIC_RESCHEDULE_VECTOR 50
+#define APIC_SPURIOUS_VECTOR 255
+
+/*
+ * Boot CPU: maps and enables its local APIC and calibrates the timer
+ * against the TSC. False, and no other apic_ call may be made, without
+ * an APIC or a calibrated TSC.
+ */
+bool apic_init();
+
+/* Enables the calling CPU's local APIC; the boot CPU's is enabled by apic_init() */
+void apic_enable();
+
+uint32_t apic_id();
+
+void apic_eoi();
+
+/* Fixed interrupt on one CPU; waits until the previous IPI was delivered first */
+void apic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+/* INIT, then STARTUP at page address >> 12, to every CPU but the caller */
+void apic_broadcast_init();
+
+void apic_broadcast_startup(uint32_t address);
+
+/* Periodic APIC_TIMER_VECTOR at TIMER_HZ on the calling CPU */
+void apic_timer_start();
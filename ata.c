@@ -0,0 +1,477 @@
+#include "ata.h"
+#include "clock.h"
+#include "cpu.h"
+#include "isr.h"
+#include "kernel.h"
+#include "klog.h"
+#include "ktimer.h"
+#include "paging.h"
+#include "pci.h"
+#include "pmm.h"
+#include "ports.h"
+#include "sched.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ATA_SYNC_BATCH 8 /* requests ata_read/ata_write keep queued at once */
+#define ATA_POLL_LIMIT 100000 /* status reads before giving up on a drive */
+
+typedef struct {
+    uint16_t io;
+    uint16_t control;
+    uint16_t bmide; /* 0 without a usable bus-master function */
+    uint32_t *prdt; /* identity mapped, so its address is also the physical one */
+    ata_request_t *queue; /* sorted by (drive, lba) */
+    ata_request_t *active; /* the command in flight; merged requests are linked through next */
+    bool active_dma;
+    bool active_write;
+    ata_request_t *pio_request; /* PIO: where the next sector goes */
+    uint32_t pio_offset;
+    uint32_t pio_remaining;
+    uint64_t position; /* elevator head: key just past the last command */
+    int selected; /* drive the DRIVE register points at, -1 if unknown */
+    uint32_t started; /* system_ticks when active was issued */
+    ktimer_t timeout;
+    uint32_t requests;
+    uint32_t commands;
+    uint32_t dma_commands;
+    uint32_t sectors;
+    uint32_t errors;
+    uint32_t timeouts;
+} ata_channel_t;
+
+static ata_channel_t channels[ATA_CHANNELS];
+static ata_drive_t drives[ATA_MAX_DRIVES];
+static bool dma_enabled = true;
+
+/* ata_read/ata_write callers waiting for their batch */
+static wait_queue_t ata_wait = WAIT_QUEUE_INIT;
+
+static uint64_t request_key(const ata_request_t *request) {
+    return (uint64_t) request->drive << 32 | request->lba;
+}
+
+/* Four alternate status reads are the 400 ns a drive select needs to settle */
+static void ata_delay(ata_channel_t *channel) {
+    for (int i = 0; i < 4; i++) port_byte_in(channel->control);
+}
+
+static bool wait_not_busy(ata_channel_t *channel) {
+    for (int i = 0; i < ATA_POLL_LIMIT; i++) {
+        if (!(port_byte_in(channel->control) & ATA_STATUS_BSY)) return true;
+    }
+    return false;
+}
+
+static bool wait_drq(ata_channel_t *channel) {
+    for (int i = 0; i < ATA_POLL_LIMIT; i++) {
+        uint8_t status = port_byte_in(channel->control);
+        if (status & ATA_STATUS_BSY) continue;
+        if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) return false;
+        if (status & ATA_STATUS_DRQ) return true;
+    }
+    return false;
+}
+
+static void channel_reset(ata_channel_t *channel) {
+    if (channel->bmide) port_byte_out(channel->bmide + BMIDE_COMMAND, 0);
+    port_byte_out(channel->control, ATA_CONTROL_SRST);
+    udelay(5);
+    port_byte_out(channel->control, 0);
+    udelay(2000);
+    wait_not_busy(channel);
+    channel->selected = -1;
+}
+
+static void write_task_file(ata_channel_t *channel, int drive, uint32_t lba, uint32_t count, bool lba48) {
+    uint8_t select = ATA_DRIVE_LBA | (drive & 1 ? ATA_DRIVE_SLAVE : 0);
+    if (!lba48) select |= (lba >> 24) & 0x0f;
+    port_byte_out(channel->io + ATA_REG_DRIVE, select);
+    if (channel->selected != drive) {
+        ata_delay(channel);
+        channel->selected = drive;
+    }
+
+    /* LBA48 registers are two deep: high bytes first */
+    if (lba48) {
+        port_byte_out(channel->io + ATA_REG_COUNT, count >> 8);
+        port_byte_out(channel->io + ATA_REG_LBA0, lba >> 24);
+        port_byte_out(channel->io + ATA_REG_LBA1, 0);
+        port_byte_out(channel->io + ATA_REG_LBA2, 0);
+    }
+    port_byte_out(channel->io + ATA_REG_COUNT, count); /* 256 goes out as 0 */
+    port_byte_out(channel->io + ATA_REG_LBA0, lba);
+    port_byte_out(channel->io + ATA_REG_LBA1, lba >> 8);
+    port_byte_out(channel->io + ATA_REG_LBA2, lba >> 16);
+}
+
+/*
+ * Describes every buffer of the batch in the PRD table, one entry per
+ * physically contiguous run within a 64 KB block. False if a buffer is
+ * on an odd address, not mapped, or needs more entries than fit.
+ */
+static bool build_prdt(ata_channel_t *channel, ata_request_t *batch) {
+    uint32_t *prdt = channel->prdt;
+    int entries = 0;
+    for (ata_request_t *request = batch; request; request = request->next) {
+        uint32_t virt = (uint32_t) request->buffer;
+        if (virt & 1) return false;
+        uint32_t remaining = request->count * ATA_SECTOR_SIZE;
+        while (remaining) {
+            uint32_t chunk = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+            if (chunk > remaining) chunk = remaining;
+            uint32_t phys = vm_virt_to_phys(virt);
+            if (phys == 0) return false;
+
+            uint32_t *last = entries ? &prdt[2 * (entries - 1)] : 0;
+            if (last && last[0] + last[1] == phys &&
+                (last[0] & ~(ATA_PRD_BOUNDARY - 1)) == ((phys + chunk - 1) & ~(ATA_PRD_BOUNDARY - 1))) {
+                last[1] += chunk;
+            } else {
+                if (entries == ATA_PRD_ENTRIES) return false;
+                prdt[2 * entries] = phys;
+                prdt[2 * entries + 1] = chunk;
+                entries++;
+            }
+            virt += chunk;
+            remaining -= chunk;
+        }
+    }
+    if (entries == 0) return false;
+
+    for (int i = 0; i < entries; i++) prdt[2 * i + 1] &= 0xffff; /* a full 64 KB is written as 0 */
+    prdt[2 * entries - 1] |= ATA_PRD_END;
+    return true;
+}
+
+/* Moves the next sector of a PIO command between the data register and the batch's buffers */
+static void pio_sector(ata_channel_t *channel) {
+    ata_request_t *request = channel->pio_request;
+    uint8_t *buffer = (uint8_t *) request->buffer + channel->pio_offset;
+    if (channel->active_write) {
+        port_words_out(channel->io + ATA_REG_DATA, buffer, ATA_SECTOR_SIZE / 2);
+    } else {
+        port_words_in(channel->io + ATA_REG_DATA, buffer, ATA_SECTOR_SIZE / 2);
+    }
+    channel->pio_remaining--;
+    channel->pio_offset += ATA_SECTOR_SIZE;
+    if (channel->pio_offset == request->count * ATA_SECTOR_SIZE) {
+        channel->pio_request = request->next;
+        channel->pio_offset = 0;
+    }
+}
+
+/* Issues the next command if the channel is idle. Interrupts off. */
+static void channel_start(ata_channel_t *channel) {
+    if (channel->active || !channel->queue) return;
+
+    /* C-LOOK: the first request at or past the head, else wrap around to the lowest */
+    ata_request_t **link = &channel->queue;
+    while (*link && request_key(*link) < channel->position) link = &(*link)->next;
+    if (*link == 0) link = &channel->queue;
+
+    ata_request_t *first = *link;
+    ata_drive_t *drive = &drives[first->drive];
+    uint32_t limit = drive->lba48 ? ATA_MAX_MERGED_SECTORS : ATA_MAX_REQUEST_SECTORS;
+    ata_request_t *last = first;
+    uint32_t sectors = first->count;
+    while (last->next && last->next->drive == first->drive && last->next->write == first->write &&
+           last->next->lba == last->lba + last->count && sectors + last->next->count <= limit) {
+        last = last->next;
+        sectors += last->count;
+    }
+    *link = last->next;
+    last->next = 0;
+
+    channel->active = first;
+    channel->active_write = first->write;
+    channel->position = request_key(last) + last->count;
+    channel->started = system_ticks;
+    channel->commands++;
+    channel->sectors += sectors;
+    ktimer_start(&channel->timeout, ATA_TIMEOUT_TICKS, ATA_TIMEOUT_TICKS / 4);
+
+    bool lba48 = drive->lba48 && (sectors > ATA_MAX_REQUEST_SECTORS || first->lba + sectors > ATA_LBA28_LIMIT);
+    channel->active_dma = dma_enabled && channel->bmide && drive->dma && build_prdt(channel, first);
+
+    if (channel->active_dma) {
+        uint16_t bmide = channel->bmide;
+        uint8_t direction = first->write ? 0 : BMIDE_CMD_READ;
+        port_dword_out(bmide + BMIDE_PRDT, (uint32_t) channel->prdt);
+        port_byte_out(bmide + BMIDE_COMMAND, direction);
+        port_byte_out(bmide + BMIDE_STATUS,
+                      port_byte_in(bmide + BMIDE_STATUS) | BMIDE_STATUS_ERROR | BMIDE_STATUS_IRQ);
+        write_task_file(channel, first->drive, first->lba, sectors, lba48);
+        port_byte_out(channel->io + ATA_REG_COMMAND, first->write
+                      ? (lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                      : (lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA));
+        port_byte_out(bmide + BMIDE_COMMAND, direction | BMIDE_CMD_START);
+        channel->dma_commands++;
+        return;
+    }
+
+    channel->pio_request = first;
+    channel->pio_offset = 0;
+    channel->pio_remaining = sectors;
+    write_task_file(channel, first->drive, first->lba, sectors, lba48);
+    port_byte_out(channel->io + ATA_REG_COMMAND, first->write
+                  ? (lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO)
+                  : (lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO));
+    /* A PIO write sends its first sector up front; each interrupt then asks for the next.
+     * If the drive never asks, the timeout resets the channel. */
+    if (first->write && wait_drq(channel)) pio_sector(channel);
+}
+
+/* Finishes the active command, starts the next one, then reports to every merged request */
+static void channel_complete(ata_channel_t *channel, int status) {
+    ata_request_t *request = channel->active;
+    channel->active = 0;
+    ktimer_cancel(&channel->timeout);
+    if (status != ATA_OK) channel->errors++;
+
+    channel_start(channel); /* keep the drive busy while the callbacks run */
+
+    while (request) {
+        ata_request_t *next = request->next;
+        request->next = 0;
+        request->status = status;
+        if (request->done) request->done(request);
+        request = next;
+    }
+}
+
+static void channel_interrupt(ata_channel_t *channel) {
+    if (channel->active && channel->active_dma) {
+        uint8_t bm_status = port_byte_in(channel->bmide + BMIDE_STATUS);
+        if (!(bm_status & BMIDE_STATUS_IRQ)) return; /* not the transfer finishing */
+        port_byte_out(channel->bmide + BMIDE_COMMAND, channel->active_write ? 0 : BMIDE_CMD_READ);
+        uint8_t status = port_byte_in(channel->io + ATA_REG_STATUS);
+        port_byte_out(channel->bmide + BMIDE_STATUS, bm_status | BMIDE_STATUS_ERROR | BMIDE_STATUS_IRQ);
+        bool failed = (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) || (bm_status & BMIDE_STATUS_ERROR);
+        channel_complete(channel, failed ? ATA_ERROR : ATA_OK);
+        return;
+    }
+
+    uint8_t status = port_byte_in(channel->io + ATA_REG_STATUS); /* also acknowledges the drive */
+    if (!channel->active) return;
+    if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+        channel_complete(channel, ATA_ERROR);
+        return;
+    }
+
+    if (!channel->active_write) {
+        if (!(status & ATA_STATUS_DRQ)) return;
+        pio_sector(channel);
+        if (channel->pio_remaining == 0) channel_complete(channel, ATA_OK);
+    } else if (channel->pio_remaining == 0) {
+        channel_complete(channel, ATA_OK);
+    } else if (status & ATA_STATUS_DRQ) {
+        pio_sector(channel);
+    }
+}
+
+static void primary_interrupt(registers_t *regs) {
+    (void) regs;
+    channel_interrupt(&channels[0]);
+}
+
+static void secondary_interrupt(registers_t *regs) {
+    (void) regs;
+    channel_interrupt(&channels[1]);
+}
+
+/* Runs from the deferred work thread; a command that really is stuck gets the channel reset */
+static void channel_timeout(ktimer_t *timer, void *arg) {
+    (void) timer;
+    ata_channel_t *channel = arg;
+    uint32_t flags = irq_save();
+    if (channel->active && system_ticks - channel->started >= ATA_TIMEOUT_TICKS) {
+        channel->timeouts++;
+        kprintf(KLOG_WARN, "ata: channel %d timed out, resetting\n", (int) (channel - channels));
+        channel_reset(channel);
+        channel_complete(channel, ATA_TIMEOUT);
+    }
+    irq_restore(flags);
+}
+
+static void identify(int index) {
+    ata_channel_t *channel = &channels[index >> 1];
+    ata_drive_t *drive = &drives[index];
+
+    port_byte_out(channel->io + ATA_REG_DRIVE, ATA_DRIVE_LBA | (index & 1 ? ATA_DRIVE_SLAVE : 0));
+    ata_delay(channel);
+    channel->selected = index;
+    port_byte_out(channel->io + ATA_REG_COUNT, 0);
+    port_byte_out(channel->io + ATA_REG_LBA0, 0);
+    port_byte_out(channel->io + ATA_REG_LBA1, 0);
+    port_byte_out(channel->io + ATA_REG_LBA2, 0);
+    port_byte_out(channel->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+
+    uint8_t status = port_byte_in(channel->io + ATA_REG_STATUS);
+    if (status == 0 || status == 0xff) return; /* no drive, or nothing on the bus at all */
+    if (!wait_not_busy(channel)) return;
+    /* ATAPI and SATA devices abort IDENTIFY and leave their signature here */
+    if (port_byte_in(channel->io + ATA_REG_LBA1) || port_byte_in(channel->io + ATA_REG_LBA2)) return;
+    if (!wait_drq(channel)) return;
+
+    uint16_t id[256];
+    port_words_in(channel->io + ATA_REG_DATA, id, 256);
+    drive->present = true;
+    drive->dma = id[ATA_ID_CAPABILITIES] & ATA_ID_CAP_DMA;
+    drive->lba48 = id[ATA_ID_COMMAND_SETS] & ATA_ID_CMD_LBA48;
+    drive->sectors = id[ATA_ID_SECTORS] | (uint32_t) id[ATA_ID_SECTORS + 1] << 16;
+    if (drive->lba48) {
+        bool huge = id[ATA_ID_SECTORS_LBA48 + 2] || id[ATA_ID_SECTORS_LBA48 + 3];
+        drive->sectors = huge ? 0xffffffff
+                              : id[ATA_ID_SECTORS_LBA48] | (uint32_t) id[ATA_ID_SECTORS_LBA48 + 1] << 16;
+    }
+
+    /* The model string is stored with the bytes of each word swapped and padded with spaces */
+    for (int i = 0; i < ATA_MODEL_SIZE / 2; i++) {
+        drive->model[2 * i] = id[ATA_ID_MODEL + i] >> 8;
+        drive->model[2 * i + 1] = id[ATA_ID_MODEL + i] & 0xff;
+    }
+    int length = ATA_MODEL_SIZE;
+    while (length > 0 && drive->model[length - 1] == ' ') length--;
+    drive->model[length] = '\0';
+}
+
+void ata_init() {
+    static const uint16_t io[ATA_CHANNELS] = {ATA_PRIMARY_IO, ATA_SECONDARY_IO};
+    static const uint16_t control[ATA_CHANNELS] = {ATA_PRIMARY_CONTROL, ATA_SECONDARY_CONTROL};
+
+    /* Bus mastering needs the IDE function in compatibility mode, where it also decodes the legacy ports */
+    uint16_t bmide = 0;
+    pci_address_t ide;
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &ide)) {
+        uint32_t bar4 = pci_read32(ide, PCI_BAR4);
+        if ((bar4 & PCI_BAR_IO) && !(pci_read8(ide, PCI_PROG_IF) & PCI_IDE_NATIVE)) {
+            bmide = bar4 & 0xfffc;
+            pci_write16(ide, PCI_COMMAND, pci_read16(ide, PCI_COMMAND) | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+        }
+    }
+
+    for (int c = 0; c < ATA_CHANNELS; c++) {
+        ata_channel_t *channel = &channels[c];
+        channel->io = io[c];
+        channel->control = control[c];
+        channel->selected = -1;
+        ktimer_init(&channel->timeout, channel_timeout, channel);
+        if (bmide) {
+            channel->prdt = (uint32_t *) pmm_alloc_pages(0);
+            if (channel->prdt) channel->bmide = bmide + c * BMIDE_CHANNEL_STRIDE;
+        }
+
+        /* Probe with the drive's interrupt off, then let it interrupt */
+        port_byte_out(channel->control, ATA_CONTROL_NIEN);
+        identify(c * 2);
+        identify(c * 2 + 1);
+        port_byte_out(channel->control, 0);
+    }
+
+    register_interrupt_handler(IRQ14, primary_interrupt);
+    register_interrupt_handler(IRQ15, secondary_interrupt);
+}
+
+const ata_drive_t *ata_drive(int drive) {
+    if (drive < 0 || drive >= ATA_MAX_DRIVES || !drives[drive].present) return 0;
+    return &drives[drive];
+}
+
+void ata_submit(ata_request_t *request) {
+    const ata_drive_t *drive = ata_drive(request->drive);
+    if (!drive || request->count == 0 || request->count > ATA_MAX_REQUEST_SECTORS ||
+        request->lba + request->count > drive->sectors || request->lba + request->count < request->lba) {
+        request->status = ATA_INVALID;
+        if (request->done) request->done(request);
+        return;
+    }
+
+    /* DMA needs the buffer mapped: fault in untouched anonymous pages here, not mid-command */
+    uint32_t end = (uint32_t) request->buffer + request->count * ATA_SECTOR_SIZE;
+    for (uint32_t page = (uint32_t) request->buffer & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+        (void) *(volatile uint8_t *) page;
+    }
+
+    ata_channel_t *channel = &channels[request->drive >> 1];
+    uint64_t key = request_key(request);
+    request->status = ATA_PENDING;
+
+    uint32_t flags = irq_save();
+    ata_request_t **link = &channel->queue;
+    while (*link && request_key(*link) <= key) link = &(*link)->next;
+    request->next = *link;
+    *link = request;
+    channel->requests++;
+    channel_start(channel);
+    irq_restore(flags);
+}
+
+static void wake_waiters(ata_request_t *request) {
+    (void) request;
+    wake_up(&ata_wait);
+}
+
+static bool batch_finished(ata_request_t *requests, int count) {
+    for (int i = 0; i < count; i++) {
+        if (requests[i].status == ATA_PENDING) return false;
+    }
+    return true;
+}
+
+/* Splits the transfer into requests and queues up to ATA_SYNC_BATCH of them at a time */
+static int ata_transfer(int drive, uint32_t lba, uint32_t count, void *buffer, bool write) {
+    ata_request_t requests[ATA_SYNC_BATCH];
+    uint8_t *cursor = buffer;
+    while (count) {
+        int batch = 0;
+        for (; batch < ATA_SYNC_BATCH && count; batch++) {
+            uint32_t sectors = count < ATA_MAX_REQUEST_SECTORS ? count : ATA_MAX_REQUEST_SECTORS;
+            requests[batch] = (ata_request_t) {
+                .drive = drive, .write = write, .lba = lba, .count = sectors,
+                .buffer = cursor, .status = ATA_PENDING, .done = wake_waiters
+            };
+            lba += sectors;
+            count -= sectors;
+            cursor += sectors * ATA_SECTOR_SIZE;
+        }
+        for (int i = 0; i < batch; i++) ata_submit(&requests[i]);
+        wait_event(&ata_wait, batch_finished(requests, batch));
+        for (int i = 0; i < batch; i++) {
+            if (requests[i].status != ATA_OK) return requests[i].status;
+        }
+    }
+    return ATA_OK;
+}
+
+int ata_read(int drive, uint32_t lba, uint32_t count, void *buffer) {
+    return ata_transfer(drive, lba, count, buffer, false);
+}
+
+int ata_write(int drive, uint32_t lba, uint32_t count, const void *buffer) {
+    return ata_transfer(drive, lba, count, (void *) buffer, true);
+}
+
+void ata_set_dma(bool enable) {
+    dma_enabled = enable;
+}
+
+bool ata_dma_enabled() {
+    return dma_enabled;
+}
+
+void ata_report() {
+    for (int d = 0; d < ATA_MAX_DRIVES; d++) {
+        if (!drives[d].present) continue;
+        kprintf(KLOG_INFO, "ata%d: %s, %u MB, %s%s\n", d, drives[d].model, drives[d].sectors >> 11,
+                drives[d].lba48 ? "LBA48" : "LBA28", drives[d].dma ? ", DMA" : "");
+    }
+    for (int c = 0; c < ATA_CHANNELS; c++) {
+        ata_channel_t *channel = &channels[c];
+        if (!drives[c * 2].present && !drives[c * 2 + 1].present) continue;
+        kprintf(KLOG_INFO, "ata: channel %d (%s): %u requests in %u commands, %u DMA, %u sectors, %u errors, %u timeouts\n",
+                c, channel->bmide ? "bus master" : "PIO only", channel->requests, channel->commands,
+                channel->dma_commands, channel->sectors, channel->errors, channel->timeouts);
+    }
+}
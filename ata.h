@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * ATA disks on the legacy IDE channels (QEMU's PIIX3). Requests are
+ * queued per channel in (drive, LBA) order and served by a C-LOOK
+ * elevator; contiguous requests in the same direction are merged into
+ * one command. Commands use bus-master DMA through a PRD table when the
+ * controller and drive allow it, otherwise interrupt-driven PIO.
+ */
+#define ATA_SECTOR_SIZE 512
+#define ATA_CHANNELS 2
+#define ATA_MAX_DRIVES 4 /* channel * 2 + 1 for the slave */
+
+#define ATA_PRIMARY_IO 0x1f0
+#define ATA_PRIMARY_CONTROL 0x3f6
+#define ATA_SECONDARY_IO 0x170
+#define ATA_SECONDARY_CONTROL 0x376
+
+/* Task file, offsets from the channel's I/O base */
+#define ATA_REG_DATA 0
+#define ATA_REG_ERROR 1
+#define ATA_REG_COUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_STATUS 7
+#define ATA_REG_COMMAND 7
+
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DF 0x20
+#define ATA_STATUS_BSY 0x80
+
+#define ATA_CONTROL_NIEN 0x02
+#define ATA_CONTROL_SRST 0x04
+
+#define ATA_DRIVE_LBA 0xe0
+#define ATA_DRIVE_SLAVE 0x10
+
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_READ_PIO_EXT 0x24
+#define ATA_CMD_READ_DMA 0xc8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA 0xca
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_IDENTIFY 0xec
+
+/* IDENTIFY words */
+#define ATA_ID_CAPABILITIES 49
+#define ATA_ID_CAP_DMA 0x100
+#define ATA_ID_SECTORS 60
+#define ATA_ID_COMMAND_SETS 83
+#define ATA_ID_CMD_LBA48 0x400
+#define ATA_ID_SECTORS_LBA48 100
+#define ATA_ID_MODEL 27
+#define ATA_MODEL_SIZE 40
+
+/* Bus master IDE registers, offsets from BAR4 plus 8 per channel */
+#define BMIDE_COMMAND 0
+#define BMIDE_STATUS 2
+#define BMIDE_PRDT 4
+#define BMIDE_CHANNEL_STRIDE 8
+#define BMIDE_CMD_START 0x01
+#define BMIDE_CMD_READ 0x08 /* device to memory */
+#define BMIDE_STATUS_ERROR 0x02
+#define BMIDE_STATUS_IRQ 0x04
+
+/* PRD entries: 32-bit physical base, then byte count (0 = 64 KB) and the end flag */
+#define ATA_PRD_END 0x80000000u
+#define ATA_PRD_ENTRIES 512 /* one page */
+#define ATA_PRD_BOUNDARY 0x10000 /* an entry can't cross 64 KB */
+
+#define ATA_MAX_REQUEST_SECTORS 256 /* per ata_request_t */
+#define ATA_MAX_MERGED_SECTORS 2048 /* per command after merging; LBA28 commands stop at 256 */
+#define ATA_LBA28_LIMIT 0x10000000u
+#define ATA_TIMEOUT_TICKS 300
+
+/* ata_request_t.status */
+#define ATA_OK 0
+#define ATA_PENDING 1
+#define ATA_ERROR -1
+#define ATA_TIMEOUT -2
+#define ATA_INVALID -3 /* no such drive, bad count or past the end */
+
+typedef struct ata_request ata_request_t;
+
+struct ata_request {
+    uint8_t drive;
+    bool write;
+    uint32_t lba;
+    uint32_t count; /* sectors, 1..ATA_MAX_REQUEST_SECTORS */
+    void *buffer;
+    volatile int status;
+    /* Runs in interrupt context when the request finishes; keep it short */
+    void (*done)(ata_request_t *request);
+    void *arg;
+    ata_request_t *next; /* owned by the driver until done */
+};
+
+typedef struct {
+    bool present;
+    bool lba48;
+    bool dma;
+    uint32_t sectors; /* capped at 2^32 - 1 */
+    char model[ATA_MODEL_SIZE + 1];
+} ata_drive_t;
+
+/* Probes both channels and the bus-master function; call after paging_init() */
+void ata_init();
+
+/* 0 if the drive isn't there */
+const ata_drive_t *ata_drive(int drive);
+
+/* Queues the request and returns at once; done() reports the outcome in request->status */
+void ata_submit(ata_request_t *request);
+
+/* Blocking reads and writes of any length, issued as a batch of queued requests. Process context only. */
+int ata_read(int drive, uint32_t lba, uint32_t count, void *buffer);
+
+int ata_write(int drive, uint32_t lba, uint32_t count, const void *buffer);
+
+/* PIO only when false, e.g. to measure the fallback */
+void ata_set_dma(bool enable);
+
+bool ata_dma_enabled();
+
+void ata_report();
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * 32-bit atomics for data shared between CPUs or with interrupt
+ * handlers. Everything is sequentially consistent except the plain
+ * load and store, which are acquire and release; on x86 only stores
+ * followed by loads need the fence, and the locked instructions here
+ * already are one. 64-bit values need a lock or a seqlock: i386 has no
+ * single-instruction 64-bit load or store.
+ */
+typedef struct {
+    volatile uint32_t value;
+} atomic_t;
+
+#define ATOMIC_INIT(v) {(v)}
+
+static inline uint32_t atomic_read(atomic_t *a) {
+    return __atomic_load_n(&a->value, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_set(atomic_t *a, uint32_t value) {
+    __atomic_store_n(&a->value, value, __ATOMIC_RELEASE);
+}
+
+/* Return the new value */
+static inline uint32_t atomic_add(atomic_t *a, uint32_t delta) {
+    return __atomic_add_fetch(&a->value, delta, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_sub(atomic_t *a, uint32_t delta) {
+    return __atomic_sub_fetch(&a->value, delta, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_inc(atomic_t *a) {
+    return atomic_add(a, 1);
+}
+
+static inline uint32_t atomic_dec(atomic_t *a) {
+    return atomic_sub(a, 1);
+}
+
+/* Return the old value */
+static inline uint32_t atomic_xchg(atomic_t *a, uint32_t value) {
+    return __atomic_exchange_n(&a->value, value, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_fetch_or(atomic_t *a, uint32_t bits) {
+    return __atomic_fetch_or(&a->value, bits, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_fetch_and(atomic_t *a, uint32_t bits) {
+    return __atomic_fetch_and(&a->value, bits, __ATOMIC_SEQ_CST);
+}
+
+/* Stores desired if the value is expected; either way *expected gets what was there */
+static inline bool atomic_cmpxchg(atomic_t *a, uint32_t *expected, uint32_t desired) {
+    return __atomic_compare_exchange_n(&a->value, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Full fence, and compiler-only barriers for ordering against interrupt handlers on this CPU */
+static inline void smp_mb() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void barrier() {
+    asm volatile("" : : : "memory");
+}
+
+static inline void cpu_relax() {
+    asm volatile("pause" : : : "memory");
+}
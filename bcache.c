@@ -0,0 +1,390 @@
+#include "bcache.h"
+#include "ata.h"
+#include "clock.h"
+#include "cpu.h"
+#include "kernel.h"
+#include "klog.h"
+#include "kstring.h"
+#include "ktimer.h"
+#include "memory.h"
+#include "pmm.h"
+#include "sched.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BCACHE_HASH_BUCKETS (1 << BCACHE_HASH_BITS)
+
+/* Where a device's reader is going, for read-ahead */
+typedef struct {
+    uint32_t next;   /* block a sequential reader asks for next */
+    uint32_t window; /* 0 until the reader looks sequential */
+    uint32_t ahead;  /* first block not read ahead yet */
+} bcache_stream_t;
+
+static bcache_buffer_t *buffers;
+static uint32_t buffer_count;
+static bcache_buffer_t *hash_table[BCACHE_HASH_BUCKETS];
+static bcache_buffer_t *lru_head; /* most recently released */
+static bcache_buffer_t *lru_tail;
+static bcache_stream_t streams[ATA_MAX_DRIVES];
+static bool readahead_enabled = true;
+static bool timing; /* rdtsc available for the latency counters */
+
+static uint32_t dirty_count;
+static uint32_t writes_in_flight;
+
+/* Woken by every I/O completion and release: readers, bcache_sync() and allocation */
+static wait_queue_t bcache_wait = WAIT_QUEUE_INIT;
+static wait_queue_t flusher_wait = WAIT_QUEUE_INIT;
+static volatile bool flush_requested;
+static ktimer_t flush_timer;
+
+static struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint64_t hit_cycles;
+    uint64_t miss_cycles;
+    uint32_t readahead;
+    uint32_t readahead_used;
+    uint32_t writebacks;
+    uint32_t evictions;
+    uint32_t errors;
+} stats;
+
+static uint32_t hash_index(int device, uint32_t block) {
+    return ((block ^ ((uint32_t) device << 24)) * 2654435761u) >> (32 - BCACHE_HASH_BITS);
+}
+
+static bcache_buffer_t *lookup(int device, uint32_t block) {
+    for (bcache_buffer_t *buffer = hash_table[hash_index(device, block)]; buffer; buffer = buffer->hash_next) {
+        if (buffer->block == block && buffer->device == device) return buffer;
+    }
+    return 0;
+}
+
+static void unhash(bcache_buffer_t *buffer) {
+    bcache_buffer_t **link = &hash_table[hash_index(buffer->device, buffer->block)];
+    while (*link && *link != buffer) link = &(*link)->hash_next;
+    if (*link) *link = buffer->hash_next;
+    buffer->hash_next = 0;
+}
+
+static void lru_unlink(bcache_buffer_t *buffer) {
+    if (buffer->lru_prev) buffer->lru_prev->lru_next = buffer->lru_next;
+    else lru_head = buffer->lru_next;
+    if (buffer->lru_next) buffer->lru_next->lru_prev = buffer->lru_prev;
+    else lru_tail = buffer->lru_prev;
+    buffer->lru_prev = buffer->lru_next = 0;
+}
+
+static void lru_push(bcache_buffer_t *buffer) {
+    buffer->lru_prev = 0;
+    buffer->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = buffer;
+    else lru_tail = buffer;
+    lru_head = buffer;
+}
+
+static void hold(bcache_buffer_t *buffer) {
+    if (buffer->references++ == 0) lru_unlink(buffer);
+}
+
+static void request_flush() {
+    flush_requested = true;
+    wake_up(&flusher_wait);
+}
+
+/* Least recently used buffer nobody holds that can be dropped without I/O */
+static bcache_buffer_t *find_victim() {
+    for (bcache_buffer_t *buffer = lru_tail; buffer; buffer = buffer->lru_prev) {
+        if (!(buffer->flags & (BCACHE_DIRTY | BCACHE_IO))) return buffer;
+    }
+    return 0;
+}
+
+/* Gives the victim a new identity, held once, with its read in flight */
+static void claim(bcache_buffer_t *buffer, int device, uint32_t block) {
+    if (buffer->flags & BCACHE_VALID) stats.evictions++;
+    unhash(buffer);
+    hold(buffer);
+    buffer->device = device;
+    buffer->block = block;
+    buffer->flags = BCACHE_IO;
+    uint32_t bucket = hash_index(device, block);
+    buffer->hash_next = hash_table[bucket];
+    hash_table[bucket] = buffer;
+}
+
+/* Interrupt context */
+static void io_done(ata_request_t *request) {
+    bcache_buffer_t *buffer = request->arg;
+    uint32_t flags = buffer->flags & ~BCACHE_IO;
+    if (request->status != ATA_OK) {
+        stats.errors++;
+        /* A failed write stays dirty for the next pass (counted once if it was redirtied meanwhile); a failed read leaves the buffer invalid */
+        if (request->write && !(flags & BCACHE_DIRTY)) {
+            flags |= BCACHE_DIRTY;
+            dirty_count++;
+        }
+    } else if (!request->write) {
+        flags |= BCACHE_VALID;
+    }
+    if (request->write) writes_in_flight--;
+    buffer->flags = flags;
+    wake_up(&bcache_wait);
+}
+
+static void start_io(bcache_buffer_t *buffer, bool write) {
+    buffer->request = (ata_request_t) {
+        .drive = buffer->device, .write = write, .lba = buffer->block * BCACHE_SECTORS_PER_BLOCK,
+        .count = BCACHE_SECTORS_PER_BLOCK, .buffer = buffer->data, .done = io_done, .arg = buffer
+    };
+    ata_submit(&buffer->request);
+}
+
+/*
+ * Called on every read. A reader asking for the block after its last one
+ * is sequential: keep at least half a window queued past it, doubling
+ * the window each refill up to BCACHE_READAHEAD_MAX. Anything else
+ * resets the stream. Interrupts off.
+ */
+static void readahead(int device, uint32_t block) {
+    bcache_stream_t *stream = &streams[device];
+    if (!readahead_enabled || block != stream->next) {
+        stream->next = stream->ahead = block + 1;
+        stream->window = 0;
+        return;
+    }
+    stream->next = block + 1;
+    if (stream->window == 0) stream->window = BCACHE_READAHEAD_MIN;
+    if (stream->ahead > block + stream->window / 2) return;
+    if (stream->ahead <= block) stream->ahead = block + 1;
+
+    uint32_t limit = ata_drive(device)->sectors / BCACHE_SECTORS_PER_BLOCK;
+    uint32_t end = stream->ahead + stream->window;
+    if (end > limit) end = limit;
+    uint32_t next = stream->ahead;
+    for (; next < end; next++) {
+        if (lookup(device, next)) continue;
+        bcache_buffer_t *buffer = find_victim();
+        if (!buffer) break;
+        claim(buffer, device, next);
+        buffer->flags |= BCACHE_READAHEAD;
+        buffer->references = 0;
+        lru_push(buffer);
+        stats.readahead++;
+        start_io(buffer, false);
+    }
+    stream->ahead = next;
+    if (stream->window < BCACHE_READAHEAD_MAX) stream->window *= 2;
+}
+
+bcache_buffer_t *bcache_read(int device, uint32_t block) {
+    if (buffer_count == 0 || !ata_drive(device)) return 0;
+    uint64_t start = timing ? rdtsc() : 0;
+
+    uint32_t flags = irq_save();
+    bcache_buffer_t *buffer;
+    bool hit;
+    for (;;) {
+        buffer = lookup(device, block);
+        if (buffer) {
+            hit = true;
+            hold(buffer);
+            if (buffer->flags & BCACHE_READAHEAD) stats.readahead_used++;
+            buffer->flags &= ~BCACHE_READAHEAD;
+            /* An earlier read of it failed: try again */
+            if (!(buffer->flags & (BCACHE_VALID | BCACHE_IO))) {
+                buffer->flags |= BCACHE_IO;
+                start_io(buffer, false);
+            }
+            break;
+        }
+        buffer = find_victim();
+        if (buffer) {
+            hit = false;
+            claim(buffer, device, block);
+            start_io(buffer, false);
+            break;
+        }
+        /* Everything is held or dirty: wait for the flusher, then look again */
+        request_flush();
+        wait_queue_sleep(&bcache_wait);
+    }
+    readahead(device, block);
+    /* A write-back in flight leaves the data valid; only a read has to be waited for */
+    while ((buffer->flags & (BCACHE_IO | BCACHE_VALID)) == BCACHE_IO) wait_queue_sleep(&bcache_wait);
+    bool valid = buffer->flags & BCACHE_VALID;
+
+    if (timing) {
+        uint64_t cycles = rdtsc() - start;
+        if (hit) {
+            stats.hits++;
+            stats.hit_cycles += cycles;
+        } else {
+            stats.misses++;
+            stats.miss_cycles += cycles;
+        }
+    }
+    irq_restore(flags);
+
+    if (!valid) {
+        bcache_release(buffer);
+        return 0;
+    }
+    return buffer;
+}
+
+void bcache_mark_dirty(bcache_buffer_t *buffer) {
+    uint32_t flags = irq_save();
+    if (!(buffer->flags & BCACHE_DIRTY)) {
+        buffer->flags |= BCACHE_DIRTY;
+        buffer->dirty_since = system_ticks;
+        dirty_count++;
+        if (dirty_count > buffer_count / 4) request_flush();
+    }
+    irq_restore(flags);
+}
+
+void bcache_release(bcache_buffer_t *buffer) {
+    uint32_t flags = irq_save();
+    if (--buffer->references == 0) lru_push(buffer);
+    wake_up(&bcache_wait);
+    irq_restore(flags);
+}
+
+int bcache_read_bytes(int device, uint64_t offset, void *buffer, uint32_t length) {
+    uint8_t *out = buffer;
+    while (length) {
+        uint32_t within = (uint32_t) offset & (BCACHE_BLOCK_SIZE - 1);
+        uint32_t chunk = BCACHE_BLOCK_SIZE - within;
+        if (chunk > length) chunk = length;
+        bcache_buffer_t *block = bcache_read(device, (uint32_t) (offset >> BCACHE_BLOCK_SHIFT));
+        if (!block) return ATA_ERROR;
+        memcpy(out, block->data + within, chunk);
+        bcache_release(block);
+        out += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return ATA_OK;
+}
+
+int bcache_write_bytes(int device, uint64_t offset, const void *buffer, uint32_t length) {
+    const uint8_t *in = buffer;
+    while (length) {
+        uint32_t within = (uint32_t) offset & (BCACHE_BLOCK_SIZE - 1);
+        uint32_t chunk = BCACHE_BLOCK_SIZE - within;
+        if (chunk > length) chunk = length;
+        bcache_buffer_t *block = bcache_read(device, (uint32_t) (offset >> BCACHE_BLOCK_SHIFT));
+        if (!block) return ATA_ERROR;
+        memcpy(block->data + within, in, chunk);
+        bcache_mark_dirty(block);
+        bcache_release(block);
+        in += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return ATA_OK;
+}
+
+/*
+ * Queues writes for up to BCACHE_FLUSH_BATCH dirty blocks, all of them or
+ * only those dirty for BCACHE_DIRTY_EXPIRE_TICKS, and waits until they
+ * are done. Returns how many were written: failed writes are dirty again,
+ * so on a failing disk a full batch would come back every pass and the
+ * callers' "until a short batch" loops would never end.
+ */
+static uint32_t flush_batch(bool all) {
+    uint32_t queued = 0;
+    uint32_t flags = irq_save();
+    uint32_t errors = stats.errors;
+    for (uint32_t i = 0; i < buffer_count && queued < BCACHE_FLUSH_BATCH; i++) {
+        bcache_buffer_t *buffer = &buffers[i];
+        if ((buffer->flags & (BCACHE_DIRTY | BCACHE_IO)) != BCACHE_DIRTY) continue;
+        if (!all && system_ticks - buffer->dirty_since < BCACHE_DIRTY_EXPIRE_TICKS) continue;
+        /* Cleared before the write, so a change made while it is in flight dirties it again */
+        buffer->flags = (buffer->flags & ~BCACHE_DIRTY) | BCACHE_IO;
+        dirty_count--;
+        writes_in_flight++;
+        stats.writebacks++;
+        queued++;
+        start_io(buffer, true);
+    }
+    while (writes_in_flight) wait_queue_sleep(&bcache_wait);
+    errors = stats.errors - errors;
+    irq_restore(flags);
+    return errors < queued ? queued - errors : 0;
+}
+
+int bcache_sync() {
+    uint32_t errors = stats.errors;
+    while (flush_batch(true) == BCACHE_FLUSH_BATCH);
+    return stats.errors == errors ? ATA_OK : ATA_ERROR;
+}
+
+static void flush_tick(ktimer_t *timer, void *arg) {
+    (void) timer;
+    (void) arg;
+    if (dirty_count) request_flush();
+}
+
+/* Writes back what has been dirty long enough, or everything it can while too much is dirty */
+static void flusher_thread(void *arg) {
+    (void) arg;
+    while (1) {
+        wait_event(&flusher_wait, flush_requested);
+        flush_requested = false;
+        while (flush_batch(dirty_count > buffer_count / 4) == BCACHE_FLUSH_BATCH);
+    }
+}
+
+void bcache_init() {
+    uint32_t count = pmm_free_frames() >> BCACHE_MEMORY_SHIFT;
+    if (count < BCACHE_MIN_BUFFERS) count = BCACHE_MIN_BUFFERS;
+    if (count > BCACHE_MAX_BUFFERS) count = BCACHE_MAX_BUFFERS;
+
+    buffers = mem_alloc(count * sizeof(bcache_buffer_t));
+    if (!buffers) {
+        kprintf(KLOG_ERROR, "bcache: no memory for %u buffers\n", count);
+        return;
+    }
+    /* Data pages come from the frame allocator, so DMA sees one contiguous run per block */
+    for (buffer_count = 0; buffer_count < count; buffer_count++) {
+        uint32_t page = pmm_alloc_pages(0);
+        if (!page) break;
+        bcache_buffer_t *buffer = &buffers[buffer_count];
+        *buffer = (bcache_buffer_t) {.data = (uint8_t *) page};
+        lru_push(buffer);
+    }
+
+    timing = cpu_has(CPU_FEATURE_TSC);
+    ktimer_init(&flush_timer, flush_tick, 0);
+    ktimer_start_periodic(&flush_timer, BCACHE_FLUSH_INTERVAL_TICKS, BCACHE_FLUSH_INTERVAL_TICKS / 2);
+    thread_create("bflush", flusher_thread, 0, 7);
+}
+
+void bcache_set_readahead(bool enable) {
+    readahead_enabled = enable;
+}
+
+/* Average of cycles over count, in nanoseconds */
+static uint32_t average_ns(uint64_t cycles, uint32_t count) {
+    uint32_t khz = clock_tsc_khz();
+    if (count == 0 || khz == 0) return 0;
+    return (uint32_t) udiv64_32(udiv64_32(cycles, count) * 1000000, khz);
+}
+
+void bcache_report() {
+    uint32_t lookups = stats.hits + stats.misses;
+    uint32_t permille = lookups ? (uint32_t) udiv64_32((uint64_t) stats.hits * 1000, lookups) : 0;
+    kprintf(KLOG_INFO, "bcache: %u blocks of %u KB, %u dirty, %u writes in flight\n",
+            buffer_count, BCACHE_BLOCK_SIZE / 1024, dirty_count, writes_in_flight);
+    kprintf(KLOG_INFO, "bcache: %u hits, %u misses (%u.%u%% hit), hit %u ns, miss %u ns average\n",
+            stats.hits, stats.misses, permille / 10, permille % 10,
+            average_ns(stats.hit_cycles, stats.hits), average_ns(stats.miss_cycles, stats.misses));
+    kprintf(KLOG_INFO, "bcache: %u read ahead, %u of them used; %u written back, %u evicted, %u errors\n",
+            stats.readahead, stats.readahead_used, stats.writebacks, stats.evictions, stats.errors);
+}
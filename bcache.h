@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ata.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Block cache between block consumers and the ATA driver. Blocks are
+ * one page, found through a hash of (device, block) and recycled least
+ * recently used first. Writes only mark a block dirty; the flusher
+ * thread writes dirty blocks back in batches the elevator can merge.
+ * Sequential reads grow a read-ahead window that is queued without
+ * waiting, so the reader overlaps with the disk.
+ *
+ * Devices are ATA drive numbers.
+ */
+#define BCACHE_BLOCK_SHIFT 12
+#define BCACHE_BLOCK_SIZE (1 << BCACHE_BLOCK_SHIFT)
+#define BCACHE_SECTORS_PER_BLOCK (BCACHE_BLOCK_SIZE / ATA_SECTOR_SIZE)
+
+#define BCACHE_HASH_BITS 10
+#define BCACHE_MEMORY_SHIFT 3 /* the cache takes up to 1/8 of the free frames */
+#define BCACHE_MIN_BUFFERS 64
+#define BCACHE_MAX_BUFFERS 16384
+
+#define BCACHE_READAHEAD_MIN 4 /* blocks, doubled on every refill of a sequential stream */
+#define BCACHE_READAHEAD_MAX 64
+
+#define BCACHE_FLUSH_INTERVAL_TICKS 100
+#define BCACHE_DIRTY_EXPIRE_TICKS 300 /* written back once dirty this long */
+#define BCACHE_FLUSH_BATCH 256 /* writes queued per pass */
+
+/* bcache_buffer_t.flags */
+#define BCACHE_VALID 0x1
+#define BCACHE_DIRTY 0x2
+#define BCACHE_IO 0x4 /* read or write in flight */
+#define BCACHE_READAHEAD 0x8 /* read ahead and not asked for yet */
+
+typedef struct bcache_buffer bcache_buffer_t;
+
+struct bcache_buffer {
+    uint8_t device;
+    uint32_t block;
+    volatile uint32_t flags;
+    uint32_t references;
+    uint32_t dirty_since; /* system_ticks */
+    uint8_t *data;
+    bcache_buffer_t *hash_next;
+    bcache_buffer_t *lru_prev; /* on the LRU list while nobody holds it */
+    bcache_buffer_t *lru_next;
+    ata_request_t request;
+};
+
+/* Sizes the cache from the free frames and starts the flusher; call after sched_init() */
+void bcache_init();
+
+/* The block with its data, held until bcache_release(); 0 on a read error. Process context. */
+bcache_buffer_t *bcache_read(int device, uint32_t block);
+
+/* The held block's data was changed; the flusher writes it back */
+void bcache_mark_dirty(bcache_buffer_t *buffer);
+
+void bcache_release(bcache_buffer_t *buffer);
+
+/* Byte-granular copies through the cache; ATA_OK or an ATA error status */
+int bcache_read_bytes(int device, uint64_t offset, void *buffer, uint32_t length);
+
+int bcache_write_bytes(int device, uint64_t offset, const void *buffer, uint32_t length);
+
+/* Writes every dirty block back and waits for the writes */
+int bcache_sync();
+
+void bcache_set_readahead(bool enable);
+
+void bcache_report();
@@ -0,0 +1,1294 @@
+#include "bench.h"
+#include "ata.h"
+#include "bcache.h"
+#include "clock.h"
+#include "cpu.h"
+#include "display.h"
+#include "initrd.h"
+#include "isr.h"
+#include "kernel.h"
+#include "keyboard.h"
+#include "ktimer.h"
+#include "kstring.h"
+#include "memory.h"
+#include "nn.h"
+#include "paging.h"
+#include "percpu.h"
+#include "pmm.h"
+#include "ports.h"
+#include "sched.h"
+#include "serial.h"
+#include "smp.h"
+#include "util.h"
+#include <stdint.h>
+
+#define BENCH_LINE "The quick brown fox jumps over the lazy dog 0123456789\n"
+
+/*
+ * Reference copy of the console before the cached-cursor rework: every
+ * call reads the cursor back from the CRTC, writes it again at the end
+ * and scrolls by copying the whole screen up one line.
+ */
+static int legacy_get_cursor() {
+    port_byte_out(REG_SCREEN_CTRL, 14);
+    int offset = port_byte_in(REG_SCREEN_DATA) << 8;
+    port_byte_out(REG_SCREEN_CTRL, 15);
+    offset += port_byte_in(REG_SCREEN_DATA);
+    return offset * 2;
+}
+
+static void legacy_set_cursor(int offset) {
+    offset /= 2;
+    port_byte_out(REG_SCREEN_CTRL, 14);
+    port_byte_out(REG_SCREEN_DATA, (unsigned char) (offset >> 8));
+    port_byte_out(REG_SCREEN_CTRL, 15);
+    port_byte_out(REG_SCREEN_DATA, (unsigned char) (offset & 0xff));
+}
+
+static int legacy_scroll_ln(int offset) {
+    uint8_t *vidmem = (uint8_t *) VIDEO_ADDRESS;
+    for (int i = 0; i < MAX_COLS * (MAX_ROWS - 1) * 2; i++) {
+        vidmem[i] = vidmem[i + 2 * MAX_COLS];
+    }
+    for (int col = 0; col < MAX_COLS; col++) {
+        set_char_at_video_memory(' ', 2 * ((MAX_ROWS - 1) * MAX_COLS + col));
+    }
+    return offset - 2 * MAX_COLS;
+}
+
+static void legacy_print_string(char *string) {
+    int offset = legacy_get_cursor();
+    int i = 0;
+    while (string[i] != 0) {
+        if (offset >= MAX_ROWS * MAX_COLS * 2) {
+            offset = legacy_scroll_ln(offset);
+        }
+        if (string[i] == '\n') {
+            offset = 2 * MAX_COLS * (offset / (2 * MAX_COLS) + 1);
+        } else {
+            set_char_at_video_memory(string[i], offset);
+            offset += 2;
+        }
+        i++;
+    }
+    legacy_set_cursor(offset);
+}
+
+/* Prints BENCH_LINE for BENCH_DURATION_TICKS and returns characters per second */
+static uint32_t console_chars_per_second(void (*print)(char *)) {
+    uint32_t line_length = string_length(BENCH_LINE);
+    uint32_t chars = 0;
+
+    uint32_t start = system_ticks;
+    while (system_ticks == start);
+    start = system_ticks;
+    while (system_ticks - start < BENCH_DURATION_TICKS) {
+        print(BENCH_LINE);
+        chars += line_length;
+    }
+    return chars / (BENCH_DURATION_TICKS / 100);
+}
+
+void bench_console() {
+    clear_screen();
+    uint32_t legacy = console_chars_per_second(legacy_print_string);
+    clear_screen();
+    uint32_t cached = console_chars_per_second(print_string);
+    clear_screen();
+
+    print_string("Console benchmark (chars/s)\n");
+    print_string("  legacy print_string: ");
+    print_int(legacy);
+    print_string("\n  cached print_string: ");
+    print_int(cached);
+    print_nl();
+}
+
+/*
+ * Reference copy of the original IRQ1 handler: a switch over every
+ * scancode that prints its echo to the screen inside the interrupt,
+ * through the original console above.
+ */
+static void legacy_keyboard_echo(char *text) {
+    legacy_print_string(text);
+}
+
+static void legacy_keyboard_irq(uint8_t scancode) {
+    switch (scancode) {
+        case 0x00: legacy_keyboard_echo("ERROR"); break;
+        case 0x01: legacy_keyboard_echo("ESC"); break;
+        case 0x02: legacy_keyboard_echo("1"); break;
+        case 0x03: legacy_keyboard_echo("2"); break;
+        case 0x04: legacy_keyboard_echo("3"); break;
+        case 0x05: legacy_keyboard_echo("4"); break;
+        case 0x06: legacy_keyboard_echo("5"); break;
+        case 0x07: legacy_keyboard_echo("6"); break;
+        case 0x08: legacy_keyboard_echo("7"); break;
+        case 0x09: legacy_keyboard_echo("8"); break;
+        case 0x0A: legacy_keyboard_echo("9"); break;
+        case 0x0B: legacy_keyboard_echo("0"); break;
+        case 0x0C: legacy_keyboard_echo("-"); break;
+        case 0x0D: legacy_keyboard_echo("+"); break;
+        case 0x0E: legacy_keyboard_echo("\b"); break;
+        case 0x0F: legacy_keyboard_echo("    "); break;
+        case 0x10: legacy_keyboard_echo("Q"); break;
+        case 0x11: legacy_keyboard_echo("W"); break;
+        case 0x12: legacy_keyboard_echo("E"); break;
+        case 0x13: legacy_keyboard_echo("R"); break;
+        case 0x14: legacy_keyboard_echo("T"); break;
+        case 0x15: legacy_keyboard_echo("Y"); break;
+        case 0x16: legacy_keyboard_echo("U"); break;
+        case 0x17: legacy_keyboard_echo("I"); break;
+        case 0x18: legacy_keyboard_echo("O"); break;
+        case 0x19: legacy_keyboard_echo("P"); break;
+        case 0x1A: legacy_keyboard_echo("["); break;
+        case 0x1B: legacy_keyboard_echo("]"); break;
+        case 0x1C: legacy_keyboard_echo("\n"); break;
+        case 0x1D: legacy_keyboard_echo("LCtrl"); break;
+        case 0x1E: legacy_keyboard_echo("A"); break;
+        case 0x1F: legacy_keyboard_echo("S"); break;
+        case 0x20: legacy_keyboard_echo("D"); break;
+        case 0x21: legacy_keyboard_echo("F"); break;
+        case 0x22: legacy_keyboard_echo("G"); break;
+        case 0x23: legacy_keyboard_echo("H"); break;
+        case 0x24: legacy_keyboard_echo("J"); break;
+        case 0x25: legacy_keyboard_echo("K"); break;
+        case 0x26: legacy_keyboard_echo("L"); break;
+        case 0x27: legacy_keyboard_echo(";"); break;
+        case 0x28: legacy_keyboard_echo("'"); break;
+        case 0x29: legacy_keyboard_echo("`"); break;
+        case 0x2A: legacy_keyboard_echo("LShift"); break;
+        case 0x2B: legacy_keyboard_echo("\\"); break;
+        case 0x2C: legacy_keyboard_echo("Z"); break;
+        case 0x2D: legacy_keyboard_echo("X"); break;
+        case 0x2E: legacy_keyboard_echo("C"); break;
+        case 0x2F: legacy_keyboard_echo("V"); break;
+        case 0x30: legacy_keyboard_echo("B"); break;
+        case 0x31: legacy_keyboard_echo("N"); break;
+        case 0x32: legacy_keyboard_echo("M"); break;
+        case 0x33: legacy_keyboard_echo(","); break;
+        case 0x34: legacy_keyboard_echo("."); break;
+        case 0x35: legacy_keyboard_echo("/"); break;
+        case 0x36: legacy_keyboard_echo("Rshift"); break;
+        case 0x37: legacy_keyboard_echo("Keypad *"); break;
+        case 0x38: legacy_keyboard_echo("LAlt"); break;
+        case 0x39: legacy_keyboard_echo(" "); break;
+        default:
+            break;
+    }
+}
+
+#define BENCH_KEYBOARD_PRESSES 16 /* two scancodes each, well below SCANCODE_BUFFER_SIZE */
+#define BENCH_SC_LSHIFT 0x2a
+#define BENCH_SC_LSHIFT_RELEASE 0xaa
+
+/*
+ * Cycles for BENCH_KEYBOARD_PRESSES Shift presses and releases through one
+ * IRQ1 path, with interrupts off as in the handler. The port read both
+ * handlers start with is left out. Shift decodes to no key, so what the
+ * new path queues never reaches the shell.
+ */
+static uint64_t keyboard_irq_cycles(void (*handler)(uint8_t)) {
+    uint64_t cycles = 0;
+    for (int i = 0; i < BENCH_KEYBOARD_PRESSES; i++) {
+        uint32_t flags = irq_save();
+        uint64_t start = rdtsc();
+        handler(BENCH_SC_LSHIFT);
+        handler(BENCH_SC_LSHIFT_RELEASE);
+        cycles += rdtsc() - start;
+        irq_restore(flags);
+    }
+    return cycles;
+}
+
+void bench_keyboard() {
+    if (!cpu_has(CPU_FEATURE_TSC)) {
+        print_string("Keyboard benchmark needs rdtsc\n");
+        return;
+    }
+    clear_screen();
+    uint64_t legacy = keyboard_irq_cycles(legacy_keyboard_irq);
+    clear_screen();
+    uint64_t ring = keyboard_irq_cycles(keyboard_queue_scancode);
+
+    print_string("IRQ1 handler benchmark (cycles/scancode)\n  legacy switch and echo: ");
+    print_int((uint32_t) udiv64_32(legacy, 2 * BENCH_KEYBOARD_PRESSES));
+    print_string("\n  scancode ring: ");
+    print_int((uint32_t) udiv64_32(ring, 2 * BENCH_KEYBOARD_PRESSES));
+    print_nl();
+}
+
+#define BENCH_MEMORY_MAX_SIZE (64 * 1024)
+#define BENCH_MEMORY_BYTES (1024 * 1024)  /* per size and implementation */
+
+static uint8_t bench_src[BENCH_MEMORY_MAX_SIZE + 64] __attribute__((aligned(16)));
+static uint8_t bench_dst[BENCH_MEMORY_MAX_SIZE + 64] __attribute__((aligned(16)));
+
+/* The byte loop memory_copy used before kstring */
+static void *byte_loop_copy(void *dest, const void *src, size_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+    return dest;
+}
+
+static void *memset_as_copy(void *dest, const void *src, size_t n) {
+    (void) src;
+    return memset(dest, 0x5a, n);
+}
+
+static void *memmove_overlapping(void *dest, const void *src, size_t n) {
+    (void) src;
+    return memmove((uint8_t *) dest + 1, dest, n);
+}
+
+/* Prints a value given in hundredths as "x.yy" */
+static void print_hundredths(uint32_t value) {
+    print_int(value / 100);
+    print_string(value % 100 < 10 ? ".0" : ".");
+    print_int(value % 100);
+}
+
+static void bench_memory_op(char *name, void *(*op)(void *, const void *, size_t)) {
+    print_string(name);
+    for (uint32_t size = 16; size <= BENCH_MEMORY_MAX_SIZE; size *= 4) {
+        uint32_t iterations = BENCH_MEMORY_BYTES / size;
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < iterations; i++) {
+            op(bench_dst, bench_src, size);
+        }
+        uint32_t cycles = (uint32_t) (rdtsc() - start);
+        print_string(" ");
+        print_hundredths(BENCH_MEMORY_BYTES * 100 / (cycles ? cycles : 1));
+    }
+    print_nl();
+}
+
+void bench_memory() {
+    if (!cpu_has(CPU_FEATURE_TSC)) {
+        print_string("Memory benchmark needs rdtsc\n");
+        return;
+    }
+
+    print_string("Memory benchmark (bytes/cycle, 16 B .. 64 KB)\n");
+    bench_memory_op("  byte loop ", byte_loop_copy);
+    bench_memory_op("  rep movsd ", memcpy_rep);
+    if (cpu_has(CPU_FEATURE_SSE2)) {
+        bench_memory_op("  sse2      ", memcpy_sse2);
+    }
+    bench_memory_op("  memset    ", memset_as_copy);
+    bench_memory_op("  memmove   ", memmove_overlapping);
+}
+
+#define BENCH_PMM_RUNS 1024
+
+static uint32_t bench_pages[BENCH_PMM_RUNS];
+
+/* Allocates then frees BENCH_PMM_RUNS runs of the given orders, printing cycles per call */
+static void bench_pmm_orders(char *name, int min_order, int max_order) {
+    uint32_t count = 0;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_PMM_RUNS; i++) {
+        bench_pages[i] = pmm_alloc_pages(min_order + i % (max_order - min_order + 1));
+        if (bench_pages[i]) count++;
+    }
+    uint32_t alloc_cycles = (uint32_t) (rdtsc() - start);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_PMM_RUNS; i++) {
+        pmm_free_pages(bench_pages[i], min_order + i % (max_order - min_order + 1));
+    }
+    uint32_t free_cycles = (uint32_t) (rdtsc() - start);
+
+    print_string(name);
+    print_string(" alloc ");
+    print_int(alloc_cycles / BENCH_PMM_RUNS);
+    print_string(", free ");
+    print_int(free_cycles / BENCH_PMM_RUNS);
+    if (count < BENCH_PMM_RUNS) {
+        print_string(" (");
+        print_int(BENCH_PMM_RUNS - count);
+        print_string(" failed)");
+    }
+    print_nl();
+}
+
+void bench_pmm() {
+    if (!cpu_has(CPU_FEATURE_TSC)) {
+        print_string("Page allocator benchmark needs rdtsc\n");
+        return;
+    }
+
+    print_string("Page allocator benchmark (cycles/call, ");
+    print_int(pmm_free_frames() / 256);
+    print_string(" MB free)\n");
+    bench_pmm_orders("  order 0    ", 0, 0);
+    bench_pmm_orders("  order 0..5 ", 0, 5);
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_PMM_RUNS; i++) {
+        mem_free(mem_alloc(64 + (i & 7) * 24));
+    }
+    print_string("  heap alloc+free ");
+    print_int((uint32_t) (rdtsc() - start) / BENCH_PMM_RUNS);
+    print_nl();
+}
+
+#define BENCH_PAGING_SIZE (8 * 1024 * 1024)
+#define BENCH_PAGING_PASSES 16
+
+/* One load per 4 KB page over BENCH_PAGING_SIZE; returns cycles per load */
+static uint32_t stride_load_cycles(volatile uint8_t *base) {
+    uint32_t pages = BENCH_PAGING_SIZE / PAGE_SIZE;
+    for (uint32_t i = 0; i < pages; i++) (void) base[i * PAGE_SIZE];  // warm the caches
+
+    uint64_t start = rdtsc();
+    for (int pass = 0; pass < BENCH_PAGING_PASSES; pass++) {
+        for (uint32_t i = 0; i < pages; i++) (void) base[i * PAGE_SIZE];
+    }
+    return (uint32_t) (rdtsc() - start) / (pages * BENCH_PAGING_PASSES);
+}
+
+void bench_paging() {
+    uint32_t pages = BENCH_PAGING_SIZE / PAGE_SIZE;
+    if (!cpu_has(CPU_FEATURE_TSC)) {
+        print_string("Paging benchmark needs rdtsc\n");
+        return;
+    }
+    if (pmm_free_frames() < 2 * pages || pmm_highest_address() < PMM_LOW_MEMORY + BENCH_PAGING_SIZE) {
+        print_string("Paging benchmark needs at least 24 MB of RAM\n");
+        return;
+    }
+    volatile uint8_t *anon = vm_alloc_anon(BENCH_PAGING_SIZE);
+    if (!anon) {
+        print_string("Paging benchmark needs paging\n");
+        return;
+    }
+
+    print_string("Paging benchmark (cycles)\n");
+
+    uint32_t faults = vm_fault_count();
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < pages; i++) anon[i * PAGE_SIZE] = 1;
+    uint32_t cycles = (uint32_t) (rdtsc() - start);
+    faults = vm_fault_count() - faults;
+    print_string("  demand-zero fault ");
+    print_int(cycles / (faults ? faults : 1));
+    print_string(" (");
+    print_int(faults);
+    print_string(" faults)\n");
+
+    // Same access pattern through 4 MB identity pages and 4 KB anonymous pages: the gap is TLB misses
+    print_string("  stride load, 4 MB pages ");
+    print_int(stride_load_cycles((volatile uint8_t *) PMM_LOW_MEMORY));
+    print_string(", 4 KB pages ");
+    print_int(stride_load_cycles(anon));
+    print_nl();
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < pages; i++) invlpg((uint32_t) anon + i * PAGE_SIZE);
+    print_string("  invlpg ");
+    print_int((uint32_t) (rdtsc() - start) / pages);
+    print_nl();
+
+    vm_release_anon((void *) anon, BENCH_PAGING_SIZE);
+}
+
+#define BENCH_SCORE_MAX 4096
+#define BENCH_SCORE_PROCESSES (64 * 1024) /* scored per table size and implementation */
+
+/* The array-of-structs layout and dividing scorer the scheduler used before process_table */
+typedef struct {
+    int pid;
+    uint32_t cpu_time;
+    uint32_t wait_time;
+    int priority;
+    bool active;
+} bench_process_t;
+
+static bench_process_t bench_processes[BENCH_SCORE_MAX];
+static uint32_t bench_cpu_time[BENCH_SCORE_MAX] __attribute__((aligned(16)));
+static uint32_t bench_wait_time[BENCH_SCORE_MAX] __attribute__((aligned(16)));
+static int32_t bench_priority[BENCH_SCORE_MAX] __attribute__((aligned(16)));
+static uint32_t bench_active[BENCH_SCORE_MAX / 32];
+static int32_t bench_activations[BENCH_SCORE_MAX] __attribute__((aligned(16)));
+
+static int legacy_pick(bench_process_t *table, int count) {
+    int best = -1, best_activation = 0;
+    for (int i = 0; i < count; i++) {
+        if (!table[i].active) continue;
+        int features[4] = {table[i].cpu_time / 200, table[i].wait_time / 100, table[i].priority * 2, 1};
+        int activation = 0;
+        for (int j = 0; j < 4; j++) activation += features[j] * nn.weights[j];
+        if (best < 0 || activation > best_activation) {
+            best = i;
+            best_activation = activation;
+        }
+    }
+    return best;
+}
+
+void bench_nn_score() {
+    if (!cpu_has(CPU_FEATURE_TSC)) {
+        print_string("Scoring benchmark needs rdtsc\n");
+        return;
+    }
+
+    uint32_t seed = 12345;
+    for (int i = 0; i < BENCH_SCORE_MAX; i++) {
+        seed = seed * 1103515245 + 12345;
+        bench_cpu_time[i] = bench_processes[i].cpu_time = seed >> 20;
+        seed = seed * 1103515245 + 12345;
+        bench_wait_time[i] = bench_processes[i].wait_time = seed >> 20;
+        bench_priority[i] = bench_processes[i].priority = i % 8;
+        bench_processes[i].active = true;
+        bench_active[i >> 5] |= 1u << (i & 31);
+    }
+    ProcessTable table = {bench_cpu_time, bench_wait_time, bench_priority, bench_active, 0};
+
+    print_string("Process scoring benchmark (cycles/process, legacy vs batch)\n");
+    for (int count = 2; count <= BENCH_SCORE_MAX; count *= 2) {
+        int repeats = BENCH_SCORE_PROCESSES / count;
+        int legacy_best = 0, batch_best = 0;
+
+        uint64_t start = rdtsc();
+        for (int r = 0; r < repeats; r++) legacy_best = legacy_pick(bench_processes, count);
+        uint32_t legacy = (uint32_t) (rdtsc() - start);
+
+        table.count = count;
+        start = rdtsc();
+        for (int r = 0; r < repeats; r++) batch_best = nn_score_batch(&table, bench_activations);
+        uint32_t batch = (uint32_t) (rdtsc() - start);
+
+        print_string("  ");
+        print_int(count);
+        print_string(": ");
+        print_hundredths(legacy * 100 / BENCH_SCORE_PROCESSES);
+        print_string(" vs ");
+        print_hundredths(batch * 100 / BENCH_SCORE_PROCESSES);
+        if (legacy_best != batch_best) print_string(" (argmax differs!)");
+        print_nl();
+    }
+}
+
+#define BENCH_KTIMER_MIN 1024
+#define BENCH_KTIMER_MAX 32768
+#define BENCH_KTIMER_TICKS 65536
+
+static ktimer_wheel_t bench_wheel;
+static uint32_t bench_ktimer_fired;
+static uint32_t bench_ktimer_wrong; /* fired on a tick other than their expiry */
+
+static void bench_ktimer_callback(ktimer_t *timer, void *arg) {
+    (void) arg;
+    bench_ktimer_fired++;
+    if (bench_wheel.ticks - 1 != timer->expires) bench_ktimer_wrong++;
+}
+
+typedef struct {
+    uint64_t add;    /* cycles for count adds */
+    uint64_t cancel; /* for count / 2 cancels */
+    uint64_t ticks;  /* for BENCH_KTIMER_TICKS ticks, expired callbacks included */
+    uint32_t expected;
+} ktimer_stress_t;
+
+/*
+ * Fills a private wheel with count timers spread over the first three
+ * levels, cancels every other one, then ticks it BENCH_KTIMER_TICKS times.
+ * False if the timers couldn't be allocated.
+ */
+static bool ktimer_stress(uint32_t count, ktimer_stress_t *result) {
+    ktimer_t *timers = mem_alloc(count * sizeof(ktimer_t));
+    if (!timers) return false;
+
+    ktimer_wheel_init(&bench_wheel, 0);
+    bench_ktimer_fired = bench_ktimer_wrong = 0;
+    uint32_t seed = 12345;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t range = 1u << (KTIMER_LEVEL0_BITS + KTIMER_LEVEL_BITS * (i % 3));
+        ktimer_init(&timers[i], bench_ktimer_callback, 0);
+        ktimer_wheel_add(&bench_wheel, &timers[i], 1 + (seed >> 8) % range);
+    }
+    result->add = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < count; i += 2) ktimer_wheel_cancel(&bench_wheel, &timers[i]);
+    result->cancel = rdtsc() - start;
+
+    result->expected = 0;
+    for (uint32_t i = 1; i < count; i += 2) {
+        if (timers[i].expires < BENCH_KTIMER_TICKS) result->expected++;
+    }
+
+    start = rdtsc();
+    for (uint32_t tick = 0; tick < BENCH_KTIMER_TICKS; tick++) {
+        if (ktimer_wheel_advance(&bench_wheel, tick)) ktimer_wheel_run_expired(&bench_wheel);
+    }
+    result->ticks = rdtsc() - start;
+
+    mem_free(timers);
+    return true;
+}
+
+void bench_ktimer() {
+    if (!cpu_has(CPU_FEATURE_TSC)) {
+        print_string("Timer wheel benchmark needs rdtsc\n");
+        return;
+    }
+
+    print_string("Timer wheel benchmark (cycles/call, per tick over ");
+    print_int(BENCH_KTIMER_TICKS);
+    print_string(" ticks)\n");
+    for (uint32_t count = BENCH_KTIMER_MIN; count <= BENCH_KTIMER_MAX; count *= 2) {
+        ktimer_stress_t result;
+        if (!ktimer_stress(count, &result)) {
+            print_string("  out of memory\n");
+            return;
+        }
+        print_string("  ");
+        print_int(count);
+        print_string(" timers: add ");
+        print_int((uint32_t) udiv64_32(result.add, count));
+        print_string(", cancel ");
+        print_int((uint32_t) udiv64_32(result.cancel, count / 2));
+        print_string(", tick ");
+        print_int((uint32_t) udiv64_32(result.ticks, BENCH_KTIMER_TICKS));
+        if (bench_ktimer_fired != result.expected || bench_ktimer_wrong) {
+            print_string(" (fired ");
+            print_int(bench_ktimer_fired);
+            print_string(" of ");
+            print_int(result.expected);
+            print_string(", ");
+            print_int(bench_ktimer_wrong);
+            print_string(" on the wrong tick!)");
+        }
+        print_nl();
+    }
+}
+
+#define BENCH_DISK_SYNC_SECTORS 1024 /* 512 KB read one sector per call */
+#define BENCH_DISK_SEQ_REQUESTS 256 /* of 64 KB: 16 MB */
+#define BENCH_DISK_SEQ_SECTORS 128
+#define BENCH_DISK_PIO_REQUESTS 32
+#define BENCH_DISK_RANDOM_REQUESTS 2048 /* of 4 KB */
+#define BENCH_DISK_RANDOM_SECTORS 8
+#define BENCH_DISK_DEPTH 8
+
+static wait_queue_t disk_bench_wait = WAIT_QUEUE_INIT;
+static ata_request_t disk_requests[BENCH_DISK_DEPTH];
+static bool disk_busy[BENCH_DISK_DEPTH];
+
+static void disk_bench_done(ata_request_t *request) {
+    (void) request;
+    wake_up(&disk_bench_wait);
+}
+
+/* True once a queued request has finished, or nothing is queued */
+static bool disk_slot_finished(uint32_t depth) {
+    bool queued = false;
+    for (uint32_t d = 0; d < depth; d++) {
+        if (!disk_busy[d]) continue;
+        if (disk_requests[d].status != ATA_PENDING) return true;
+        queued = true;
+    }
+    return !queued;
+}
+
+/*
+ * Reads count requests of sectors each from the scratch drive, keeping
+ * depth of them queued: in order from LBA 0, or at random aligned LBAs.
+ * Returns the cycles taken, or 0 if a read failed.
+ */
+static uint64_t disk_reads(uint8_t *buffer, uint32_t count, uint32_t sectors, uint32_t depth, bool random) {
+    uint32_t positions = ata_drive(BENCH_DISK_DRIVE)->sectors / sectors;
+    uint32_t seed = 12345;
+    uint32_t submitted = 0, finished = 0;
+    bool failed = false;
+    for (uint32_t d = 0; d < depth; d++) disk_busy[d] = false;
+
+    uint64_t start = rdtsc();
+    while (finished < count) {
+        for (uint32_t d = 0; d < depth; d++) {
+            ata_request_t *request = &disk_requests[d];
+            if (disk_busy[d] && request->status != ATA_PENDING) {
+                disk_busy[d] = false;
+                finished++;
+                if (request->status != ATA_OK) failed = true;
+            }
+            if (disk_busy[d] || submitted == count) continue;
+
+            uint32_t position = submitted % positions;
+            if (random) {
+                seed = seed * 1103515245 + 12345;
+                position = (seed >> 8) % positions;
+            }
+            *request = (ata_request_t) {
+                .drive = BENCH_DISK_DRIVE, .lba = position * sectors, .count = sectors,
+                .buffer = buffer + d * sectors * ATA_SECTOR_SIZE, .done = disk_bench_done
+            };
+            disk_busy[d] = true;
+            submitted++;
+            ata_submit(request);
+        }
+        wait_event(&disk_bench_wait, disk_slot_finished(depth));
+    }
+    return failed ? 0 : rdtsc() - start;
+}
+
+static uint64_t disk_sync_sectors(uint8_t *buffer) {
+    uint64_t start = rdtsc();
+    for (uint32_t lba = 0; lba < BENCH_DISK_SYNC_SECTORS; lba++) {
+        if (ata_read(BENCH_DISK_DRIVE, lba, 1, buffer) != ATA_OK) return 0;
+    }
+    return rdtsc() - start;
+}
+
+/* "name: N KB/s, M us/request" */
+static void print_disk_result(char *name, uint32_t requests, uint32_t sectors, uint64_t cycles) {
+    print_string(name);
+    uint32_t khz = clock_tsc_khz();
+    uint32_t us = khz ? (uint32_t) udiv64_32(cycles * 1000, khz) : 0;
+    if (cycles == 0 || us == 0) {
+        print_string(" failed\n");
+        return;
+    }
+    uint32_t kb = requests * sectors / 2;
+    print_int((uint32_t) udiv64_32((uint64_t) kb * 1000000, us));
+    print_string(" KB/s, ");
+    print_int(us / requests);
+    print_string(" us/request\n");
+}
+
+void bench_disk() {
+    if (!cpu_has(CPU_FEATURE_TSC) || !ata_drive(BENCH_DISK_DRIVE)) {
+        print_string("Disk benchmark needs rdtsc and the scratch disk\n");
+        return;
+    }
+    uint8_t *buffer = mem_alloc(BENCH_DISK_DEPTH * BENCH_DISK_SEQ_SECTORS * ATA_SECTOR_SIZE);
+    if (!buffer) return;
+
+    print_string("Disk benchmark (ata");
+    print_int(BENCH_DISK_DRIVE);
+    print_string(", ");
+    print_int(BENCH_DISK_DEPTH);
+    print_string(" queued)\n");
+    print_disk_result("  sync 512 B       ", BENCH_DISK_SYNC_SECTORS, 1, disk_sync_sectors(buffer));
+
+    bool dma = ata_dma_enabled();
+    ata_set_dma(false);
+    print_disk_result("  seq 64 KB PIO    ", BENCH_DISK_PIO_REQUESTS, BENCH_DISK_SEQ_SECTORS,
+                      disk_reads(buffer, BENCH_DISK_PIO_REQUESTS, BENCH_DISK_SEQ_SECTORS, BENCH_DISK_DEPTH, false));
+    ata_set_dma(dma);
+
+    print_disk_result("  seq 64 KB        ", BENCH_DISK_SEQ_REQUESTS, BENCH_DISK_SEQ_SECTORS,
+                      disk_reads(buffer, BENCH_DISK_SEQ_REQUESTS, BENCH_DISK_SEQ_SECTORS, BENCH_DISK_DEPTH, false));
+    print_disk_result("  random 4 KB, 1   ", BENCH_DISK_RANDOM_REQUESTS, BENCH_DISK_RANDOM_SECTORS,
+                      disk_reads(buffer, BENCH_DISK_RANDOM_REQUESTS, BENCH_DISK_RANDOM_SECTORS, 1, true));
+    print_disk_result("  random 4 KB      ", BENCH_DISK_RANDOM_REQUESTS, BENCH_DISK_RANDOM_SECTORS,
+                      disk_reads(buffer, BENCH_DISK_RANDOM_REQUESTS, BENCH_DISK_RANDOM_SECTORS, BENCH_DISK_DEPTH, true));
+    mem_free(buffer);
+}
+
+#define BENCH_BCACHE_COLD_BLOCKS 2048 /* 8 MB from each of two untouched ranges */
+#define BENCH_BCACHE_READAHEAD_START 4096
+#define BENCH_BCACHE_PLAIN_START 8192
+#define BENCH_BCACHE_HOT_BLOCKS 16
+#define BENCH_BCACHE_HOT_READS 20000
+#define BENCH_BCACHE_HOT_BYTES 512
+
+/* Reads BENCH_BCACHE_COLD_BLOCKS blocks in order through the cache; cycles, or 0 on an error */
+static uint64_t bcache_cold_reads(uint32_t first, bool readahead) {
+    bcache_set_readahead(readahead);
+    uint64_t start = rdtsc();
+    for (uint32_t block = first; block < first + BENCH_BCACHE_COLD_BLOCKS; block++) {
+        bcache_buffer_t *buffer = bcache_read(BENCH_DISK_DRIVE, block);
+        if (!buffer) {
+            bcache_set_readahead(true);
+            return 0;
+        }
+        bcache_release(buffer);
+    }
+    uint64_t cycles = rdtsc() - start;
+    bcache_set_readahead(true);
+    return cycles;
+}
+
+/* Small reads spread over a few cached blocks, like repeated metadata lookups; cycles, or 0 on an error */
+static uint64_t bcache_hot_reads(uint8_t *buffer) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_BCACHE_HOT_READS; i++) {
+        uint64_t offset = (uint64_t) (i % BENCH_BCACHE_HOT_BLOCKS) * BCACHE_BLOCK_SIZE + (i & 7) * BENCH_BCACHE_HOT_BYTES;
+        if (bcache_read_bytes(BENCH_DISK_DRIVE, offset, buffer, BENCH_BCACHE_HOT_BYTES) != ATA_OK) return 0;
+    }
+    return rdtsc() - start;
+}
+
+static uint64_t memcpy_reads(uint8_t *buffer, uint8_t *source) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_BCACHE_HOT_READS; i++) {
+        memcpy(buffer, source + (i & 7) * BENCH_BCACHE_HOT_BYTES, BENCH_BCACHE_HOT_BYTES);
+    }
+    return rdtsc() - start;
+}
+
+void bench_bcache() {
+    if (!cpu_has(CPU_FEATURE_TSC) || !ata_drive(BENCH_DISK_DRIVE)) {
+        print_string("Block cache benchmark needs rdtsc and the scratch disk\n");
+        return;
+    }
+    uint8_t *buffer = mem_alloc(BCACHE_BLOCK_SIZE);
+    uint8_t *source = mem_alloc(BCACHE_BLOCK_SIZE);
+    if (!buffer || !source) {
+        mem_free(source);
+        mem_free(buffer);
+        return;
+    }
+
+    print_string("Block cache benchmark (4 KB blocks)\n");
+    print_disk_result("  cold, read-ahead ", BENCH_BCACHE_COLD_BLOCKS, BCACHE_SECTORS_PER_BLOCK,
+                      bcache_cold_reads(BENCH_BCACHE_READAHEAD_START, true));
+    print_disk_result("  cold, no read-ahead ", BENCH_BCACHE_COLD_BLOCKS, BCACHE_SECTORS_PER_BLOCK,
+                      bcache_cold_reads(BENCH_BCACHE_PLAIN_START, false));
+
+    uint64_t hot = bcache_hot_reads(buffer);
+    uint64_t copy = memcpy_reads(buffer, source);
+    print_string("  hot 512 B read ");
+    print_int((uint32_t) udiv64_32(hot, BENCH_BCACHE_HOT_READS));
+    print_string(" cycles, memcpy ");
+    print_int((uint32_t) udiv64_32(copy, BENCH_BCACHE_HOT_READS));
+    print_nl();
+    mem_free(source);
+    mem_free(buffer);
+    bcache_report();
+}
+
+#define BENCH_INITRD_LOOKUPS 20000
+#define BENCH_INITRD_READ_PASSES 4
+#define BENCH_INITRD_READ_MAX 4096 /* bytes read per file */
+#define BENCH_INITRD_STRIDE 7919 /* prime step through the files, so lookups don't follow image order */
+
+/* ustar: 512-byte headers with the name at 0 and the size in octal at 124, data padded to 512 */
+#define TAR_BLOCK 512
+#define TAR_NAME_SIZE 100
+#define TAR_SIZE_OFFSET 124
+#define TAR_SIZE_DIGITS 11
+#define TAR_TYPE_OFFSET 156
+#define TAR_MAGIC_OFFSET 257
+
+static uint8_t *tar_image;
+static uint32_t tar_size;
+static int tar_order;
+
+static uint32_t tar_padded(uint32_t size) {
+    return (size + TAR_BLOCK - 1) & ~(TAR_BLOCK - 1);
+}
+
+/* The same files as a tar archive, the layout a linear scan would walk; false if it doesn't fit */
+static bool tar_build() {
+    uint32_t size = 2 * TAR_BLOCK;
+    for (uint32_t i = 0; i < initrd_file_count(); i++) {
+        size += TAR_BLOCK + tar_padded(initrd_file(i)->size);
+    }
+    tar_order = pmm_order_for(size);
+    tar_image = tar_order <= PMM_MAX_ORDER ? (uint8_t *) pmm_alloc_pages(tar_order) : 0;
+    if (!tar_image) return false;
+    memset(tar_image, 0, size);
+    tar_size = size;
+
+    uint8_t *header = tar_image;
+    for (uint32_t i = 0; i < initrd_file_count(); i++) {
+        const initrd_file_t *file = initrd_file(i);
+        const char *path = initrd_path(file);
+        for (int c = 0; c < TAR_NAME_SIZE - 1 && path[c] != '\0'; c++) header[c] = path[c];
+        for (int digit = TAR_SIZE_DIGITS - 1, value = file->size; digit >= 0; digit--, value >>= 3) {
+            header[TAR_SIZE_OFFSET + digit] = '0' + (value & 7);
+        }
+        header[TAR_TYPE_OFFSET] = '0';
+        memcpy(header + TAR_MAGIC_OFFSET, "ustar", 6);
+        const void *data;
+        uint32_t length = initrd_read(file, 0, file->size, &data);
+        memcpy(header + TAR_BLOCK, data, length);
+        header += TAR_BLOCK + tar_padded(file->size);
+    }
+    return true;
+}
+
+static void tar_free() {
+    pmm_free_pages((uint32_t) tar_image, tar_order);
+    tar_image = 0;
+}
+
+/* Header of path, walking the archive from the start; 0 if it isn't there */
+static const uint8_t *tar_find(const char *path, uint32_t *size) {
+    for (uint32_t offset = 0; offset + TAR_BLOCK <= tar_size;) {
+        const uint8_t *header = tar_image + offset;
+        if (header[0] == '\0') return 0;
+        uint32_t length = 0;
+        for (int digit = 0; digit < TAR_SIZE_DIGITS; digit++) length = length << 3 | (header[TAR_SIZE_OFFSET + digit] - '0');
+
+        int c = 0;
+        while (c < TAR_NAME_SIZE && header[c] == (uint8_t) path[c] && path[c] != '\0') c++;
+        if (c == TAR_NAME_SIZE || (header[c] == '\0' && path[c] == '\0')) {
+            *size = length;
+            return header;
+        }
+        offset += TAR_BLOCK + tar_padded(length);
+    }
+    return 0;
+}
+
+static const char *bench_initrd_path(uint32_t i) {
+    return initrd_path(initrd_file(i * BENCH_INITRD_STRIDE % initrd_file_count()));
+}
+
+/* Cycles for BENCH_INITRD_LOOKUPS opens through the hash index, or tar scans; 0 if one missed */
+static uint64_t initrd_lookups(bool tar) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_INITRD_LOOKUPS; i++) {
+        const char *path = bench_initrd_path(i);
+        uint32_t size;
+        if (tar ? !tar_find(path, &size) : !initrd_open(path)) return 0;
+    }
+    return rdtsc() - start;
+}
+
+static uint32_t sum_words(const uint32_t *words, uint32_t bytes) {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < bytes / 4; i++) sum += words[i];
+    return sum;
+}
+
+/*
+ * Every file BENCH_INITRD_READ_PASSES times, opened by path and its first
+ * BENCH_INITRD_READ_MAX bytes summed: in place for the initrd, copied out
+ * into buffer for tar as a read() would.
+ * Cycles, or 0 if a file was missing; *bytes gets the total read.
+ */
+static uint64_t initrd_reads(bool tar, uint8_t *buffer, uint32_t *bytes) {
+    uint32_t sum = 0;
+    *bytes = 0;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_INITRD_READ_PASSES * initrd_file_count(); i++) {
+        const char *path = bench_initrd_path(i);
+        const void *data;
+        uint32_t size;
+        if (tar) {
+            const uint8_t *header = tar_find(path, &size);
+            if (!header) return 0;
+            if (size > BENCH_INITRD_READ_MAX) size = BENCH_INITRD_READ_MAX;
+            data = memcpy(buffer, header + TAR_BLOCK, size);
+        } else {
+            const initrd_file_t *file = initrd_open(path);
+            if (!file) return 0;
+            size = initrd_read(file, 0, BENCH_INITRD_READ_MAX, &data);
+        }
+        sum += sum_words(data, size);
+        *bytes += size;
+    }
+    uint64_t cycles = rdtsc() - start;
+    asm volatile("" : : "r" (sum));
+    return cycles;
+}
+
+void bench_initrd() {
+    if (!cpu_has(CPU_FEATURE_TSC) || initrd_file_count() == 0) {
+        print_string("Initrd benchmark needs rdtsc and an initrd\n");
+        return;
+    }
+    uint8_t *buffer = mem_alloc(BENCH_INITRD_READ_MAX);
+    if (!buffer || !tar_build()) {
+        if (buffer) mem_free(buffer);
+        return;
+    }
+
+    print_string("Initrd benchmark (");
+    print_int(initrd_file_count());
+    print_string(" files, cycles per lookup)\n  hash index ");
+    print_int((uint32_t) udiv64_32(initrd_lookups(false), BENCH_INITRD_LOOKUPS));
+    print_string(", tar scan ");
+    print_int((uint32_t) udiv64_32(initrd_lookups(true), BENCH_INITRD_LOOKUPS));
+    print_nl();
+
+    uint32_t bytes;
+    uint64_t cycles = initrd_reads(false, buffer, &bytes);
+    print_string("  open+read in place ");
+    print_int(bytes ? (uint32_t) udiv64_32(cycles * 100, bytes) : 0);
+    print_string(" cycles/100 B, tar scan+copy ");
+    cycles = initrd_reads(true, buffer, &bytes);
+    print_int(bytes ? (uint32_t) udiv64_32(cycles * 100, bytes) : 0);
+    print_nl();
+    tar_free();
+    mem_free(buffer);
+}
+
+#define BENCH_SMP_CHUNK 4096 /* xorshift rounds per work unit */
+#define BENCH_SMP_PRIORITY 4
+
+/* Each worker's count on its own cache line */
+typedef struct {
+    volatile uint32_t units;
+} __attribute__((aligned(64))) smp_counter_t;
+
+static smp_counter_t smp_counters[SMP_MAX_CPUS];
+static volatile uint64_t smp_deadline;
+static volatile uint32_t smp_running;
+static wait_queue_t smp_done = WAIT_QUEUE_INIT; /* woken by the last worker */
+
+/* Pure register work: nothing shared but the deadline, so it should scale with the CPUs */
+static void smp_worker(void *arg) {
+    smp_counter_t *counter = arg;
+    uint32_t x = (uint32_t) arg | 1;
+    while (ktime_get() < smp_deadline) {
+        for (int i = 0; i < BENCH_SMP_CHUNK; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+        }
+        counter->units++;
+    }
+    asm volatile("" : : "r" (x));
+    if (__atomic_sub_fetch(&smp_running, 1, __ATOMIC_SEQ_CST) == 0) wake_up(&smp_done);
+}
+
+/*
+ * Work units done by workers unbound threads in ticks; the scheduler
+ * spreads them over the idle CPUs. *cycles gets the wall time.
+ * 0 if a thread couldn't be created.
+ */
+static uint32_t smp_run(uint32_t workers, uint32_t ticks, uint64_t *cycles) {
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) smp_counters[i].units = 0;
+    smp_running = workers;
+    smp_deadline = ktime_get() + (uint64_t) ticks * NSEC_PER_TICK;
+
+    uint64_t start = rdtsc();
+    uint32_t flags = irq_save();
+    bool created = true;
+    for (uint32_t i = 0; i < workers; i++) {
+        if (!thread_create_on("smp bench", smp_worker, (void *) &smp_counters[i], BENCH_SMP_PRIORITY, SCHED_ANY_CPU)) {
+            __atomic_sub_fetch(&smp_running, 1, __ATOMIC_SEQ_CST);
+            created = false;
+        }
+    }
+    irq_restore(flags);
+
+    wait_event(&smp_done, smp_running == 0);
+    *cycles = rdtsc() - start;
+    if (!created) return 0;
+
+    uint32_t units = 0;
+    for (uint32_t i = 0; i < workers; i++) units += smp_counters[i].units;
+    return units;
+}
+
+void bench_smp() {
+    if (!cpu_has(CPU_FEATURE_TSC)) {
+        print_string("SMP benchmark needs rdtsc\n");
+        return;
+    }
+    uint32_t cpus = smp_cpu_count();
+    uint64_t cycles;
+    uint32_t one = smp_run(1, BENCH_DURATION_TICKS, &cycles);
+    uint32_t all = smp_run(cpus, BENCH_DURATION_TICKS, &cycles);
+
+    print_string("SMP benchmark (");
+    print_int(cpus);
+    print_string(" CPUs, CPU-bound work units per second)\n  1 thread ");
+    print_int(one / (BENCH_DURATION_TICKS / 100));
+    print_string(", ");
+    print_int(cpus);
+    print_string(" threads ");
+    print_int(all / (BENCH_DURATION_TICKS / 100));
+    print_string(", speedup ");
+    print_hundredths(one ? all * 100 / one : 0);
+    print_nl();
+}
+
+#define SUITE_TSC_SAMPLES 1000
+#define SUITE_LOOP_ITERATIONS 100000
+#define SUITE_TIMER_TICKS 25
+#define SUITE_KEYBOARD_IRQS 32
+#define SUITE_SWITCHES 1000 /* handoffs per thread */
+#define SUITE_SWITCH_TIMEOUT_TICKS 300
+#define SUITE_PRINT_LINES 500
+#define SUITE_ALLOC_PAIRS 10000
+#define SUITE_SCORE_CALLS 1000
+#define SUITE_SMP_TICKS 50
+
+/* i8042: a byte written after this command comes back as keyboard data and raises IRQ1 */
+#define I8042_STATUS_PORT 0x64
+#define I8042_INPUT_FULL 0x02
+#define I8042_WRITE_KEYBOARD_OUTPUT 0xd2
+#define SCANCODE_ESC_RELEASE 0x81
+
+static bool suite_failed;
+
+/* One machine-readable result line; cycles are the total over all iterations */
+static void suite_report(char *name, uint32_t iterations, uint64_t cycles) {
+    char line[96];
+    uint32_t high = (uint32_t) udiv64_32(cycles, 1000000000);
+    uint32_t low = (uint32_t) (cycles - (uint64_t) high * 1000000000);
+    if (high) {
+        ksnprintf(line, sizeof(line), "BENCH %s %u %u%09u\n", name, iterations, high, low);
+    } else {
+        ksnprintf(line, sizeof(line), "BENCH %s %u %u\n", name, iterations, low);
+    }
+    serial_write(line, string_length(line));
+    if (iterations == 0) suite_failed = true;
+}
+
+static void suite_loop_overhead() {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SUITE_TSC_SAMPLES; i++) (void) rdtsc();
+    suite_report("rdtsc", SUITE_TSC_SAMPLES, rdtsc() - start);
+
+    start = rdtsc();
+    for (int i = 0; i < SUITE_LOOP_ITERATIONS; i++) asm volatile("" : : : "memory");
+    suite_report("empty_loop", SUITE_LOOP_ITERATIONS, rdtsc() - start);
+}
+
+/* Entry-to-handler cycles as irq_handler charges them, over whatever arrived meanwhile */
+static void suite_report_irq_entry(char *name, uint8_t vector, irq_stats_t *before) {
+    irq_stats_t after = irq_stats[vector];
+    suite_report(name, after.count - before->count, after.entry_cycles - before->entry_cycles);
+}
+
+static void suite_irq_latency() {
+    irq_stats_t before = irq_stats[IRQ0];
+    uint32_t start = system_ticks;
+    while (system_ticks - start < SUITE_TIMER_TICKS) asm volatile("pause");
+    suite_report_irq_entry("irq0_entry", IRQ0, &before);
+
+    before = irq_stats[IRQ1];
+    for (int i = 0; i < SUITE_KEYBOARD_IRQS; i++) {
+        uint32_t count = irq_stats[IRQ1].count;
+        while (port_byte_in(I8042_STATUS_PORT) & I8042_INPUT_FULL);
+        port_byte_out(I8042_STATUS_PORT, I8042_WRITE_KEYBOARD_OUTPUT);
+        while (port_byte_in(I8042_STATUS_PORT) & I8042_INPUT_FULL);
+        port_byte_out(KEYBOARD_DATA_PORT, SCANCODE_ESC_RELEASE);
+
+        uint32_t deadline = system_ticks + 2;
+        while (irq_stats[IRQ1].count == count && system_ticks != deadline) asm volatile("pause");
+    }
+    suite_report_irq_entry("irq1_entry", IRQ1, &before);
+}
+
+/* Two threads hand a turn back and forth with thread_yield */
+static volatile uint32_t pingpong_turns;
+static volatile int pingpong_finished;
+static volatile bool pingpong_stop;
+static volatile uint64_t pingpong_end;
+
+static void pingpong_thread(void *arg) {
+    uint32_t parity = (uint32_t) arg;
+    for (int handoffs = 0; handoffs < SUITE_SWITCHES && !pingpong_stop;) {
+        if ((pingpong_turns & 1) == parity) {
+            pingpong_turns++;
+            handoffs++;
+        }
+        thread_yield();
+    }
+    if (__atomic_add_fetch(&pingpong_finished, 1, __ATOMIC_SEQ_CST) == 2) pingpong_end = rdtsc();
+}
+
+static void suite_context_switch() {
+    pingpong_turns = 0;
+    pingpong_finished = 0;
+    pingpong_stop = false;
+
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    thread_create("ping", pingpong_thread, (void *) 0, 8);
+    thread_create("pong", pingpong_thread, (void *) 1, 8);
+    irq_restore(flags);
+
+    uint32_t deadline = system_ticks + SUITE_SWITCH_TIMEOUT_TICKS;
+    while (pingpong_finished < 2 && system_ticks != deadline) asm volatile("hlt");
+    if (pingpong_finished < 2) {
+        pingpong_stop = true;
+        suite_report("context_switch", 0, 0);
+        return;
+    }
+    suite_report("context_switch", pingpong_turns, pingpong_end - start);
+}
+
+static void suite_console() {
+    clear_screen();
+    console_set_backends(CONSOLE_VGA); /* keep the serial line for results */
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SUITE_PRINT_LINES; i++) print_string(BENCH_LINE);
+    uint64_t cycles = rdtsc() - start;
+    console_set_backends(CONSOLE_VGA | CONSOLE_SERIAL);
+    suite_report("print_string", SUITE_PRINT_LINES, cycles);
+}
+
+static void suite_keyboard() {
+    clear_screen();
+    uint64_t legacy = keyboard_irq_cycles(legacy_keyboard_irq);
+    clear_screen();
+    suite_report("irq1_legacy_switch", 2 * BENCH_KEYBOARD_PRESSES, legacy);
+    suite_report("irq1_scancode_ring", 2 * BENCH_KEYBOARD_PRESSES, keyboard_irq_cycles(keyboard_queue_scancode));
+}
+
+static void suite_allocators() {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SUITE_ALLOC_PAIRS; i++) mem_free(mem_alloc(64 + (i & 7) * 24));
+    suite_report("mem_alloc_free", SUITE_ALLOC_PAIRS, rdtsc() - start);
+
+    uint32_t failed = 0;
+    start = rdtsc();
+    for (int i = 0; i < SUITE_ALLOC_PAIRS; i++) {
+        uint32_t page = pmm_alloc_pages(0);
+        if (page) {
+            pmm_free_pages(page, 0);
+        } else {
+            failed++;
+        }
+    }
+    suite_report("pmm_alloc_free", SUITE_ALLOC_PAIRS - failed, rdtsc() - start);
+}
+
+/* What sched_switch pays per decision: one activation, or a whole-table scan */
+static void suite_scheduler() {
+    int sink = 0;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SUITE_SCORE_CALLS; i++) sink += calculate_activation(current_thread);
+    suite_report("calculate_activation", SUITE_SCORE_CALLS, rdtsc() - start);
+
+    uint32_t flags = irq_save();
+    start = rdtsc();
+    for (int i = 0; i < SUITE_SCORE_CALLS; i++) sink += nn_score_batch(&process_table, bench_activations);
+    uint64_t cycles = rdtsc() - start;
+    irq_restore(flags);
+    suite_report("nn_score_batch", SUITE_SCORE_CALLS, cycles);
+    asm volatile("" : : "r" (sink));
+}
+
+/* Per-tick cost should stay flat from the smallest to the largest timer count */
+static void suite_ktimer() {
+    ktimer_stress_t result;
+    if (!ktimer_stress(BENCH_KTIMER_MIN, &result)) {
+        suite_report("ktimer_tick_small", 0, 0);
+        return;
+    }
+    bool correct = bench_ktimer_fired == result.expected && !bench_ktimer_wrong;
+    suite_report("ktimer_tick_small", correct ? BENCH_KTIMER_TICKS : 0, result.ticks);
+
+    if (!ktimer_stress(BENCH_KTIMER_MAX, &result)) {
+        suite_report("ktimer_add", 0, 0);
+        return;
+    }
+    correct = bench_ktimer_fired == result.expected && !bench_ktimer_wrong;
+    suite_report("ktimer_add", BENCH_KTIMER_MAX, result.add);
+    suite_report("ktimer_cancel", BENCH_KTIMER_MAX / 2, result.cancel);
+    suite_report("ktimer_tick_large", correct ? BENCH_KTIMER_TICKS : 0, result.ticks);
+}
+
+/* Iterations are requests; the scratch disk must be attached */
+static void suite_disk() {
+    uint8_t *buffer = ata_drive(BENCH_DISK_DRIVE)
+        ? mem_alloc(BENCH_DISK_DEPTH * BENCH_DISK_SEQ_SECTORS * ATA_SECTOR_SIZE) : 0;
+    if (!buffer) {
+        suite_report("disk_seq_read", 0, 0);
+        return;
+    }
+
+    uint64_t cycles = disk_sync_sectors(buffer);
+    suite_report("disk_sync_sector", cycles ? BENCH_DISK_SYNC_SECTORS : 0, cycles);
+
+    cycles = disk_reads(buffer, BENCH_DISK_SEQ_REQUESTS, BENCH_DISK_SEQ_SECTORS, BENCH_DISK_DEPTH, false);
+    suite_report("disk_seq_read_64k", cycles ? BENCH_DISK_SEQ_REQUESTS : 0, cycles);
+
+    cycles = disk_reads(buffer, BENCH_DISK_RANDOM_REQUESTS, BENCH_DISK_RANDOM_SECTORS, BENCH_DISK_DEPTH, true);
+    suite_report("disk_random_read_4k", cycles ? BENCH_DISK_RANDOM_REQUESTS : 0, cycles);
+    mem_free(buffer);
+}
+
+static void suite_bcache() {
+    uint8_t *buffer = mem_alloc(BCACHE_BLOCK_SIZE);
+    uint8_t *source = mem_alloc(BCACHE_BLOCK_SIZE);
+    if (!buffer || !source || !ata_drive(BENCH_DISK_DRIVE)) {
+        mem_free(source);
+        mem_free(buffer);
+        suite_report("bcache_cold_readahead", 0, 0);
+        return;
+    }
+
+    uint64_t cycles = bcache_cold_reads(BENCH_BCACHE_READAHEAD_START, true);
+    suite_report("bcache_cold_readahead", cycles ? BENCH_BCACHE_COLD_BLOCKS : 0, cycles);
+    cycles = bcache_cold_reads(BENCH_BCACHE_PLAIN_START, false);
+    suite_report("bcache_cold_plain", cycles ? BENCH_BCACHE_COLD_BLOCKS : 0, cycles);
+    cycles = bcache_hot_reads(buffer);
+    suite_report("bcache_hot_read_512", cycles ? BENCH_BCACHE_HOT_READS : 0, cycles);
+    suite_report("memcpy_512", BENCH_BCACHE_HOT_READS, memcpy_reads(buffer, source));
+    mem_free(source);
+    mem_free(buffer);
+}
+
+/* Iterations are lookups, then files read; the bench image's initrd carries synthetic files for this */
+static void suite_initrd() {
+    uint8_t *buffer = mem_alloc(BENCH_INITRD_READ_MAX);
+    if (!buffer || initrd_file_count() == 0 || !tar_build()) {
+        suite_report("initrd_lookup", 0, 0);
+        if (buffer) mem_free(buffer);
+        return;
+    }
+
+    uint64_t cycles = initrd_lookups(false);
+    suite_report("initrd_lookup", cycles ? BENCH_INITRD_LOOKUPS : 0, cycles);
+    cycles = initrd_lookups(true);
+    suite_report("tar_lookup", cycles ? BENCH_INITRD_LOOKUPS : 0, cycles);
+
+    uint32_t bytes;
+    uint32_t reads = BENCH_INITRD_READ_PASSES * initrd_file_count();
+    cycles = initrd_reads(false, buffer, &bytes);
+    suite_report("initrd_read", cycles ? reads : 0, cycles);
+    cycles = initrd_reads(true, buffer, &bytes);
+    suite_report("tar_read", cycles ? reads : 0, cycles);
+    tar_free();
+    mem_free(buffer);
+}
+
+/* Iterations are work units over the same wall time: the all-CPU run should do about cpus times more */
+static void suite_smp() {
+    uint64_t cycles;
+    uint32_t units = smp_run(1, SUITE_SMP_TICKS, &cycles);
+    suite_report("smp_cpu_bound_1", units, cycles);
+    units = smp_run(smp_cpu_count(), SUITE_SMP_TICKS, &cycles);
+    suite_report("smp_cpu_bound_all", units, cycles);
+}
+
+void bench_suite_run() {
+    uint8_t status = BENCH_EXIT_FAIL;
+    if (cpu_has(CPU_FEATURE_TSC)) {
+        char line[48];
+        ksnprintf(line, sizeof(line), "BENCH-BEGIN tsc_khz %u\n", clock_tsc_khz());
+        serial_write(line, string_length(line));
+
+        suite_failed = false;
+        suite_loop_overhead();
+        suite_irq_latency();
+        suite_context_switch();
+        suite_console();
+        suite_keyboard();
+        suite_allocators();
+        suite_scheduler();
+        suite_ktimer();
+        suite_disk();
+        suite_bcache();
+        suite_initrd();
+        suite_smp();
+        if (!suite_failed) status = BENCH_EXIT_PASS;
+    }
+
+    serial_write(status == BENCH_EXIT_PASS ? "BENCH-END pass\n" : "BENCH-END fail\n", 15);
+    serial_flush();
+    port_byte_out(BENCH_EXIT_PORT, status);
+
+    /* Still here: no isa-debug-exit device, so this isn't make bench */
+    print_string("Benchmark suite done\n");
+    while (1) asm volatile("hlt");
+}
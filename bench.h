@@ -0,0 +1,46 @@
+#pragma once
+
+/* Ticks each throughput benchmark runs for, a multiple of 100 (1 s) */
+#define BENCH_DURATION_TICKS 100
+
+void bench_console();
+
+/* IRQ1's work per scancode: the old decode-and-echo switch against the scancode ring */
+void bench_keyboard();
+
+void bench_memory();
+
+void bench_pmm();
+
+void bench_paging();
+
+void bench_nn_score();
+
+/* Add, cancel and per-tick cost of the timer wheel as the number of pending timers grows */
+void bench_ktimer();
+
+/* make run and make bench attach scratch.img as the secondary master */
+#define BENCH_DISK_DRIVE 2
+
+/* Sequential and random reads from BENCH_DISK_DRIVE: a sector at a time, then queued PIO and DMA */
+void bench_disk();
+
+/* Cold sequential reads through the block cache with and without read-ahead, then hot re-reads */
+void bench_bcache();
+
+/* Path lookups and whole-file reads through the initrd's hash index against a linear tar scan */
+void bench_initrd();
+
+/* CPU-bound threads on one CPU, then one per online CPU */
+void bench_smp();
+
+/*
+ * make bench: QEMU's isa-debug-exit device at BENCH_EXIT_PORT exits with
+ * status (value << 1) | 1, so the pass code comes out as 33.
+ */
+#define BENCH_EXIT_PORT 0xf4
+#define BENCH_EXIT_PASS 0x10
+#define BENCH_EXIT_FAIL 0x11
+
+/* Runs every measurement, writes "BENCH <name> <iterations> <cycles>" lines to COM1 and exits QEMU */
+void bench_suite_run();
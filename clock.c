@@ -0,0 +1,194 @@
+#include "clock.h"
+#include "cpu.h"
+#include "kernel.h"
+#include "ports.h"
+#include "seqlock.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_CH2_GATE_PORT 0x61
+
+#define PIT_CMD_CH0_MODE0 0x30 /* channel 0, lobyte/hibyte, interrupt on terminal count */
+#define PIT_CMD_CH0_MODE3 0x36 /* channel 0, lobyte/hibyte, square wave */
+#define PIT_CMD_CH2_MODE0 0xb0
+#define PIT_GATE2 0x01
+#define PIT_SPEAKER 0x02
+#define PIT_OUT2 0x20
+
+#define CALIBRATE_MS 10
+#define CALIBRATE_RUNS 3
+#define PIT_MAX_COUNT 0xffff
+
+/* ns = cycles * tsc_mult >> TSC_SHIFT */
+#define TSC_SHIFT 24
+
+static uint32_t tsc_khz = 0;
+static uint32_t tsc_mult = 0;
+static uint64_t tsc_base = 0;
+/* clock_seq covers tickless, next_deadline and programming PIT channel 0 */
+static lock_class_t clock_lock_class = LOCK_CLASS("clock");
+static seqlock_t clock_seq = SEQLOCK_INIT(&clock_lock_class);
+static bool tickless = false;
+static uint64_t next_deadline = NO_DEADLINE;
+static volatile uint32_t interrupts = 0;
+
+/* Cycles the TSC advances while PIT channel 2 counts down CALIBRATE_MS */
+static uint32_t calibrate_once() {
+    uint16_t count = PIT_FREQUENCY / 1000 * CALIBRATE_MS;
+    uint8_t gate = port_byte_in(PIT_CH2_GATE_PORT) & ~(PIT_SPEAKER | PIT_GATE2);
+    port_byte_out(PIT_CH2_GATE_PORT, gate);
+
+    port_byte_out(PIT_COMMAND, PIT_CMD_CH2_MODE0);
+    port_byte_out(PIT_CHANNEL2, count & 0xff);
+    port_byte_out(PIT_CHANNEL2, count >> 8);
+
+    port_byte_out(PIT_CH2_GATE_PORT, gate | PIT_GATE2);
+    uint64_t start = rdtsc();
+    while (!(port_byte_in(PIT_CH2_GATE_PORT) & PIT_OUT2));
+    uint64_t end = rdtsc();
+
+    port_byte_out(PIT_CH2_GATE_PORT, gate);
+    return (uint32_t) (end - start);
+}
+
+static void pit_program(uint8_t command, uint16_t count) {
+    port_byte_out(PIT_COMMAND, command);
+    port_byte_out(PIT_CHANNEL0, count & 0xff);
+    port_byte_out(PIT_CHANNEL0, count >> 8);
+}
+
+void clock_init() {
+    if (cpu_has(CPU_FEATURE_TSC)) {
+        uint32_t best = 0xffffffff;
+        for (int i = 0; i < CALIBRATE_RUNS; i++) {
+            uint32_t cycles = calibrate_once();
+            if (cycles < best) best = cycles;
+        }
+        tsc_khz = best / CALIBRATE_MS;
+        if (tsc_khz != 0) {
+            tsc_mult = (uint32_t) udiv64_32((uint64_t) 1000000 << TSC_SHIFT, tsc_khz);
+            tsc_base = rdtsc();
+        }
+    }
+
+    pit_program(PIT_CMD_CH0_MODE3, PIT_FREQUENCY / TIMER_HZ);
+}
+
+static uint64_t cycles_to_ns(uint64_t cycles) {
+    uint64_t low = (uint64_t) (uint32_t) cycles * tsc_mult;
+    uint64_t high = (uint64_t) (uint32_t) (cycles >> 32) * tsc_mult;
+    return (low >> TSC_SHIFT) + (high << (32 - TSC_SHIFT));
+}
+
+uint64_t ktime_get() {
+    if (tsc_khz == 0) {
+        return (uint64_t) system_ticks * NSEC_PER_TICK;
+    }
+    return cycles_to_ns(rdtsc() - tsc_base);
+}
+
+uint32_t clock_tsc_khz() {
+    return tsc_khz;
+}
+
+void ndelay(uint32_t nsec) {
+    if (tsc_khz == 0) {
+        /* No TSC: round up to whole ticks; the difference survives system_ticks wrapping */
+        uint32_t start = system_ticks;
+        int32_t ticks = nsec / NSEC_PER_TICK + 1;
+        while ((int32_t) (system_ticks - start) < ticks);
+        return;
+    }
+    uint64_t cycles = udiv64_32((uint64_t) nsec * tsc_khz, 1000000);
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < cycles) {
+        asm volatile("pause");
+    }
+}
+
+void udelay(uint32_t usec) {
+    while (usec > 1000000) {
+        ndelay(1000000000);
+        usec -= 1000000;
+    }
+    ndelay(usec * 1000);
+}
+
+/* Arm a one-shot interrupt for the next deadline, capped at what the PIT can count */
+static void clock_arm_oneshot(uint64_t now) {
+    uint32_t count = PIT_MAX_COUNT;
+    if (next_deadline != NO_DEADLINE) {
+        uint64_t delta = next_deadline > now ? next_deadline - now : 0;
+        if (delta < (uint64_t) PIT_MAX_COUNT * NSEC_PER_SEC / PIT_FREQUENCY) {
+            count = (uint32_t) udiv64_32(delta * PIT_FREQUENCY, NSEC_PER_SEC);
+            if (count == 0) count = 1;
+        }
+    }
+    pit_program(PIT_CMD_CH0_MODE0, count);
+}
+
+void clock_set_tickless(bool enable) {
+    uint32_t flags = write_seqlock_irqsave(&clock_seq);
+    /* Without a TSC the tick is the only clock */
+    tickless = enable && tsc_khz != 0;
+    if (tickless) {
+        clock_arm_oneshot(ktime_get());
+    } else {
+        pit_program(PIT_CMD_CH0_MODE3, PIT_FREQUENCY / TIMER_HZ);
+    }
+    write_sequnlock_irqrestore(&clock_seq, flags);
+}
+
+static uint64_t read_next_deadline() {
+    uint32_t sequence;
+    uint64_t deadline;
+    do {
+        sequence = read_seqbegin(&clock_seq);
+        deadline = next_deadline;
+    } while (read_seqretry(&clock_seq, sequence));
+    return deadline;
+}
+
+void clock_request_deadline(uint64_t deadline) {
+    /* Most requests are for later than what is armed already and only need to read it */
+    if (deadline >= read_next_deadline()) return;
+
+    uint32_t flags = write_seqlock_irqsave(&clock_seq);
+    if (deadline < next_deadline) {
+        next_deadline = deadline;
+        if (tickless) clock_arm_oneshot(ktime_get());
+    }
+    write_sequnlock_irqrestore(&clock_seq, flags);
+}
+
+uint32_t clock_ticks_now() {
+    if (!tickless) return system_ticks;
+    return (uint32_t) udiv64_32(ktime_get(), NSEC_PER_TICK);
+}
+
+void clock_tick() {
+    interrupts++;
+    if (!tickless) {
+        system_ticks++;
+        return;
+    }
+
+    write_seqlock(&clock_seq);
+    uint64_t now = ktime_get();
+    uint32_t ticks = (uint32_t) udiv64_32(now, NSEC_PER_TICK);
+    if (ticks > system_ticks) system_ticks = ticks;
+    if (next_deadline <= now) {
+        next_deadline = NO_DEADLINE;
+    }
+    clock_arm_oneshot(now);
+    write_sequnlock(&clock_seq);
+}
+
+uint32_t clock_interrupts() {
+    return interrupts;
+}
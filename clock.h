@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIT_FREQUENCY 1193182
+#define TIMER_HZ 100
+#define NSEC_PER_SEC 1000000000u
+#define NSEC_PER_TICK (NSEC_PER_SEC / TIMER_HZ)
+#define NO_DEADLINE ((uint64_t) -1)
+
+/* Calibrates the TSC against PIT channel 2 and starts the periodic tick */
+void clock_init();
+
+/* Nanoseconds since clock_init() */
+uint64_t ktime_get();
+
+uint32_t clock_tsc_khz();
+
+void ndelay(uint32_t nsec);
+
+void udelay(uint32_t usec);
+
+/*
+ * Tickless mode: instead of TIMER_HZ periodic interrupts, PIT channel 0
+ * runs one-shot (mode 0) and fires only at the next requested deadline,
+ * or after the longest interval it can count if none is pending.
+ */
+void clock_set_tickless(bool enable);
+
+/* Ask for a timer interrupt at (or shortly after) ktime deadline */
+void clock_request_deadline(uint64_t deadline);
+
+/*
+ * system_ticks as it would be now. In tickless mode system_ticks only
+ * moves when the timer fires, which can be several ticks apart.
+ */
+uint32_t clock_ticks_now();
+
+/* Timer interrupt work: keeps system_ticks current and rearms a one-shot */
+void clock_tick();
+
+uint32_t clock_interrupts();
@@ -0,0 +1,41 @@
+#include "cpu.h"
+
+#include <stdint.h>
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+uint32_t cpu_features = 0;
+
+/*
+ * Read the CPUID feature flags and turn on the FPU and, when the CPU has
+ * them, SSE instructions. Features the kernel could not enable are
+ * cleared so cpu_has() only reports what is usable.
+ */
+void cpu_init() {
+    uint32_t max_leaf, ebx, ecx, edx;
+    cpuid(0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf >= 1) {
+        uint32_t eax;
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        cpu_features = edx;
+    }
+
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP;
+    asm volatile("mov %0, %%cr0" : : "r" (cr0));
+    asm volatile("fninit");
+
+    if (cpu_has(CPU_FEATURE_FXSR | CPU_FEATURE_SSE)) {
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r" (cr4));
+        cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+        asm volatile("mov %0, %%cr4" : : "r" (cr4));
+    } else {
+        cpu_features &= ~(CPU_FEATURE_SSE | CPU_FEATURE_SSE2);
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* CPUID leaf 1 EDX feature bits */
+#define CPU_FEATURE_FPU (1 << 0)
+#define CPU_FEATURE_PSE (1 << 3)
+#define CPU_FEATURE_TSC (1 << 4)
+#define CPU_FEATURE_MSR (1 << 5)
+#define CPU_FEATURE_APIC (1 << 9)
+#define CPU_FEATURE_FXSR (1 << 24)
+#define CPU_FEATURE_SSE (1 << 25)
+#define CPU_FEATURE_SSE2 (1 << 26)
+
+extern uint32_t cpu_features;
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0));
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+#ifdef HOST_BUILD
+/* make bench-host: a user process can't mask interrupts and doesn't need to */
+static inline uint32_t irq_save() {
+    return 0;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    (void) flags;
+}
+#else
+/* Disable interrupts and return the previous EFLAGS for irq_restore */
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    asm volatile("push %0; popf" : : "r" (flags) : "memory", "cc");
+}
+#endif
+
+static inline bool cpu_has(uint32_t feature) {
+    return (cpu_features & feature) == feature;
+}
+
+void cpu_init();
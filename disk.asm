@@ -1,46 +1,44 @@
 [bits 16]
 
-print_string_16:
-    pusha
-    mov ah, 0x0e
-.print_loop:
-    mov al, [bx]
-    cmp al, 0
-    je .done
-    int 0x10
-    inc bx
-    jmp .print_loop
-.done:
-    popa
+; Reads cx sectors from LBA [dap_lba] to BOUNCE_SEGMENT:0 with INT 13h AH=42h
+; and advances [dap_lba] past them
+disk_read_lba:
+    pushad
+    mov [dap_count], cx
+    mov si, dap
+    mov ah, 0x42
+    mov dl, [BOOT_DRIVE]
+    int 0x13
+    jc disk_error
+    popad
+    add [dap_lba], cx
+    adc word [dap_lba + 2], 0
     ret
 
-disk_load:
-    pusha
-    push dx
-
-    mov ah, 0x02
-    mov al, dh
-    mov cl, 0x02
-    mov ch, 0x00
-    mov dh, 0x00
-    int 0x13
-    jc .disk_error
+disk_error:
+    mov si, DISK_ERROR_MSG
+    jmp boot_error
 
-    pop dx
-    cmp al, dh
-    jne .sectors_error
-    popa
-    ret
+header_error:
+    mov si, HEADER_ERROR_MSG
 
-.disk_error:
-    mov bx, DISK_ERROR_MSG
-    call print_string_16
-    jmp $
+; Prints the string at si and stops there
+boot_error:
+    lodsb
+    test al, al
+    jz $
+    mov ah, 0x0e
+    int 0x10
+    jmp boot_error
 
-.sectors_error:
-    mov bx, SECTORS_ERROR_MSG
-    call print_string_16
-    jmp $
+; Disk address packet
+dap:
+    db 0x10, 0
+dap_count:
+    dw 0
+    dw 0, BOUNCE_SEGMENT
+dap_lba:
+    dd 0, 0
 
 DISK_ERROR_MSG: db "Disk error!", 0
-SECTORS_ERROR_MSG: db "Sector error!", 0
\ No newline at end of file
+HEADER_ERROR_MSG: db "Bad kernel header!", 0
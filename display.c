@@ -1,24 +1,63 @@
 #include "display.h"
 #include "ports.h"
 #include <stdint.h>
-#include "util.h"
+#include <stdbool.h>
+#include "kstring.h"
+#include "sched.h"
+#include "serial.h"
+#include "spinlock.h"
 
+/*
+ * The console keeps the cursor in memory and only pushes it to the CRTC
+ * in console_flush(). Offsets are absolute byte offsets into the whole
+ * 32 KB text buffer; the visible 80x25 window starts at screen_start_row
+ * and scrolling just moves the CRTC start address down one row. Memory is
+ * only copied when the window reaches the end of the buffer and wraps.
+ */
+static int cursor_offset = 0;
+static int screen_start_row = 0;
+static bool cursor_dirty = false;
+static bool start_dirty = false;
+static int console_backends = CONSOLE_VGA;
+
+/*
+ * Protected by console_lock: the cursor and the screen window. Held with
+ * interrupts on: the serial backend sleeps in hlt while its transmit
+ * buffer is full.
+ */
+static lock_class_t console_lock_class = LOCK_CLASS("console");
+static spinlock_t console_lock = SPINLOCK_INIT(&console_lock_class);
 
+void console_set_backends(int backends) {
+    console_backends = backends;
+}
+
+static void crtc_write_word(uint8_t high_reg, uint16_t value) {
+    port_byte_out(REG_SCREEN_CTRL, high_reg);
+    port_byte_out(REG_SCREEN_DATA, (unsigned char) (value >> 8));
+    port_byte_out(REG_SCREEN_CTRL, high_reg + 1);
+    port_byte_out(REG_SCREEN_DATA, (unsigned char) (value & 0xff));
+}
+
+void console_flush() {
+    if (start_dirty) {
+        crtc_write_word(CRTC_START_ADDRESS_HIGH, (uint16_t) (screen_start_row * MAX_COLS));
+        start_dirty = false;
+    }
+    if (cursor_dirty) {
+        crtc_write_word(CRTC_CURSOR_LOCATION_HIGH, (uint16_t) (cursor_offset / 2));
+        cursor_dirty = false;
+    }
+}
 
 void set_cursor(int offset) {
-    offset /= 2;
-    port_byte_out(REG_SCREEN_CTRL, 14);
-    port_byte_out(REG_SCREEN_DATA, (unsigned char) (offset >> 8));
-    port_byte_out(REG_SCREEN_CTRL, 15);
-    port_byte_out(REG_SCREEN_DATA, (unsigned char) (offset & 0xff));
+    cursor_offset = offset;
+    cursor_dirty = true;
+    console_flush();
 }
 
 int get_cursor() {
-    port_byte_out(REG_SCREEN_CTRL, 14);
-    int offset = port_byte_in(REG_SCREEN_DATA) << 8; /* High byte: << 8 */
-    port_byte_out(REG_SCREEN_CTRL, 15);
-    offset += port_byte_in(REG_SCREEN_DATA);
-    return offset * 2;
+    return cursor_offset;
 }
 
 int get_offset(int col, int row) {
@@ -33,40 +72,65 @@ int move_offset_to_new_line(int offset) {
     return get_offset(0, get_row_from_offset(offset) + 1);
 }
 
+static int screen_end_offset() {
+    return get_offset(0, screen_start_row + MAX_ROWS);
+}
+
 void set_char_at_video_memory(char character, int offset) {
     uint8_t *vidmem = (uint8_t *) VIDEO_ADDRESS;
     vidmem[offset] = character;
     vidmem[offset + 1] = WHITE_ON_BLACK;
 }
 
+static void clear_row(int row) {
+    uint16_t *cell = (uint16_t *) (VIDEO_ADDRESS + get_offset(0, row));
+    for (int col = 0; col < MAX_COLS; col++) {
+        cell[col] = (WHITE_ON_BLACK << 8) | ' ';
+    }
+}
+
 int scroll_ln(int offset) {
-    memory_copy(
-            (uint8_t * )(get_offset(0, 1) + VIDEO_ADDRESS),
+    if (screen_start_row + MAX_ROWS < VIDEO_BUFFER_ROWS) {
+        screen_start_row++;
+        start_dirty = true;
+        clear_row(screen_start_row + MAX_ROWS - 1);
+        return offset;
+    }
+
+    /* Out of buffer: move the window back to the top of video memory */
+    memcpy(
             (uint8_t * )(get_offset(0, 0) + VIDEO_ADDRESS),
+            (uint8_t * )(get_offset(0, screen_start_row + 1) + VIDEO_ADDRESS),
             MAX_COLS * (MAX_ROWS - 1) * 2
     );
+    offset -= get_offset(0, screen_start_row + 1);
+    screen_start_row = 0;
+    start_dirty = true;
+    clear_row(MAX_ROWS - 1);
 
-
-    for (int col = 0; col < MAX_COLS; col++) {
-        set_char_at_video_memory(' ', get_offset(col, MAX_ROWS - 1));
-    }
-
-    return offset - 2 * MAX_COLS;
+    return offset;
 }
 
 /*
  * TODO:
  * - handle illegal offset (print error message somewhere)
  */
-void print_string(char *string) {
-    int offset = get_cursor();
+static void print_string_vga(char *string) {
+    int offset = cursor_offset;
+    int end = screen_end_offset();
     int i = 0;
     while (string[i] != 0) {
-        if (offset >= MAX_ROWS * MAX_COLS * 2) {
+        if (offset >= end) {
             offset = scroll_ln(offset);
+            end = screen_end_offset();
         }
         if (string[i] == '\n') {
             offset = move_offset_to_new_line(offset);
+        } else if (string[i] == '\b') {
+            if (offset > get_offset(0, screen_start_row)) {
+                offset -= 2;
+                set_char_at_video_memory(' ', offset);
+            }
         } else {
             set_char_at_video_memory(string[i], offset);
             offset += 2;
@@ -76,6 +140,34 @@ void print_string(char *string) {
     set_cursor(offset);
 }
 
+static void console_lock_acquire() {
+    preempt_disable();
+    spin_lock(&console_lock);
+}
+
+static void console_lock_release() {
+    spin_unlock(&console_lock);
+    preempt_enable();
+}
+
+void console_force_unlock() {
+    if (spin_is_locked(&console_lock)) {
+        console_lock = (spinlock_t) SPINLOCK_INIT(&console_lock_class);
+    }
+}
+
+void print_string(char *string) {
+    /* The cursor is cached across the loop, so nobody else may print meanwhile */
+    console_lock_acquire();
+    if (console_backends & CONSOLE_SERIAL) {
+        serial_print(string);
+    }
+    if (console_backends & CONSOLE_VGA) {
+        print_string_vga(string);
+    }
+    console_lock_release();
+}
+
 void print_int(int num) {
     char buffer[12];  // Enough for a 32-bit integer
     int i = 0, is_negative = 0;
@@ -112,19 +204,27 @@ void print_int(int num) {
 
 
 void print_nl() {
-    int newOffset = move_offset_to_new_line(get_cursor());
-    if (newOffset >= MAX_ROWS * MAX_COLS * 2) {
-        newOffset = scroll_ln(newOffset);
+    console_lock_acquire();
+    if (console_backends & CONSOLE_SERIAL) {
+        serial_print("\n");
+    }
+    if (console_backends & CONSOLE_VGA) {
+        int newOffset = move_offset_to_new_line(cursor_offset);
+        if (newOffset >= screen_end_offset()) {
+            newOffset = scroll_ln(newOffset);
+        }
+        set_cursor(newOffset);
     }
-    set_cursor(newOffset);
+    console_lock_release();
 }
 
 void clear_screen() {
-    int screen_size = MAX_COLS * MAX_ROWS;
-    for (int i = 0; i < screen_size; ++i) {
-        set_char_at_video_memory(' ', i * 2);
+    console_lock_acquire();
+    screen_start_row = 0;
+    start_dirty = true;
+    for (int row = 0; row < MAX_ROWS; ++row) {
+        clear_row(row);
     }
     set_cursor(get_offset(0, 0));
+    console_lock_release();
 }
-
-
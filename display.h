@@ -1,14 +1,28 @@
 #pragma once
 
+#ifndef VIDEO_ADDRESS /* host/shims.h points it at a buffer */
 #define VIDEO_ADDRESS 0xb8000
+#endif
 #define MAX_ROWS 25
 #define MAX_COLS 80
 #define WHITE_ON_BLACK 0x0f
 
+/* Text mode maps 32 KB of video memory, the screen is a window into it */
+#define VIDEO_MEMORY_SIZE 0x8000
+#define VIDEO_BUFFER_ROWS (VIDEO_MEMORY_SIZE / (2 * MAX_COLS))
+
+/* Console backends */
+#define CONSOLE_VGA 0x1
+#define CONSOLE_SERIAL 0x2
+
 /* Screen i/o ports */
 #define REG_SCREEN_CTRL 0x3d4
 #define REG_SCREEN_DATA 0x3d5
 
+/* CRTC registers (high byte; the low byte is the next index) */
+#define CRTC_START_ADDRESS_HIGH 0x0c
+#define CRTC_CURSOR_LOCATION_HIGH 0x0e
+
 /* Public kernel API */
 void print_string(char* string);
 void print_int(int number);
@@ -17,4 +31,8 @@ void clear_screen();
 void set_cursor(int row);
 int get_cursor();
 void set_char_at_video_memory(char character, int offset);
-int scroll_ln(int offset);
\ No newline at end of file
+int scroll_ln(int offset);
+void console_flush();
+void console_set_backends(int backends);
+/* Breaks the console lock for a panic that may have interrupted a print */
+void console_force_unlock();
@@ -0,0 +1,372 @@
+/*
+ * make bench-host: times kernel code paths as an ordinary Linux process.
+ *
+ * memory.c, nn.c, display.c and ktimer.c are built unchanged against host/shims.c,
+ * so the numbers are for the same C the kernel runs, just compiled for
+ * x86_64 with libc's memcpy/memset underneath. Each benchmark is sized to
+ * roughly BENCH_TARGET_NS per run and run BENCH_DEFAULT_RUNS times; the
+ * report is the mean ns/op and its standard deviation over the runs.
+ *
+ *   ./host-bench [--runs N] [--save FILE] [--compare FILE]
+ *
+ * --save writes "name mean stddev" lines; --compare reads them back and
+ * exits with status 1 when any benchmark got significantly slower.
+ */
+
+#include "display.h"
+#include "ktimer.h"
+#include "memory.h"
+#include "nn.h"
+#include "sched.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_RUNS 15
+#define BENCH_MAX_RUNS 100
+#define BENCH_TARGET_NS 20000000ull /* per run */
+#define BENCH_MAX_BENCHMARKS 16
+
+/* A change counts when it is over this many standard errors and this fraction of the baseline */
+#define BENCH_SIGNIFICANCE 3.0
+#define BENCH_MIN_CHANGE 0.02
+
+#define BENCH_LINE "The quick brown fox jumps over the lazy dog 0123456789\n"
+#define CHURN_SLOTS 256
+#define CHURN_MAX_SIZE 2048
+#define SCORE_SLOTS 4096
+#define WHEEL_TIMERS 32768
+
+typedef struct {
+    const char *name;
+    void (*setup)();
+    void (*run)(uint64_t ops);
+    void (*teardown)(); /* undoes setup, or 0 if there is nothing to undo */
+} benchmark_t;
+
+typedef struct {
+    char name[32];
+    double mean;
+    double stddev;
+} bench_result_t;
+
+static volatile int sink;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint32_t lcg_state = 1;
+
+static uint32_t lcg_next() {
+    lcg_state = lcg_state * 1103515245u + 12345u;
+    return lcg_state >> 8;
+}
+
+/* ---- heap ---- */
+
+static void *churn_slots[CHURN_SLOTS];
+
+static void setup_heap() {
+    lcg_state = 1;
+    for (int i = 0; i < CHURN_SLOTS; i++) {
+        churn_slots[i] = mem_alloc(16 + lcg_next() % CHURN_MAX_SIZE);
+    }
+}
+
+/* Frees what setup_heap and the churn left live, so the next heap benchmark starts from the same state */
+static void teardown_heap() {
+    for (int i = 0; i < CHURN_SLOTS; i++) {
+        mem_free(churn_slots[i]);
+        churn_slots[i] = 0;
+    }
+}
+
+/* One op = free a random live block and allocate a random size in its place */
+static void run_mem_churn(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        uint32_t r = lcg_next();
+        int slot = r % CHURN_SLOTS;
+        mem_free(churn_slots[slot]);
+        churn_slots[slot] = mem_alloc(16 + (r >> 8) % CHURN_MAX_SIZE);
+    }
+}
+
+/* One op = mem_alloc + mem_free of a small block, the common fast path */
+static void run_mem_alloc_free(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        void *p = mem_alloc(64);
+        mem_free(p);
+    }
+}
+
+/* ---- scheduler math ---- */
+
+static Process score_processes[MAX_PROCESSES];
+static uint32_t score_cpu_time[SCORE_SLOTS] __attribute__((aligned(16)));
+static uint32_t score_wait_time[SCORE_SLOTS] __attribute__((aligned(16)));
+static int32_t score_priority[SCORE_SLOTS] __attribute__((aligned(16)));
+static uint32_t score_active[SCORE_SLOTS / 32];
+static int32_t score_activations[SCORE_SLOTS] __attribute__((aligned(16)));
+static ProcessTable score_table = {
+    .cpu_time = score_cpu_time,
+    .wait_time = score_wait_time,
+    .priority = score_priority,
+    .active = score_active,
+    .count = SCORE_SLOTS
+};
+
+static void setup_scores() {
+    lcg_state = 1;
+    init_neural_network();
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        score_processes[i].slot = i;
+        process_table.cpu_time[i] = lcg_next() % 1000;
+        process_table.wait_time[i] = lcg_next() % 1000;
+        process_table.priority[i] = lcg_next() % SCHED_PRIORITIES;
+    }
+    for (int i = 0; i < SCORE_SLOTS; i++) {
+        score_cpu_time[i] = lcg_next() % 1000;
+        score_wait_time[i] = lcg_next() % 1000;
+        score_priority[i] = lcg_next() % SCHED_PRIORITIES;
+        score_active[i / 32] |= 1u << (i % 32);
+    }
+}
+
+/* One op = one calculate_activation over a thread's features */
+static void run_calculate_activation(uint64_t ops) {
+    int sum = 0;
+    for (uint64_t i = 0; i < ops; i++) {
+        sum += calculate_activation(&score_processes[i % MAX_PROCESSES]);
+    }
+    sink = sum;
+}
+
+/* One op = one slot scored by nn_score_batch over a SCORE_SLOTS table */
+static void run_nn_score_batch(uint64_t ops) {
+    int best = 0;
+    for (uint64_t i = 0; i < ops; i += SCORE_SLOTS) {
+        best += nn_score_batch(&score_table, score_activations);
+    }
+    sink = best;
+}
+
+/* ---- console ---- */
+
+static void setup_console() {
+    console_set_backends(CONSOLE_VGA);
+    clear_screen();
+}
+
+/* One op = one BENCH_LINE through print_string, scrolling included */
+static void run_print_string(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        print_string(BENCH_LINE);
+    }
+}
+
+/* One op = one scroll_ln from the bottom row */
+static void run_scroll_ln(uint64_t ops) {
+    int offset = 2 * MAX_COLS * MAX_ROWS;
+    for (uint64_t i = 0; i < ops; i++) {
+        offset = scroll_ln(offset) + 2 * MAX_COLS;
+    }
+    sink = offset;
+}
+
+/* ---- timer wheel ---- */
+
+static ktimer_wheel_t wheel;
+static ktimer_t wheel_timers[WHEEL_TIMERS];
+static uint32_t wheel_now;
+
+static void count_expiry(ktimer_t *timer, void *arg) {
+    (void) timer;
+    (void) arg;
+    sink++;
+}
+
+/* WHEEL_TIMERS periodic timers, periods spread over the first three levels, so the load stays steady */
+static void setup_wheel() {
+    lcg_state = 1;
+    wheel_now = 0;
+    ktimer_wheel_init(&wheel, 0);
+    for (int i = 0; i < WHEEL_TIMERS; i++) {
+        ktimer_init(&wheel_timers[i], count_expiry, 0);
+        wheel_timers[i].period = 1 + lcg_next() % (1u << (KTIMER_LEVEL0_BITS + KTIMER_LEVEL_BITS * (i % 3)));
+        ktimer_wheel_add(&wheel, &wheel_timers[i], wheel_timers[i].period);
+    }
+}
+
+/* One op = re-adding a random pending timer at a random expiry, which unlinks it first */
+static void run_ktimer_add(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        uint32_t r = lcg_next();
+        ktimer_wheel_add(&wheel, &wheel_timers[r % WHEEL_TIMERS], wheel_now + 1 + (r >> 4) % (1u << 20));
+    }
+}
+
+/* One op = one tick, with the expired timers' callbacks and re-arming */
+static void run_ktimer_tick(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        if (ktimer_wheel_advance(&wheel, wheel_now++)) ktimer_wheel_run_expired(&wheel);
+    }
+}
+
+static const benchmark_t benchmarks[] = {
+    {"mem_churn", setup_heap, run_mem_churn, teardown_heap},
+    {"mem_alloc_free", setup_heap, run_mem_alloc_free, teardown_heap},
+    {"calculate_activation", setup_scores, run_calculate_activation, 0},
+    {"nn_score_batch", setup_scores, run_nn_score_batch, 0},
+    {"print_string", setup_console, run_print_string, 0},
+    {"scroll_ln", setup_console, run_scroll_ln, 0},
+    {"ktimer_add", setup_wheel, run_ktimer_add, 0},
+    {"ktimer_tick", setup_wheel, run_ktimer_tick, 0},
+};
+
+#define BENCHMARK_COUNT ((int) (sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+/* Doubles the op count until one run takes at least a tenth of the target, then scales */
+static uint64_t calibrate(const benchmark_t *b) {
+    uint64_t ops = 1;
+    for (;;) {
+        uint64_t start = now_ns();
+        b->run(ops);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= BENCH_TARGET_NS / 10 || ops >= (1ull << 40)) {
+            if (elapsed == 0) elapsed = 1;
+            uint64_t scaled = ops * BENCH_TARGET_NS / elapsed;
+            return scaled ? scaled : 1;
+        }
+        ops *= 2;
+    }
+}
+
+static void run_benchmark(const benchmark_t *b, int runs, bench_result_t *result) {
+    b->setup();
+    uint64_t ops = calibrate(b);
+
+    /* Welford's running mean and variance of ns/op across runs */
+    double mean = 0, m2 = 0;
+    for (int i = 0; i < runs; i++) {
+        uint64_t start = now_ns();
+        b->run(ops);
+        double ns_per_op = (double) (now_ns() - start) / (double) ops;
+        double delta = ns_per_op - mean;
+        mean += delta / (i + 1);
+        m2 += delta * (ns_per_op - mean);
+    }
+
+    if (b->teardown) b->teardown();
+
+    snprintf(result->name, sizeof(result->name), "%s", b->name);
+    result->mean = mean;
+    result->stddev = runs > 1 ? sqrt(m2 / (runs - 1)) : 0;
+}
+
+static int load_baseline(const char *path, bench_result_t *results) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    int count = 0;
+    while (count < BENCH_MAX_BENCHMARKS &&
+           fscanf(f, "%31s %lf %lf", results[count].name, &results[count].mean,
+                  &results[count].stddev) == 3) {
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+static const bench_result_t *find_result(const bench_result_t *results, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(results[i].name, name) == 0) return &results[i];
+    }
+    return NULL;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--runs N] [--save FILE] [--compare FILE]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int runs = BENCH_DEFAULT_RUNS;
+    const char *save_path = NULL;
+    const char *compare_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+            if (runs < 1 || runs > BENCH_MAX_RUNS) usage(argv[0]);
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare_path = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    bench_result_t baseline[BENCH_MAX_BENCHMARKS];
+    int baseline_count = compare_path ? load_baseline(compare_path, baseline) : 0;
+
+    init_dynamic_mem();
+
+    bench_result_t results[BENCHMARK_COUNT];
+    int regressions = 0;
+
+    printf("%-22s %10s %10s %7s", "benchmark", "ns/op", "stddev", "cv");
+    if (compare_path) printf(" %10s %8s", "baseline", "change");
+    printf("\n");
+
+    for (int i = 0; i < BENCHMARK_COUNT; i++) {
+        bench_result_t *r = &results[i];
+        run_benchmark(&benchmarks[i], runs, r);
+        printf("%-22s %10.2f %10.2f %6.1f%%", r->name, r->mean, r->stddev,
+               r->mean > 0 ? 100.0 * r->stddev / r->mean : 0.0);
+
+        const bench_result_t *base = compare_path ? find_result(baseline, baseline_count, r->name) : NULL;
+        if (base && base->mean > 0) {
+            double change = (r->mean - base->mean) / base->mean;
+            double stderr_sum = sqrt((r->stddev * r->stddev + base->stddev * base->stddev) / runs);
+            const char *verdict = "";
+            if (fabs(r->mean - base->mean) > BENCH_SIGNIFICANCE * stderr_sum &&
+                fabs(change) > BENCH_MIN_CHANGE) {
+                verdict = change > 0 ? "  slower" : "  faster";
+                if (change > 0) regressions++;
+            }
+            printf(" %10.2f %+7.1f%%%s", base->mean, 100.0 * change, verdict);
+        } else if (compare_path) {
+            printf(" %10s", "-");
+        }
+        printf("\n");
+    }
+
+    if (save_path) {
+        FILE *f = fopen(save_path, "w");
+        if (!f) {
+            perror(save_path);
+            return 2;
+        }
+        for (int i = 0; i < BENCHMARK_COUNT; i++) {
+            fprintf(f, "%s %.4f %.4f\n", results[i].name, results[i].mean, results[i].stddev);
+        }
+        fclose(f);
+        printf("saved baseline to %s\n", save_path);
+    }
+
+    if (regressions) {
+        printf("%d benchmark(s) slower than %s\n", regressions, compare_path);
+        return 1;
+    }
+    return 0;
+}
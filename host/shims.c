@@ -0,0 +1,83 @@
+#include "clock.h"
+#include "cpu.h"
+#include "klog.h"
+#include "paging.h"
+#include "pmm.h"
+#include "ports.h"
+#include "sched.h"
+#include "serial.h"
+
+#include <stdlib.h>
+
+/*
+ * Stand-ins for the parts of the kernel the benchmarked files call into
+ * but that need real hardware (ports, page tables, physical frames) or
+ * the rest of the scheduler.
+ */
+
+uint8_t host_video_memory[HOST_VIDEO_SIZE] __attribute__((aligned(16)));
+
+uint32_t cpu_features = CPU_FEATURE_SSE | CPU_FEATURE_SSE2; /* every x86_64 host has both */
+
+static uint32_t table_cpu_time[MAX_PROCESSES] __attribute__((aligned(16)));
+static uint32_t table_wait_time[MAX_PROCESSES] __attribute__((aligned(16)));
+static int32_t table_priority[MAX_PROCESSES] __attribute__((aligned(16)));
+static uint32_t table_active[(MAX_PROCESSES + 31) / 32];
+
+ProcessTable process_table = {
+    .cpu_time = table_cpu_time,
+    .wait_time = table_wait_time,
+    .priority = table_priority,
+    .active = table_active,
+    .count = MAX_PROCESSES
+};
+
+/* Port I/O reads back as an idle bus and writes go nowhere */
+unsigned char port_byte_in(uint16_t port) {
+    (void) port;
+    return 0xff;
+}
+
+void port_byte_out(uint16_t port, uint8_t data) {
+    (void) port;
+    (void) data;
+}
+
+void serial_print(const char *string) {
+    (void) string;
+}
+
+void kprintf(int level, const char *format, ...) {
+    (void) level;
+    (void) format;
+}
+
+/* The timer wheel asks for a tickless deadline after every change */
+volatile uint32_t system_ticks;
+
+void clock_request_deadline(uint64_t deadline) {
+    (void) deadline;
+}
+
+void preempt_disable() {
+}
+
+void preempt_enable() {
+}
+
+/* Heap growth takes the anonymous path; the memory is never given back, as in the kernel */
+void *vm_alloc_anon(uint32_t bytes) {
+    bytes = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    return aligned_alloc(PAGE_SIZE, bytes);
+}
+
+uint32_t pmm_alloc_pages(int order) {
+    (void) order;
+    return 0;
+}
+
+int pmm_order_for(uint32_t bytes) {
+    int order = 0;
+    while (order <= PMM_MAX_ORDER && ((uint32_t) PAGE_SIZE << order) < bytes) order++;
+    return order;
+}
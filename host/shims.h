@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * Force-included (-include host/shims.h) into every file of the host
+ * benchmark build. The kernel sources compile unchanged; only the few
+ * things that touch hardware are pointed somewhere harmless here and in
+ * shims.c.
+ */
+
+#include <stdint.h>
+
+/* Text mode video memory: the display code writes into this buffer instead */
+#define HOST_VIDEO_SIZE 0x8000
+extern uint8_t host_video_memory[HOST_VIDEO_SIZE];
+#define VIDEO_ADDRESS ((uintptr_t) host_video_memory)
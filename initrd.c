@@ -0,0 +1,104 @@
+#include "initrd.h"
+#include "kernel.h"
+#include "klog.h"
+#include "kstring.h"
+
+static const uint8_t *image;
+static const initrd_header_t *header;
+static const uint32_t *displacements;
+static const initrd_file_t *files;
+
+static uint32_t path_hash(const char *path, uint32_t seed, uint32_t *length) {
+    uint32_t hash = INITRD_FNV_OFFSET ^ seed;
+    const char *p = path;
+    while (*p != '\0') {
+        hash ^= (uint8_t) *p++;
+        hash *= INITRD_FNV_PRIME;
+    }
+    *length = p - path;
+    return hash;
+}
+
+/* murmur3's finalizer over the hash and its bucket's displacement; the tool uses the same */
+static uint32_t slot_for(uint32_t hash, uint32_t displacement) {
+    uint32_t x = hash ^ displacement;
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x % header->file_count;
+}
+
+/* Offsets inside the image and a terminated path for every file, so lookups need no checks */
+static bool image_valid(const initrd_header_t *h, uint32_t loaded) {
+    if (h->magic != INITRD_MAGIC || h->size > loaded || h->size < sizeof(initrd_header_t)) return false;
+    if (h->bucket_count == 0 || (h->bucket_count & (h->bucket_count - 1))) return false;
+    if (h->displacements_offset > h->size || h->bucket_count > (h->size - h->displacements_offset) / 4) return false;
+    if (h->files_offset > h->size || h->file_count > (h->size - h->files_offset) / sizeof(initrd_file_t)) return false;
+
+    const uint8_t *base = (const uint8_t *) h;
+    const initrd_file_t *entries = (const initrd_file_t *) (base + h->files_offset);
+    for (uint32_t i = 0; i < h->file_count; i++) {
+        if (entries[i].data_offset > h->size || entries[i].size > h->size - entries[i].data_offset) return false;
+        uint32_t end = entries[i].path_offset;
+        while (end < h->size && base[end] != '\0') end++;
+        if (end >= h->size) return false;
+    }
+    return true;
+}
+
+bool initrd_init() {
+    if (initrd_sectors == 0) return false;
+    const initrd_header_t *h = (const initrd_header_t *) initrd_address;
+    if (!image_valid(h, initrd_sectors * 512)) {
+        kprintf(KLOG_WARN, "initrd: bad image at %x\n", initrd_address);
+        return false;
+    }
+    image = (const uint8_t *) h;
+    displacements = (const uint32_t *) (image + h->displacements_offset);
+    files = (const initrd_file_t *) (image + h->files_offset);
+    header = h;
+    return true;
+}
+
+const initrd_file_t *initrd_open(const char *path) {
+    if (!header || header->file_count == 0) return 0;
+    while (*path == '/') path++;
+
+    uint32_t length;
+    uint32_t hash = path_hash(path, header->seed, &length);
+    uint32_t displacement = displacements[hash & (header->bucket_count - 1)];
+    const initrd_file_t *file = &files[slot_for(hash, displacement)];
+    if (file->hash != hash) return 0;
+    if (memcmp(image + file->path_offset, path, length + 1) != 0) return 0;
+    return file;
+}
+
+uint32_t initrd_read(const initrd_file_t *file, uint32_t offset, uint32_t length, const void **data) {
+    if (offset >= file->size) return 0;
+    if (length > file->size - offset) length = file->size - offset;
+    *data = image + file->data_offset + offset;
+    return length;
+}
+
+const char *initrd_path(const initrd_file_t *file) {
+    return (const char *) image + file->path_offset;
+}
+
+uint32_t initrd_file_count() {
+    return header ? header->file_count : 0;
+}
+
+const initrd_file_t *initrd_file(uint32_t index) {
+    return index < initrd_file_count() ? &files[index] : 0;
+}
+
+void initrd_report() {
+    if (!header) {
+        kprintf(KLOG_INFO, "initrd: none\n");
+        return;
+    }
+    kprintf(KLOG_INFO, "initrd: %u files, %u KB at %x, %u hash buckets\n",
+            header->file_count, header->size / 1024, initrd_address, header->bucket_count);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Read-only initrd packed by tools/mkinitrd.py and loaded by the MBR
+ * right after the kernel. Paths are found through a minimal perfect hash
+ * the tool computed: FNV-1a of the path picks a bucket, the bucket's
+ * displacement picks the entry, and one compare confirms it. File data
+ * is never copied; reads hand out pointers into the image.
+ *
+ * Image layout, all offsets from the start of the image:
+ *   initrd_header_t
+ *   uint32_t displacements[bucket_count]
+ *   initrd_file_t files[file_count], in hash slot order
+ *   NUL-terminated paths
+ *   file data, each file INITRD_DATA_ALIGN aligned
+ */
+#define INITRD_MAGIC 0x44524e49 /* "INRD" */
+#define INITRD_DATA_ALIGN 16
+#define INITRD_FNV_OFFSET 0x811c9dc5u
+#define INITRD_FNV_PRIME 0x01000193u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;         /* bytes, the whole image */
+    uint32_t file_count;
+    uint32_t bucket_count; /* a power of two */
+    uint32_t seed;         /* mixed into the path hash */
+    uint32_t displacements_offset;
+    uint32_t files_offset;
+    uint32_t reserved;
+} initrd_header_t;
+
+typedef struct {
+    uint32_t hash; /* of the path with the image's seed */
+    uint32_t path_offset;
+    uint32_t data_offset;
+    uint32_t size;
+} initrd_file_t;
+
+/* Checks the image the MBR loaded; false (and every lookup fails) if there is none */
+bool initrd_init();
+
+/* The file at path, e.g. "nn/weights.bin" (a leading / is ignored), or 0 */
+const initrd_file_t *initrd_open(const char *path);
+
+/* Up to length bytes from offset as a pointer into the image; returns how many there are */
+uint32_t initrd_read(const initrd_file_t *file, uint32_t offset, uint32_t length, const void **data);
+
+const char *initrd_path(const initrd_file_t *file);
+
+uint32_t initrd_file_count();
+
+/* Files in hash order, for listing; 0 past the end */
+const initrd_file_t *initrd_file(uint32_t index);
+
+void initrd_report();
@@ -1,6 +1,9 @@
 ; Defined in isr.c
 [extern isr_handler]
 [extern irq_handler]
+[extern sched_switch_done]
+
+CPU_IRQ_ENTRY_TSC equ 8 ; offset in cpu_t, see percpu.h
 
 ; Common ISR code
 isr_common_stub:
@@ -11,8 +14,7 @@ isr_common_stub:
 	mov ax, 0x10  ; kernel data segment descriptor
 	mov ds, ax
 	mov es, ax
-	mov fs, ax
-	mov gs, ax
+	mov fs, ax ; GS keeps this CPU's percpu segment
 
     ; 2. Call C handler
     push esp ; push registers_t *r pointer
@@ -24,35 +26,34 @@ isr_common_stub:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 	popa
 	add esp, 8 ; Cleans up the pushed error code and pushed ISR number
 	iret ; pops 5 things at once: CS, EIP, EFLAGS, SS, and ESP
 
-; Common IRQ code. Identical to ISR code except for the 'call'
-; and the 'pop ebx'
+; Common IRQ code. Everything runs in ring 0 with the flat kernel
+; data segment loaded, so unlike the ISR path it leaves DS/ES/FS/GS
+; alone; DS is still pushed to keep the registers_t layout. GS is
+; based at this CPU's cpu_t.
 irq_common_stub:
     ; 1. Save CPU state
     pusha
+    rdtsc ; irq_handler charges entry-to-handler latency from this
+    mov [gs:CPU_IRQ_ENTRY_TSC], eax
+    mov [gs:CPU_IRQ_ENTRY_TSC + 4], edx
     mov ax, ds
     push eax
-    mov ax, 0x10
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
 
-    ; 2. Call C handler
+    ; 2. Call C handler. It returns the frame to resume in eax: the
+    ; same one, or another thread's saved frame if the scheduler
+    ; switched, in which case loading esp is the context switch.
     push esp
     call irq_handler ; Different than the ISR code
-    pop ebx  ; Different than the ISR code
+switch_context:
+    mov esp, eax
+    call sched_switch_done ; off the previous thread's stack now
+    add esp, 4 ; Drop the saved DS
 
     ; 3. Restore state
-    pop ebx
-    mov ds, bx
-    mov es, bx
-    mov fs, bx
-    mov gs, bx
     popa
     add esp, 8
     iret
@@ -381,4 +382,30 @@ irq14:
 irq15:
 	push byte 15
 	push byte 47
-	jmp irq_common_stub
\ No newline at end of file
+	jmp irq_common_stub
+
+; 48: Scheduler yield. A software interrupt, but it goes through the
+; IRQ path so the scheduler can switch threads on the way out
+global isr48
+isr48:
+	push byte 0
+	push byte 48
+	jmp irq_common_stub
+
+; 49, 50: Local APIC timer and reschedule IPI, see apic.h
+global isr49
+isr49:
+	push byte 0
+	push byte 49
+	jmp irq_common_stub
+
+global isr50
+isr50:
+	push byte 0
+	push byte 50
+	jmp irq_common_stub
+
+; 255: Local APIC spurious interrupt. Nothing to handle or acknowledge
+global isr255
+isr255:
+	iret
\ No newline at end of file
@@ -1,11 +1,26 @@
 #include "isr.h"
 
+#include "acct.h"
+#include "apic.h"
+#include "cpu.h"
 #include "display.h"
 #include "idt.h"
+#include "klog.h"
+#include "percpu.h"
+#include "sched.h"
+#include "spinlock.h"
 #include "ports.h"
 #include "util.h"
 
-isr_t interrupt_handlers[256];
+irq_action_t *interrupt_handlers[256];
+static irq_action_t irq_action_pool[MAX_IRQ_ACTIONS];
+static int irq_actions_used = 0;
+/* Serializes registration; dispatch walks the chains without it, see register_interrupt_handler */
+static lock_class_t irq_actions_class = LOCK_CLASS("irq_actions");
+static spinlock_t irq_actions_lock = SPINLOCK_INIT(&irq_actions_class);
+
+irq_stats_t irq_stats[256];
+static bool irq_timing = false;
 
 /* Can't do this with a loop because we need the address
  * of the function names */
@@ -74,6 +89,8 @@ void isr_install() {
     set_idt_gate(47, (uint32_t)irq15);
 
     load_idt(); // Load with ASM
+
+    irq_timing = cpu_has(CPU_FEATURE_TSC);
 }
 
 /* To print the message which defines every exception */
@@ -115,31 +132,128 @@ char *exception_messages[] = {
         "Reserved"
 };
 
+static void run_handlers(registers_t *r) {
+    irq_stats_t *stats = &irq_stats[r->int_no];
+    cpu_t *cpu = this_cpu();
+    uint32_t depth = ++cpu->irq_depth;
+    if (depth > stats->max_depth) stats->max_depth = depth;
+    uint64_t start = irq_timing ? rdtsc() : 0;
+
+    for (irq_action_t *action = interrupt_handlers[r->int_no]; action != 0; action = action->next) {
+        action->handler(r);
+    }
+
+    if (irq_timing) {
+        uint32_t cycles = (uint32_t) (rdtsc() - start);
+        if (stats->count == 0 || cycles < stats->min_cycles) stats->min_cycles = cycles;
+        if (cycles > stats->max_cycles) stats->max_cycles = cycles;
+        stats->total_cycles += cycles;
+    }
+    stats->count++;
+    cpu->irq_depth--;
+}
+
 void isr_handler(registers_t *regs) {
-    print_string("Received interrupt: ");
-    print_int(regs->int_no);
-    print_string("\nError Code: ");
-    print_int(regs->err_code);
-    print_string("\nHalting...\n");
+    /* Exceptions with a registered handler (e.g. page faults) are recoverable */
+    if (interrupt_handlers[regs->int_no] != 0) {
+        run_handlers(regs);
+        return;
+    }
+
+    kprintf(KLOG_PANIC, "Received interrupt: %d (%s)\nError Code: %d\nHalting...\n",
+            regs->int_no, regs->int_no < 32 ? exception_messages[regs->int_no] : "?", regs->err_code);
+    klog_panic();
 
     while (1) { asm volatile("hlt"); } // Halt system to prevent infinite loop
 }
 
 
 void register_interrupt_handler(uint8_t n, isr_t handler) {
-    interrupt_handlers[n] = handler;
+    uint32_t flags = spin_lock_irqsave(&irq_actions_lock);
+    if (irq_actions_used == MAX_IRQ_ACTIONS) {
+        spin_unlock_irqrestore(&irq_actions_lock, flags);
+        kprintf(KLOG_ERROR, "No free irq_action for vector %d\n", n);
+        return;
+    }
+    irq_action_t *action = &irq_action_pool[irq_actions_used++];
+    action->handler = handler;
+    action->next = 0;
+
+    /* Appended fully built, so a CPU dispatching this vector meanwhile sees the old chain or the new one */
+    irq_action_t **link = &interrupt_handlers[n];
+    while (*link != 0) link = &(*link)->next;
+    __atomic_store_n(link, action, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&irq_actions_lock, flags);
 }
 
-void irq_handler(registers_t *r) {
-    /* Handle the interrupt in a more modular way */
-    if (interrupt_handlers[r->int_no] != 0) {
-        isr_t handler = interrupt_handlers[r->int_no];
-        handler(r);
+static uint8_t pic_in_service(uint16_t command_port) {
+    port_byte_out(command_port, PIC_READ_ISR);
+    return port_byte_in(command_port);
+}
+
+/*
+ * IRQ7 and IRQ15 are what the PICs report when a request goes away
+ * before it is acknowledged. A real one has its in-service bit set; a
+ * spurious one must not be EOI'd (IRQ15 still needs one on the leader,
+ * which did see the cascade).
+ */
+static bool irq_is_spurious(registers_t *r) {
+    if (r->int_no == IRQ7 && !(pic_in_service(PIC1_COMMAND) & 0x80)) {
+        irq_stats[r->int_no].spurious++;
+        return true;
+    }
+    if (r->int_no == IRQ15 && !(pic_in_service(PIC2_COMMAND) & 0x80)) {
+        irq_stats[r->int_no].spurious++;
+        port_byte_out(PIC1_COMMAND, PIC_EOI);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * The only place IRQs are acknowledged; handlers must not send EOI
+ * themselves. Returns the frame irq_common_stub resumes, which is
+ * another thread's when the scheduler switches.
+ */
+registers_t *irq_handler(registers_t *r) {
+    uint64_t entry_tsc = this_cpu()->irq_entry_tsc; /* stored by irq_common_stub */
+    acct_irq_enter(r->int_no, entry_tsc);
+    if (irq_is_spurious(r)) {
+        acct_irq_exit();
+        return r;
     }
 
-    // EOI
-    if (r->int_no >= 40) {
-        port_byte_out(0xA0, 0x20); /* follower */
+    if (irq_timing) {
+        irq_stats_t *stats = &irq_stats[r->int_no];
+        uint32_t entry = (uint32_t) (rdtsc() - entry_tsc);
+        stats->entry_cycles += entry;
+        if (entry > stats->entry_max) stats->entry_max = entry;
+    }
+    run_handlers(r);
+
+    if (r->int_no <= IRQ15) {
+        if (r->int_no >= IRQ8) {
+            port_byte_out(PIC2_COMMAND, PIC_EOI); /* follower */
+        }
+        port_byte_out(PIC1_COMMAND, PIC_EOI); /* leader */
+    } else if (r->int_no == APIC_TIMER_VECTOR || r->int_no == APIC_RESCHEDULE_VECTOR) {
+        apic_eoi();
+    }
+    registers_t *next = sched_switch(r);
+    acct_irq_exit(); /* from here on the cycles belong to whichever thread resumes */
+    return next;
+}
+
+void irq_stats_dump() {
+    kprintf(KLOG_INFO, "vector   count  min/avg/max cycles  entry avg/max  depth  spurious\n");
+    for (int n = 0; n < 256; n++) {
+        irq_stats_t stats = irq_stats[n];
+        if (stats.count == 0 && stats.spurious == 0) continue;
+
+        uint32_t average = stats.count ? (uint32_t) udiv64_32(stats.total_cycles, stats.count) : 0;
+        uint32_t entry = stats.count ? (uint32_t) udiv64_32(stats.entry_cycles, stats.count) : 0;
+        kprintf(KLOG_CONT, "%6d %7u  %u/%u/%u  %u/%u  %5u  %8u\n", n, stats.count,
+                stats.min_cycles, average, stats.max_cycles, entry, stats.entry_max,
+                stats.max_depth, stats.spurious);
     }
-    port_byte_out(0x20, 0x20); /* leader */
 }
\ No newline at end of file
@@ -100,6 +100,16 @@ extern void irq14();
 
 extern void irq15();
 
+/* Software interrupt taken through the IRQ path, see SCHED_YIELD_VECTOR */
+extern void isr48();
+
+/* Local APIC vectors, see apic.h */
+extern void isr49();
+
+extern void isr50();
+
+extern void isr255();
+
 #define IRQ0 32
 #define IRQ1 33
 #define IRQ2 34
@@ -135,6 +145,40 @@ void isr_install();
 
 void isr_handler(registers_t *r);
 
+registers_t *irq_handler(registers_t *r);
+
 typedef void (*isr_t)(registers_t *);
 
-void register_interrupt_handler(uint8_t n, isr_t handler);
\ No newline at end of file
+/* Handlers registered on the same vector are chained and all called */
+typedef struct irq_action {
+    isr_t handler;
+    struct irq_action *next;
+} irq_action_t;
+
+#define MAX_IRQ_ACTIONS 64
+
+/* 8259 PIC ports and commands */
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI 0x20
+#define PIC_READ_ISR 0x0b
+
+/* Per-vector dispatch statistics, handler time in rdtsc cycles */
+typedef struct {
+    uint32_t count;
+    uint32_t spurious;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint64_t entry_cycles; /* irq_common_stub entry to the first handler */
+    uint32_t entry_max;
+    uint32_t max_depth;
+} irq_stats_t;
+
+extern irq_stats_t irq_stats[256];
+
+void register_interrupt_handler(uint8_t n, isr_t handler);
+
+void irq_stats_dump();
\ No newline at end of file
@@ -1,7 +1,51 @@
 [bits 32]
 [global _start]
+[global kernel_sectors]
+[global initrd_sectors]
+[global initrd_address]
 [extern main]
+[extern __bss_start]
+[extern _end]
+
+KERNEL_MAGIC equ 0x4b534f42 ; "BOSK"
 
 _start:
+    jmp short .entry
+
+    ; Header read by the MBR loader: magic at offset 4, image size in
+    ; sectors at offset 8 (written by the Makefile after linking), then the
+    ; initrd's size in sectors and load address (written when it is appended)
+    times 4 - ($ - $$) db 0x90
+    dd KERNEL_MAGIC
+kernel_sectors:
+    dd 0
+initrd_sectors:
+    dd 0
+initrd_address:
+    dd 0
+
+.entry:
+    ; Switch to the kernel's own GDT: the bootloader's copy sits at 0x7c00,
+    ; which is free memory once the kernel runs
+    lgdt [gdt_descriptor]
+    jmp CODE_SEG:.reload_segments
+.reload_segments:
+    mov ax, DATA_SEG
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; kernel.bin stops at the end of .data, so .bss is whatever was in RAM
+    mov edi, __bss_start
+    mov ecx, _end
+    sub ecx, edi
+    xor eax, eax
+    cld
+    rep stosb
+
     call main
-    jmp $
\ No newline at end of file
+    jmp $
+
+%include "gdt.asm"
@@ -1,40 +1,74 @@
+#include "acct.h"
+#include "ata.h"
+#include "bcache.h"
+#include "bench.h"
+#include "clock.h"
+#include "cpu.h"
 #include "display.h"
+#include "initrd.h"
 #include "isr.h"
+#include "kernel.h"
 #include "keyboard.h"
+#include "klog.h"
+#include "ktimer.h"
+#include "kstring.h"
+#include "memory.h"
+#include "nn.h"
+#include "paging.h"
+#include "percpu.h"
+#include "pmm.h"
 #include "ports.h"
+#include "profile.h"
+#include "sched.h"
+#include "serial.h"
+#include "shell.h"
+#include "smp.h"
+#include "util.h"
 #include <stdint.h>
 #include <stdbool.h>
 
-#define MAX_PROCESSES 2
+#define SIMULATED_PROCESSES 2
 #define TOTAL_TICKS 1000
 #define ENABLE_TESTS 1  // Set to 0 to disable tests
+#define ENABLE_BENCHMARKS 0  // Set to 1 to run the benchmarks at boot
+#define CONSOLE_BACKENDS (CONSOLE_VGA | CONSOLE_SERIAL)
+#define TICKLESS_IDLE 1  // One-shot timer instead of the 100 Hz tick once idle
+#define NN_ONLINE_TRAINING 1  // Retune the scheduler weights from each 1 s window
+#ifndef BENCH_SUITE
+#define BENCH_SUITE 0  // make bench builds with 1: run bench_suite_run() instead of the demo
+#endif
 
-typedef struct {
-    int weights[4];
-    int threshold;
-} NeuralNetwork;
-
-typedef struct {
-    int pid;
-    uint32_t cpu_time;
-    uint32_t wait_time;
-    int priority;
-    bool active;
-    uint32_t cpu_ticks;
-} Process;
-
-Process processes[MAX_PROCESSES];
-NeuralNetwork nn;
+Process *workers[SIMULATED_PROCESSES];
+static wait_queue_t deferred_wait = WAIT_QUEUE_INIT;
+static volatile bool deferred_pending = false;
+static uint32_t last_housekeeping = 0;
+static volatile int workers_running = 0;
+static wait_queue_t workers_done = WAIT_QUEUE_INIT;
+static uint64_t simulation_end;
 volatile uint32_t system_ticks = 0;
 
 // Timer and Interrupt Handlers
 void timer_callback(registers_t *regs) {
-    system_ticks++;
-    port_byte_out(0x20, 0x20);
+    clock_tick();
+    acct_tick();
+    profile_tick(regs);
+    sched_tick();
+    if (ktimer_tick(system_ticks)) deferred_kick();
+    // Log records to print, or the once a second housekeeping (predictor training)
+    if (klog_pending() || system_ticks - last_housekeeping >= TIMER_HZ) {
+        last_housekeeping = system_ticks;
+        deferred_kick();
+    }
+}
+
+void deferred_kick() {
+    deferred_pending = true;
+    wake_up(&deferred_wait);
 }
 
 void isr6_handler(registers_t *regs) {
-    print_string("\nInvalid Opcode!");
+    kprintf(KLOG_PANIC, "Invalid Opcode at %p\n", (void *) regs->eip);
+    klog_panic();
     asm volatile("cli; hlt");
 }
 
@@ -49,60 +83,30 @@ void init_timer() {
     port_byte_out(0xA1, 0x01);
 
     register_interrupt_handler(32, &timer_callback);
-    uint32_t divisor = 1193180 / 100;
-    port_byte_out(0x43, 0x36);
-    port_byte_out(0x40, divisor & 0xFF);
-    port_byte_out(0x40, divisor >> 8);
-}
-
-// Neural Network
-void init_neural_network() {
-    nn.weights[0] = 1;   // CPU time
-    nn.weights[1] = -2;  // Wait time
-    nn.weights[2] = 3;   // Priority
-    nn.weights[3] = 1;   // Memory
-    nn.threshold = 25;
-}
-
-int calculate_activation(Process *p) {
-    int features[4] = {
-        p->cpu_time / 200,
-        p->wait_time / 100,
-        p->priority * 2,
-        1
-    };
-
-    int activation = 0;
-    for(int i = 0; i < 4; i++)
-        activation += features[i] * nn.weights[i];
-    return activation;
-}
-
-int nn_predict(int activation) {
-    return activation > nn.threshold ? 1 : 0;
+    clock_init();
 }
 
 // CPU Analysis
-void analyze_cpu_usage() {
-    print_string("\nCPU Usage Report:\n");
-    int total_ticks = 0;
-
-    for(int i = 0; i < MAX_PROCESSES; i++)
-        total_ticks += processes[i].cpu_ticks;
-
-    for(int i = 0; i < MAX_PROCESSES; i++) {
-        int usage = (processes[i].cpu_ticks * 100) / (total_ticks ? total_ticks : 1);
-        int activation = calculate_activation(&processes[i]);
-
-        print_string("Process ");
-        print_int(processes[i].pid);
-        print_string(": ");
-        print_int(usage);
-        print_string("% [");
-        print_string(nn_predict(activation) ? "OPTIMAL" : "SUBOPTIMAL");
-        print_string("] (Score: ");
-        print_int(activation);
-        print_string(")\n");
+void analyze_cpu_usage(uint64_t elapsed_ns) {
+    kprintf(KLOG_CONT, "\nCPU Usage Report: %u us, %u timer interrupts\n",
+            (uint32_t) udiv64_32(elapsed_ns, 1000), clock_interrupts());
+    acct_report();
+
+    // The workers have exited, so score their slots through a mask of our own
+    uint32_t worker_mask[(MAX_PROCESSES + 31) / 32] = {0};
+    for(int i = 0; i < SIMULATED_PROCESSES; i++)
+        worker_mask[workers[i]->slot >> 5] |= 1u << (workers[i]->slot & 31);
+    ProcessTable worker_table = process_table;
+    worker_table.active = worker_mask;
+    int32_t activations[MAX_PROCESSES];
+    int best = nn_score_batch(&worker_table, activations);
+
+    for(int i = 0; i < SIMULATED_PROCESSES; i++) {
+        uint32_t usage = acct_permille(workers[i]->cpu_cycles);
+        int activation = activations[workers[i]->slot];
+        kprintf(KLOG_CONT, "Process %d: %u.%u%% [%s] (Score: %d)%s\n", workers[i]->pid,
+                usage / 10, usage % 10, nn_predict(activation) ? "OPTIMAL" : "SUBOPTIMAL",
+                activation, workers[i]->slot == best ? " <- best" : "");
     }
 }
 
@@ -110,11 +114,8 @@ void analyze_cpu_usage() {
 void test_nn_functions() {
     print_string("\nRunning AI Scheduler Tests...\n");
 
-    Process test_p1 = {1, 400, 50, 4, true, 0};
-    Process test_p2 = {2, 100, 200, 5, true, 0};
-
-    int act1 = calculate_activation(&test_p1);
-    int act2 = calculate_activation(&test_p2);
+    int act1 = nn_activation(400, 50, 4);
+    int act2 = nn_activation(100, 200, 5);
 
     print_string("Test 1 - Activation: ");
     print_int(act1);
@@ -133,55 +134,121 @@ void test_nn_functions() {
     print_string("AI Scheduler Tests Completed!\n");
 }
 
+// Kernel and initrd size and the time the MBR spent reading them
+void report_boot_load() {
+    volatile uint64_t *stamps = (volatile uint64_t *) BOOT_LOAD_CYCLES_ADDRESS;
+    uint64_t cycles = stamps[1] - stamps[0];
+    uint32_t khz = clock_tsc_khz();
+    uint32_t us = khz ? (uint32_t) udiv64_32(cycles * 1000, khz) : 0;
+    kprintf(KLOG_INFO, "boot: loaded %u KB kernel and %u KB initrd in %u us\n",
+            kernel_sectors / 2, initrd_sectors / 2, us);
+}
+
+// Work interrupt handlers leave for process context
+void run_deferred_work() {
+    keyboard_poll();
+    shell_poll();
+    ktimer_run_expired();
+    mem_train_predictor();
+    klog_drain();
+}
+
+// Highest-priority thread; sleeps until an interrupt hands it work
+void deferred_work_thread(void *arg) {
+    (void) arg;
+    while(1) {
+        deferred_pending = false;
+        run_deferred_work();
+        wait_event(&deferred_wait, deferred_pending);
+    }
+}
+
+// CPU-bound load for the scheduler: runs until the simulation ends
+void process_worker(void *arg) {
+    (void) arg;
+    while(ktime_get() < simulation_end);
+    __atomic_fetch_sub(&workers_running, 1, __ATOMIC_RELEASE);
+    wake_up(&workers_done);
+}
+
 int main() {
+    percpu_init(0);
+    cpu_init();
+    acct_init();
+    kstring_init();
     clear_screen();
     isr_install();
     register_interrupt_handler(6, &isr6_handler);
+    init_serial();
+    console_set_backends(CONSOLE_BACKENDS);
     init_timer();
+    report_boot_load();
+    initrd_init();
+    initrd_report();
+    pmm_init();
+    pmm_report();
+    paging_init();
+    paging_report();
+    init_dynamic_mem();
     init_neural_network();
     init_keyboard();
+    init_shell();
+    ktimer_system_init();
+    ata_init();
+    ata_report();
+    sched_init();
+    nn_set_training(NN_ONLINE_TRAINING);
+    thread_create("deferred", deferred_work_thread, 0, 9);
+    bcache_init();
+    smp_init();
     asm volatile("sti");
 
+#if BENCH_SUITE
+    bench_suite_run();
+#endif
+
+#if ENABLE_BENCHMARKS
+    bench_console();
+    bench_keyboard();
+    bench_memory();
+    bench_pmm();
+    bench_paging();
+    bench_nn_score();
+    bench_ktimer();
+    bench_disk();
+    bench_bcache();
+    bench_initrd();
+    bench_smp();
+#endif
+
 #if ENABLE_TESTS
     test_nn_functions();
 #endif
 
-    // Initialize processes
-    processes[0] = (Process){1, 300, 150, 4, true, 0};
-    processes[1] = (Process){2, 200, 100, 5, true, 0};
-
-    uint32_t start_ticks = system_ticks;
-    int last_selected = -1;
-    int consecutive = 0;
-
-    while(system_ticks < start_ticks + TOTAL_TICKS) {
-        int max_activation = -1000;
-        int selected = 0;
-
-        for(int i = 0; i < MAX_PROCESSES; i++) {
-            if(!processes[i].active) continue;
-
-            int activation = calculate_activation(&processes[i]);
-            if(activation > max_activation) {
-                max_activation = activation;
-                selected = i;
-            }
-        }
-
-        if(selected == last_selected) {
-            if(++consecutive >= 2) {
-                selected = (selected + 1) % MAX_PROCESSES;
-                consecutive = 0;
-            }
-        } else {
-            consecutive = 0;
-        }
-
-        processes[selected].cpu_ticks++;
-        last_selected = selected;
+    // Start the simulated processes as kernel threads; the boot thread idles
+    uint64_t start_time = ktime_get();
+    simulation_end = start_time + (uint64_t) TOTAL_TICKS * NSEC_PER_TICK;
+    workers_running = SIMULATED_PROCESSES;
+
+    acct_reset();
+    uint32_t flags = irq_save();
+    workers[0] = thread_create("process 1", process_worker, 0, 4);
+    process_table.cpu_time[workers[0]->slot] = 300;
+    process_table.wait_time[workers[0]->slot] = 150;
+    workers[1] = thread_create("process 2", process_worker, 0, 5);
+    process_table.cpu_time[workers[1]->slot] = 200;
+    process_table.wait_time[workers[1]->slot] = 100;
+    irq_restore(flags);
+
+    // The boot thread is the idle thread: this halts until the last worker is done
+    wait_event(&workers_done, workers_running == 0);
+
+    analyze_cpu_usage(ktime_get() - start_time);
+    keyboard_print_stats();
+    clock_set_tickless(TICKLESS_IDLE);
+    kprintf(KLOG_CONT, "> ");
+    while(1) {
+        asm volatile("hlt");
     }
-
-    analyze_cpu_usage();
-    while(1) asm volatile("hlt");
     return 0;
 }
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Incremented by the timer interrupt (100 Hz) */
+extern volatile uint32_t system_ticks;
+
+/* Image size from the header kernel-entry.asm carries, filled in by the Makefile */
+extern uint32_t kernel_sectors;
+
+/* Where the MBR put the initrd appended to the image; 0 sectors without one */
+extern uint32_t initrd_sectors;
+extern uint32_t initrd_address;
+
+/* Wakes the deferred work thread (keyboard, shell, klog); safe from interrupt context */
+void deferred_kick();
+
+/* mbr.asm leaves rdtsc from before and after loading the kernel and initrd here */
+#define BOOT_LOAD_CYCLES_ADDRESS 0x4f0
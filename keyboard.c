@@ -1,236 +1,216 @@
 #include "keyboard.h"
-#include "ports.h"
-#include "isr.h"
+#include "cpu.h"
 #include "display.h"
+#include "isr.h"
+#include "kernel.h"
+#include "klog.h"
+#include "ports.h"
+#include "sched.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCANCODE_RELEASE 0x80
+#define SCANCODE_EXTENDED 0xe0
+
+#define SC_LCTRL 0x1d
+#define SC_LSHIFT 0x2a
+#define SC_RSHIFT 0x36
+#define SC_LALT 0x38
+#define SC_CAPS_LOCK 0x3a
+
+/* US layout, scancode set 1 */
+static const uint8_t keymap_normal[0x59] = {
+    0, 27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
+    '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
+    0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',
+    0, '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0,
+    '*', 0, ' ', 0,
+    KEY_F1, KEY_F1 + 1, KEY_F1 + 2, KEY_F1 + 3, KEY_F1 + 4,
+    KEY_F1 + 5, KEY_F1 + 6, KEY_F1 + 7, KEY_F1 + 8, KEY_F1 + 9,
+    0, 0, /* Num Lock, Scroll Lock */
+    '7', '8', '9', '-', '4', '5', '6', '+', '1', '2', '3', '0', '.',
+    0, 0, 0, KEY_F1 + 10, KEY_F1 + 11
+};
+
+static const uint8_t keymap_shift[0x59] = {
+    0, 27, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
+    '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
+    0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~',
+    0, '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0,
+    '*', 0, ' ', 0,
+    KEY_F1, KEY_F1 + 1, KEY_F1 + 2, KEY_F1 + 3, KEY_F1 + 4,
+    KEY_F1 + 5, KEY_F1 + 6, KEY_F1 + 7, KEY_F1 + 8, KEY_F1 + 9,
+    0, 0,
+    '7', '8', '9', '-', '4', '5', '6', '+', '1', '2', '3', '0', '.',
+    0, 0, 0, KEY_F1 + 10, KEY_F1 + 11
+};
 
-void handle_backspace() {
-    int offset = get_cursor();
+/* Keys behind the 0xe0 prefix, indexed by the second byte */
+static const uint8_t keymap_extended[0x59] = {
+    [0x1c] = '\n', [0x35] = '/',
+    [0x47] = KEY_HOME, [0x48] = KEY_UP, [0x49] = KEY_PAGE_UP,
+    [0x4b] = KEY_LEFT, [0x4d] = KEY_RIGHT,
+    [0x4f] = KEY_END, [0x50] = KEY_DOWN, [0x51] = KEY_PAGE_DOWN,
+    [0x52] = KEY_INSERT, [0x53] = KEY_DELETE
+};
+
+/* Raw scancodes: written only by IRQ1, read only by keyboard_poll */
+static volatile uint8_t scancode_buffer[SCANCODE_BUFFER_SIZE];
+static volatile uint32_t scancode_head = 0;
+static volatile uint32_t scancode_tail = 0;
+static volatile uint32_t scancodes_dropped = 0;
+
+static key_event_t key_buffer[KEY_BUFFER_SIZE];
+static uint32_t key_head = 0;
+static uint32_t key_tail = 0;
+
+/* read_key() callers waiting for a scancode */
+static wait_queue_t keyboard_wait = WAIT_QUEUE_INIT;
 
-    if(offset > 0) {
-        offset -= 2;
+static uint8_t modifiers = 0;
+static bool extended_prefix = false;
 
-        set_char_at_video_memory(' ', offset);
+/* IRQ1 handler cost in cycles */
+static uint32_t irq_count = 0;
+static uint64_t irq_cycles_total = 0;
+static uint32_t irq_cycles_max = 0;
 
-        set_cursor(offset);
+void keyboard_queue_scancode(uint8_t scancode) {
+    if (scancode_head - scancode_tail < SCANCODE_BUFFER_SIZE) {
+        scancode_buffer[scancode_head & (SCANCODE_BUFFER_SIZE - 1)] = scancode;
+        __atomic_store_n(&scancode_head, scancode_head + 1, __ATOMIC_RELEASE);
+    } else {
+        scancodes_dropped++;
     }
+    wake_up(&keyboard_wait);
+    deferred_kick();
 }
 
-void print_letter(uint8_t scancode) {
-    switch (scancode) {
-        case 0x0:
-            print_string("ERROR");
-            break;
-        case 0x1:
-            print_string("ESC");
-            break;
-        case 0x2:
-            print_string("1");
-            break;
-        case 0x3:
-            print_string("2");
-            break;
-        case 0x4:
-            print_string("3");
-            break;
-        case 0x5:
-            print_string("4");
-            break;
-        case 0x6:
-            print_string("5");
-            break;
-        case 0x7:
-            print_string("6");
-            break;
-        case 0x8:
-            print_string("7");
-            break;
-        case 0x9:
-            print_string("8");
-            break;
-        case 0x0A:
-            print_string("9");
-            break;
-        case 0x0B:
-            print_string("0");
-            break;
-        case 0x0C:
-            print_string("-");
-            break;
-        case 0x0D:
-            print_string("+");
-            break;
-        case 0x0E:
-            handle_backspace();
-            break;
-        case 0x0F:
-            print_string("    ");
-            break;
-        case 0x10:
-            print_string("Q");
-            break;
-        case 0x11:
-            print_string("W");
-            break;
-        case 0x12:
-            print_string("E");
-            break;
-        case 0x13:
-            print_string("R");
-            break;
-        case 0x14:
-            print_string("T");
-            break;
-        case 0x15:
-            print_string("Y");
-            break;
-        case 0x16:
-            print_string("U");
-            break;
-        case 0x17:
-            print_string("I");
-            break;
-        case 0x18:
-            print_string("O");
-            break;
-        case 0x19:
-            print_string("P");
-            break;
-        case 0x1A:
-            print_string("[");
-            break;
-        case 0x1B:
-            print_string("]");
-            break;
-        case 0x1C:
-            print_nl();
-            break;
-        case 0x1D:
-            print_string("LCtrl");
-            break;
-        case 0x1E:
-            print_string("A");
-            break;
-        case 0x1F:
-            print_string("S");
-            break;
-        case 0x20:
-            print_string("D");
-            break;
-        case 0x21:
-            print_string("F");
-            break;
-        case 0x22:
-            print_string("G");
-            break;
-        case 0x23:
-            print_string("H");
-            break;
-        case 0x24:
-            print_string("J");
-            break;
-        case 0x25:
-            print_string("K");
-            break;
-        case 0x26:
-            print_string("L");
-            break;
-        case 0x27:
-            print_string(";");
-            break;
-        case 0x28:
-            print_string("'");
-            break;
-        case 0x29:
-            print_string("`");
-            break;
-        case 0x2A:
-            print_string("LShift");
-            break;
-        case 0x2B:
-            print_string("\\");
-            break;
-        case 0x2C:
-            print_string("Z");
-            break;
-        case 0x2D:
-            print_string("X");
-            break;
-        case 0x2E:
-            print_string("C");
-            break;
-        case 0x2F:
-            print_string("V");
-            break;
-        case 0x30:
-            print_string("B");
-            break;
-        case 0x31:
-            print_string("N");
-            break;
-        case 0x32:
-            print_string("M");
-            break;
-        case 0x33:
-            print_string(",");
-            break;
-        case 0x34:
-            print_string(".");
-            break;
-        case 0x35:
-            print_string("/");
-            break;
-        case 0x36:
-            print_string("Rshift");
-            break;
-        case 0x37:
-            print_string("Keypad *");
-            break;
-        case 0x38:
-            print_string("LAlt");
-            break;
-        case 0x39:
-            print_string(" ");
-            break;
+static void keyboard_callback(registers_t *regs) {
+    (void) regs;
+    uint64_t start = rdtsc();
+
+    keyboard_queue_scancode(port_byte_in(KEYBOARD_DATA_PORT));
+
+    uint32_t cycles = (uint32_t) (rdtsc() - start);
+    irq_count++;
+    irq_cycles_total += cycles;
+    if (cycles > irq_cycles_max) irq_cycles_max = cycles;
+}
+
+static void update_modifier(uint8_t code, bool released) {
+    uint8_t bit;
+    switch (code) {
+        case SC_LSHIFT:
+        case SC_RSHIFT:
+            bit = KEY_MOD_SHIFT;
+            break;
+        case SC_LCTRL:
+            bit = KEY_MOD_CTRL;
+            break;
+        case SC_LALT:
+            bit = KEY_MOD_ALT;
+            break;
+        case SC_CAPS_LOCK:
+            if (!released) modifiers ^= KEY_MOD_CAPS_LOCK;
+            return;
         default:
-            break;
+            return;
+    }
+    if (released) {
+        modifiers &= ~bit;
+    } else {
+        modifiers |= bit;
     }
 }
 
-#include "ports.h"
-#include "display.h"
-#include <stdint.h>
-
-#define BACKSPACE 0x0E
-#define ENTER 0x1C
+static void echo_key(uint8_t key) {
+    char text[2] = {key, 0};
+    if (key == '\n' || key == '\b' || key == '\t' || (key >= ' ' && key < 0x7f)) {
+        print_string(text);
+    }
+}
 
-// US keyboard layout (scancode set 1)
-char scancode_table[] = {
-    0,  27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', // Backspace
-    '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', // Enter
-    0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',
-    0, '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0,
-    '*', 0, ' ', 0 // Spacebar
-};
+/* Returns the key for a scancode, or 0 for modifiers, releases and unknown codes */
+static uint8_t decode_scancode(uint8_t scancode) {
+    if (scancode == SCANCODE_EXTENDED) {
+        extended_prefix = true;
+        return 0;
+    }
+    bool extended = extended_prefix;
+    extended_prefix = false;
 
-// Function to get the pressed key
-char get_key_pressed() {
-    uint8_t scancode = port_byte_in(0x60); // Read from keyboard port
+    bool released = scancode & SCANCODE_RELEASE;
+    uint8_t code = scancode & ~SCANCODE_RELEASE;
 
-    if (scancode & 0x80) {
-        // Ignore key releases (MSB set)
+    /* Right Ctrl/Alt share codes with the left ones; e0 2a/e0 36 are fake shifts */
+    if (code == SC_LCTRL || code == SC_LALT || code == SC_CAPS_LOCK ||
+        (!extended && (code == SC_LSHIFT || code == SC_RSHIFT))) {
+        update_modifier(code, released);
         return 0;
     }
+    if (released || code >= sizeof(keymap_normal)) return 0;
+
+    if (extended) return keymap_extended[code];
 
-    return scancode_table[scancode]; // Convert scancode to ASCII
+    uint8_t key = keymap_normal[code];
+    bool shift = modifiers & KEY_MOD_SHIFT;
+    if (key >= 'a' && key <= 'z' && (modifiers & KEY_MOD_CAPS_LOCK)) {
+        shift = !shift;
+    }
+    if (shift) key = keymap_shift[code];
+    if ((modifiers & KEY_MOD_CTRL) && ((key >= 'a' && key <= 'z') || (key >= 'A' && key <= 'Z'))) {
+        key &= 0x1f;
+    }
+    return key;
 }
 
+void keyboard_poll() {
+    while (scancode_tail != __atomic_load_n(&scancode_head, __ATOMIC_ACQUIRE)) {
+        uint8_t scancode = scancode_buffer[scancode_tail & (SCANCODE_BUFFER_SIZE - 1)];
+        scancode_tail++;
 
-static void keyboard_callback(registers_t *regs) {
-    uint8_t scancode = port_byte_in(0x60);
-    print_letter(scancode);
+        uint8_t key = decode_scancode(scancode);
+        if (key == 0) continue;
+
+        echo_key(key);
+        if (key_head - key_tail < KEY_BUFFER_SIZE) {
+            key_buffer[key_head & (KEY_BUFFER_SIZE - 1)] = (key_event_t) {key, modifiers};
+            key_head++;
+        }
+    }
+}
+
+bool try_read_key(key_event_t *event) {
+    keyboard_poll();
+    if (key_tail == key_head) return false;
+    *event = key_buffer[key_tail & (KEY_BUFFER_SIZE - 1)];
+    key_tail++;
+    return true;
+}
+
+key_event_t read_key() {
+    key_event_t event;
+    while (!try_read_key(&event)) {
+        wait_event(&keyboard_wait, scancode_tail != scancode_head);
+    }
+    return event;
+}
+
+void keyboard_print_stats() {
+    uint32_t flags = irq_save();
+    uint32_t count = irq_count;
+    uint64_t total = irq_cycles_total;
+    uint32_t max = irq_cycles_max;
+    irq_restore(flags);
+
+    uint32_t average = count ? (uint32_t) udiv64_32(total, count) : 0;
+    kprintf(KLOG_INFO, "IRQ1: %u interrupts, avg %u cycles, max %u cycles, %u scancodes dropped\n",
+            count, average, max, scancodes_dropped);
 }
 
 void init_keyboard() {
     register_interrupt_handler(IRQ1, keyboard_callback);
-
 }
@@ -1,5 +1,47 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEYBOARD_DATA_PORT 0x60
+
+#define SCANCODE_BUFFER_SIZE 64 /* powers of two */
+#define KEY_BUFFER_SIZE 64
+
+/* Modifier state carried with every key event */
+#define KEY_MOD_SHIFT 0x01
+#define KEY_MOD_CTRL 0x02
+#define KEY_MOD_ALT 0x04
+#define KEY_MOD_CAPS_LOCK 0x08
+
+/* Keys without an ASCII code; everything below 0x80 is plain ASCII */
+#define KEY_UP 0x80
+#define KEY_DOWN 0x81
+#define KEY_LEFT 0x82
+#define KEY_RIGHT 0x83
+#define KEY_HOME 0x84
+#define KEY_END 0x85
+#define KEY_PAGE_UP 0x86
+#define KEY_PAGE_DOWN 0x87
+#define KEY_INSERT 0x88
+#define KEY_DELETE 0x89
+#define KEY_F1 0x90 /* KEY_F1 + n - 1 for Fn, up to F12 */
+
+typedef struct {
+    uint8_t key;
+    uint8_t modifiers;
+} key_event_t;
+
 void init_keyboard();
-void handle_backspace();
-char get_key_pressed();
\ No newline at end of file
+
+/* IRQ1's work once the scancode is read: queue it for keyboard_poll(); bench_keyboard() calls it too */
+void keyboard_queue_scancode(uint8_t scancode);
+
+/* Decodes the scancodes queued by IRQ1 and echoes them; call outside interrupt context */
+void keyboard_poll();
+
+bool try_read_key(key_event_t *event);
+
+key_event_t read_key();
+
+void keyboard_print_stats();
@@ -0,0 +1,115 @@
+#include "klog.h"
+#include "display.h"
+#include "kernel.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Records are reserved by advancing klog_head with a compare-and-swap, so
+ * an interrupt that logs while the interrupted code is in the middle of a
+ * kprintf just takes the next slot. The drain stops at the first record
+ * that is reserved but not yet committed.
+ */
+static klog_record_t klog_ring[KLOG_RECORDS];
+static volatile uint32_t klog_head = 0;
+static volatile uint32_t klog_tail = 0;
+static volatile uint32_t klog_dropped_records = 0;
+static uint32_t klog_reported_drops = 0;
+static volatile bool klog_panicking = false;
+
+static char *klog_level_names[] = {
+        "PANIC: ",
+        "ERROR: ",
+        "WARNING: ",
+        "",
+        "debug: "
+};
+
+static bool klog_reserve(uint32_t *seq) {
+    uint32_t head = klog_head;
+    do {
+        if (head - klog_tail >= KLOG_RECORDS) {
+            __atomic_fetch_add(&klog_dropped_records, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&klog_head, &head, head + 1, false,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    *seq = head;
+    return true;
+}
+
+void kprintf(int level, const char *format, ...) {
+    uint32_t seq;
+    if (!klog_reserve(&seq)) return;
+
+    klog_record_t *record = &klog_ring[seq & (KLOG_RECORDS - 1)];
+    record->ticks = system_ticks;
+    record->level = level;
+
+    va_list args;
+    va_start(args, format);
+    kvsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+
+    __atomic_store_n(&record->committed, seq + 1, __ATOMIC_RELEASE);
+
+    if (klog_panicking) {
+        klog_drain();
+    }
+}
+
+static void klog_print_record(klog_record_t *record) {
+    if (record->level != KLOG_CONT) {
+        char header[24];
+        ksnprintf(header, sizeof(header), "[%5u.%02u] ", record->ticks / 100, record->ticks % 100);
+        print_string(header);
+        if (record->level <= KLOG_DEBUG) {
+            print_string(klog_level_names[record->level]);
+        }
+    }
+    print_string(record->text);
+}
+
+/* A panic can interrupt a kprintf half way, so it skips incomplete records */
+static void klog_drain_records(bool skip_incomplete) {
+    uint32_t tail = klog_tail;
+    while (tail != klog_head) {
+        klog_record_t *record = &klog_ring[tail & (KLOG_RECORDS - 1)];
+        if (__atomic_load_n(&record->committed, __ATOMIC_ACQUIRE) == tail + 1) {
+            klog_print_record(record);
+        } else if (!skip_incomplete) {
+            break;
+        }
+        tail++;
+        __atomic_store_n(&klog_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    uint32_t dropped = klog_dropped_records;
+    if (dropped != klog_reported_drops) {
+        char message[48];
+        ksnprintf(message, sizeof(message), "[klog: %u records dropped]\n", dropped - klog_reported_drops);
+        print_string(message);
+        klog_reported_drops = dropped;
+    }
+}
+
+void klog_drain() {
+    klog_drain_records(klog_panicking);
+}
+
+bool klog_pending() {
+    return klog_tail != klog_head;
+}
+
+void klog_panic() {
+    klog_panicking = true;
+    console_force_unlock();
+    klog_drain_records(true);
+}
+
+uint32_t klog_dropped() {
+    return klog_dropped_records;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Severity levels, most severe first */
+#define KLOG_PANIC 0
+#define KLOG_ERROR 1
+#define KLOG_WARN 2
+#define KLOG_INFO 3
+#define KLOG_DEBUG 4
+/* Plain console text: printed without a timestamp or level */
+#define KLOG_CONT 5
+
+#define KLOG_RECORDS 64 /* must be a power of two */
+#define KLOG_MESSAGE_SIZE 116
+
+typedef struct {
+    volatile uint32_t committed; /* sequence number + 1 once the text is complete */
+    uint32_t ticks;
+    uint8_t level;
+    char text[KLOG_MESSAGE_SIZE + 1];
+} klog_record_t;
+
+/* Safe from interrupt context: only formats into the ring */
+void kprintf(int level, const char *format, ...);
+
+/* Prints every completed record; call outside interrupt context */
+void klog_drain();
+
+/* True while records are waiting for klog_drain() */
+bool klog_pending();
+
+/* Flushes the ring synchronously and makes every later kprintf print directly */
+void klog_panic();
+
+uint32_t klog_dropped();
@@ -0,0 +1,175 @@
+#include "kstring.h"
+#include "cpu.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default to the plain x86 paths until kstring_init() has looked at CPUID */
+static void *(*memcpy_impl)(void *, const void *, size_t) = memcpy_rep;
+static void *(*memset_impl)(void *, int, size_t) = memset_rep;
+
+void kstring_init() {
+    if (cpu_has(CPU_FEATURE_SSE2)) {
+        memcpy_impl = memcpy_sse2;
+        memset_impl = memset_sse2;
+    }
+}
+
+/* Byte copy of the unaligned head, rep movsd for the body, bytes for the tail */
+void *memcpy_rep(void *dest, const void *src, size_t n) {
+    void *d = dest;
+    size_t head = (-(uint32_t) dest) & 3;
+    if (head > n) head = n;
+    n -= head;
+    size_t dwords = n >> 2;
+    size_t tail = n & 3;
+
+    asm volatile("rep movsb\n\t"
+                 "mov %3, %%ecx\n\t"
+                 "rep movsl\n\t"
+                 "mov %4, %%ecx\n\t"
+                 "rep movsb"
+                 : "+D" (d), "+S" (src), "+c" (head)
+                 : "r" (dwords), "r" (tail)
+                 : "memory");
+    return dest;
+}
+
+void *memcpy_sse2(void *dest, const void *src, size_t n) {
+    if (n < KSTRING_SSE2_THRESHOLD) {
+        return memcpy_rep(dest, src, n);
+    }
+
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    size_t head = (-(uint32_t) d) & 15;
+    memcpy_rep(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n >> 6;
+    /*
+     * xmm registers are not saved across interrupts or thread switches. The
+     * kernel is built without SSE code generation, so they need no clobbers.
+     */
+    uint32_t flags = irq_save();
+    asm volatile("1:\n\t"
+                 "movdqu   (%0), %%xmm0\n\t"
+                 "movdqu 16(%0), %%xmm1\n\t"
+                 "movdqu 32(%0), %%xmm2\n\t"
+                 "movdqu 48(%0), %%xmm3\n\t"
+                 "movdqa %%xmm0,   (%1)\n\t"
+                 "movdqa %%xmm1, 16(%1)\n\t"
+                 "movdqa %%xmm2, 32(%1)\n\t"
+                 "movdqa %%xmm3, 48(%1)\n\t"
+                 "add $64, %0\n\t"
+                 "add $64, %1\n\t"
+                 "dec %2\n\t"
+                 "jnz 1b"
+                 : "+r" (s), "+r" (d), "+r" (blocks)
+                 :
+                 : "memory", "cc");
+    irq_restore(flags);
+
+    memcpy_rep(d, s, n & 63);
+    return dest;
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+    return memcpy_impl(dest, src, n);
+}
+
+/* Copy from the top down so an overlapping source is read before it is overwritten */
+static void memmove_backward(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *) dest + n - 1;
+    const uint8_t *s = (const uint8_t *) src + n - 1;
+    size_t tail = n & 3;
+
+    asm volatile("std\n\t"
+                 "rep movsb\n\t"
+                 "sub $3, %%esi\n\t"
+                 "sub $3, %%edi\n\t"
+                 "mov %3, %%ecx\n\t"
+                 "rep movsl\n\t"
+                 "cld"
+                 : "+D" (d), "+S" (s), "+c" (tail)
+                 : "r" (n >> 2)
+                 : "memory", "cc");
+}
+
+void *memmove(void *dest, const void *src, size_t n) {
+    if ((uint8_t *) dest <= (const uint8_t *) src || (uint8_t *) dest >= (const uint8_t *) src + n) {
+        return memcpy_impl(dest, src, n);
+    }
+    memmove_backward(dest, src, n);
+    return dest;
+}
+
+void *memset_rep(void *dest, int c, size_t n) {
+    void *d = dest;
+    uint32_t pattern = (uint8_t) c * 0x01010101u;
+    size_t head = (-(uint32_t) dest) & 3;
+    if (head > n) head = n;
+    n -= head;
+    size_t dwords = n >> 2;
+    size_t tail = n & 3;
+
+    asm volatile("rep stosb\n\t"
+                 "mov %3, %%ecx\n\t"
+                 "rep stosl\n\t"
+                 "mov %4, %%ecx\n\t"
+                 "rep stosb"
+                 : "+D" (d), "+c" (head)
+                 : "a" (pattern), "r" (dwords), "r" (tail)
+                 : "memory");
+    return dest;
+}
+
+void *memset_sse2(void *dest, int c, size_t n) {
+    if (n < KSTRING_SSE2_THRESHOLD) {
+        return memset_rep(dest, c, n);
+    }
+
+    uint8_t *d = dest;
+    size_t head = (-(uint32_t) d) & 15;
+    memset_rep(d, c, head);
+    d += head;
+    n -= head;
+
+    size_t blocks = n >> 6;
+    uint32_t pattern = (uint8_t) c * 0x01010101u;
+    uint32_t flags = irq_save();
+    asm volatile("movd %2, %%xmm0\n\t"
+                 "pshufd $0, %%xmm0, %%xmm0\n\t"
+                 "1:\n\t"
+                 "movdqa %%xmm0,   (%0)\n\t"
+                 "movdqa %%xmm0, 16(%0)\n\t"
+                 "movdqa %%xmm0, 32(%0)\n\t"
+                 "movdqa %%xmm0, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b"
+                 : "+r" (d), "+r" (blocks)
+                 : "r" (pattern)
+                 : "memory", "cc");
+    irq_restore(flags);
+
+    memset_rep(d, c, n & 63);
+    return dest;
+}
+
+void *memset(void *dest, int c, size_t n) {
+    return memset_impl(dest, c, n);
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+    const uint8_t *x = a;
+    const uint8_t *y = b;
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) {
+            return x[i] - y[i];
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Copies at least this long take the SSE2 path when it is available */
+#define KSTRING_SSE2_THRESHOLD 256
+
+void kstring_init();
+
+void *memcpy(void *dest, const void *src, size_t n);
+
+void *memmove(void *dest, const void *src, size_t n);
+
+void *memset(void *dest, int c, size_t n);
+
+int memcmp(const void *a, const void *b, size_t n);
+
+/* Individual implementations, exposed for the benchmarks */
+void *memcpy_rep(void *dest, const void *src, size_t n);
+
+void *memcpy_sse2(void *dest, const void *src, size_t n);
+
+void *memset_rep(void *dest, int c, size_t n);
+
+void *memset_sse2(void *dest, int c, size_t n);
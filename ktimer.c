@@ -0,0 +1,288 @@
+#include "ktimer.h"
+#include "clock.h"
+#include "cpu.h"
+#include "kernel.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+static ktimer_wheel_t system_wheel;
+
+void ktimer_wheel_init(ktimer_wheel_t *wheel, uint32_t now) {
+    ktimer_t **slots = wheel->level0;
+    for (int i = 0; i < KTIMER_LEVEL0_SIZE; i++) slots[i] = 0;
+    for (int l = 0; l < KTIMER_UPPER_LEVELS; l++) {
+        for (int i = 0; i < KTIMER_LEVEL_SIZE; i++) wheel->levels[l][i] = 0;
+        for (int i = 0; i < KTIMER_LEVEL_SIZE / 32; i++) wheel->level_map[l][i] = 0;
+    }
+    for (int i = 0; i < KTIMER_LEVEL0_SIZE / 32; i++) wheel->level0_map[i] = 0;
+    wheel->ticks = now;
+    wheel->expired = 0;
+    wheel->expired_tail = &wheel->expired;
+    wheel->pending = 0;
+}
+
+void ktimer_init(ktimer_t *timer, ktimer_callback_t callback, void *arg) {
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->expires = 0;
+    timer->period = 0;
+    timer->slack = 0;
+    timer->expired = false;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+/*
+ * Latest tick in [expires, expires + slack] with as many low zero bits as
+ * possible, so timers with overlapping windows land in the same slot and
+ * cascade together.
+ */
+static uint32_t apply_slack(uint32_t expires, uint32_t slack) {
+    uint32_t limit = expires + slack;
+    if (slack == 0 || limit < expires) return expires;
+    uint32_t mask = expires ^ limit;
+    int bit = 31 - __builtin_clz(mask);
+    return limit & ~((1u << bit) - 1);
+}
+
+static ktimer_t **slot_head(ktimer_wheel_t *wheel, uint16_t slot) {
+    if (slot < KTIMER_LEVEL0_SIZE) return &wheel->level0[slot];
+    int level = slot / KTIMER_LEVEL0_SIZE - 1;
+    return &wheel->levels[level][slot % KTIMER_LEVEL0_SIZE];
+}
+
+static uint32_t *slot_map(ktimer_wheel_t *wheel, uint16_t slot) {
+    if (slot < KTIMER_LEVEL0_SIZE) return wheel->level0_map;
+    return wheel->level_map[slot / KTIMER_LEVEL0_SIZE - 1];
+}
+
+/* Links the timer into the slot its (slacked) expiry falls in, relative to the wheel's time */
+static void enqueue(ktimer_wheel_t *wheel, ktimer_t *timer) {
+    uint32_t expires = apply_slack(timer->expires, timer->slack);
+    uint32_t delta = expires - wheel->ticks;
+    uint16_t slot;
+
+    if ((int32_t) delta < 0) {
+        slot = wheel->ticks & (KTIMER_LEVEL0_SIZE - 1); /* already due: the next tick runs it */
+    } else if (delta < KTIMER_LEVEL0_SIZE) {
+        slot = expires & (KTIMER_LEVEL0_SIZE - 1);
+    } else {
+        int level = 0;
+        int shift = KTIMER_LEVEL0_BITS;
+        while (level < KTIMER_UPPER_LEVELS - 1 && delta >= 1u << (shift + KTIMER_LEVEL_BITS)) {
+            level++;
+            shift += KTIMER_LEVEL_BITS;
+        }
+        slot = (level + 1) * KTIMER_LEVEL0_SIZE + ((expires >> shift) & (KTIMER_LEVEL_SIZE - 1));
+    }
+
+    ktimer_t **head = slot_head(wheel, slot);
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+    timer->slot = slot;
+    timer->expired = false;
+
+    int index = slot % KTIMER_LEVEL0_SIZE;
+    slot_map(wheel, slot)[index >> 5] |= 1u << (index & 31);
+}
+
+static void unlink_timer(ktimer_wheel_t *wheel, ktimer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+
+    if (timer->expired) {
+        if (wheel->expired_tail == &timer->next) wheel->expired_tail = timer->pprev;
+    } else if (*slot_head(wheel, timer->slot) == 0) {
+        int index = timer->slot % KTIMER_LEVEL0_SIZE;
+        slot_map(wheel, timer->slot)[index >> 5] &= ~(1u << (index & 31));
+    }
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->expired = false;
+}
+
+void ktimer_wheel_add(ktimer_wheel_t *wheel, ktimer_t *timer, uint32_t expires) {
+    uint32_t flags = irq_save();
+    if (timer->pprev) {
+        unlink_timer(wheel, timer);
+    } else {
+        wheel->pending++;
+    }
+    timer->expires = expires;
+    enqueue(wheel, timer);
+    irq_restore(flags);
+}
+
+bool ktimer_wheel_cancel(ktimer_wheel_t *wheel, ktimer_t *timer) {
+    uint32_t flags = irq_save();
+    bool was_pending = timer->pprev != 0;
+    timer->period = 0;
+    if (was_pending) {
+        unlink_timer(wheel, timer);
+        wheel->pending--;
+    }
+    irq_restore(flags);
+    return was_pending;
+}
+
+/* Empties one upper-level slot back into the wheel, which now sorts it more finely */
+static void cascade(ktimer_wheel_t *wheel, int level, int index) {
+    ktimer_t *timer = wheel->levels[level][index];
+    wheel->levels[level][index] = 0;
+    wheel->level_map[level][index >> 5] &= ~(1u << (index & 31));
+    while (timer) {
+        ktimer_t *next = timer->next;
+        enqueue(wheel, timer);
+        timer = next;
+    }
+}
+
+bool ktimer_wheel_advance(ktimer_wheel_t *wheel, uint32_t now) {
+    uint32_t flags = irq_save();
+    bool expired = false;
+    while ((int32_t) (now - wheel->ticks) >= 0) {
+        int index = wheel->ticks & (KTIMER_LEVEL0_SIZE - 1);
+        if (index == 0) {
+            /* Level 0 wrapped: pull the next slot of each level whose lower level wrapped too */
+            int shift = KTIMER_LEVEL0_BITS;
+            for (int level = 0; level < KTIMER_UPPER_LEVELS; level++, shift += KTIMER_LEVEL_BITS) {
+                int upper = (wheel->ticks >> shift) & (KTIMER_LEVEL_SIZE - 1);
+                cascade(wheel, level, upper);
+                if (upper != 0) break;
+            }
+        }
+
+        ktimer_t *timer = wheel->level0[index];
+        if (timer) {
+            wheel->level0[index] = 0;
+            wheel->level0_map[index >> 5] &= ~(1u << (index & 31));
+            /* Splice the whole slot onto the expired list */
+            *wheel->expired_tail = timer;
+            timer->pprev = wheel->expired_tail;
+            for (; timer->next; timer = timer->next) timer->expired = true;
+            timer->expired = true;
+            wheel->expired_tail = &timer->next;
+            expired = true;
+        }
+        wheel->ticks++;
+    }
+    irq_restore(flags);
+    return expired;
+}
+
+uint32_t ktimer_wheel_run_expired(ktimer_wheel_t *wheel) {
+    uint32_t ran = 0;
+    uint32_t flags = irq_save();
+    while (wheel->expired) {
+        ktimer_t *timer = wheel->expired;
+        unlink_timer(wheel, timer);
+        wheel->pending--;
+        irq_restore(flags);
+
+        timer->callback(timer, timer->arg);
+        ran++;
+
+        flags = irq_save();
+        /* Re-arm unless the callback cancelled or re-added it */
+        if (timer->period && timer->pprev == 0) {
+            timer->expires += timer->period;
+            if ((int32_t) (timer->expires - wheel->ticks) < 0) timer->expires = wheel->ticks;
+            wheel->pending++;
+            enqueue(wheel, timer);
+        }
+    }
+    irq_restore(flags);
+    return ran;
+}
+
+/* Distance from bit 'from' to the next set bit, wrapping around a map of size bits; -1 if empty */
+static int next_set_bit(const uint32_t *map, int size, int from) {
+    for (int scanned = 0; scanned < size + 32; ) {
+        int position = (from + scanned) & (size - 1);
+        uint32_t word = map[position >> 5] >> (position & 31);
+        if (word) {
+            int distance = scanned + __builtin_ctz(word);
+            return distance < size ? distance : -1;
+        }
+        scanned += 32 - (position & 31);
+    }
+    return -1;
+}
+
+bool ktimer_wheel_next_expiry(ktimer_wheel_t *wheel, uint32_t *tick) {
+    uint32_t flags = irq_save();
+    bool found = false;
+    uint32_t best = 0;
+
+    int distance = next_set_bit(wheel->level0_map, KTIMER_LEVEL0_SIZE,
+                                wheel->ticks & (KTIMER_LEVEL0_SIZE - 1));
+    if (distance >= 0) {
+        best = distance;
+        found = true;
+    }
+
+    /* An upper-level slot can't expire before it is cascaded, at the start of its range */
+    int shift = KTIMER_LEVEL0_BITS;
+    for (int level = 0; level < KTIMER_UPPER_LEVELS; level++, shift += KTIMER_LEVEL_BITS) {
+        /* First cascade point not yet passed, in units of this level's slots */
+        uint32_t first = (wheel->ticks >> shift) + ((wheel->ticks & ((1u << shift) - 1)) != 0);
+        distance = next_set_bit(wheel->level_map[level], KTIMER_LEVEL_SIZE, first & (KTIMER_LEVEL_SIZE - 1));
+        if (distance < 0) continue;
+        uint32_t delta = ((first + distance) << shift) - wheel->ticks;
+        if (!found || delta < best) {
+            best = delta;
+            found = true;
+        }
+    }
+    irq_restore(flags);
+
+    if (found) *tick = wheel->ticks + best;
+    return found;
+}
+
+/* Tickless mode only interrupts at requested deadlines, so ask for the next expiry */
+static void request_next_expiry() {
+    uint32_t tick;
+    if (ktimer_wheel_next_expiry(&system_wheel, &tick)) {
+        clock_request_deadline((uint64_t) tick * NSEC_PER_TICK);
+    }
+}
+
+void ktimer_system_init() {
+    ktimer_wheel_init(&system_wheel, system_ticks);
+}
+
+void ktimer_start(ktimer_t *timer, uint32_t delay, uint32_t slack) {
+    timer->period = 0;
+    timer->slack = slack;
+    ktimer_wheel_add(&system_wheel, timer, system_ticks + delay);
+    request_next_expiry();
+}
+
+void ktimer_start_periodic(ktimer_t *timer, uint32_t period, uint32_t slack) {
+    timer->period = period ? period : 1;
+    timer->slack = slack;
+    ktimer_wheel_add(&system_wheel, timer, system_ticks + timer->period);
+    request_next_expiry();
+}
+
+bool ktimer_cancel(ktimer_t *timer) {
+    return ktimer_wheel_cancel(&system_wheel, timer);
+}
+
+bool ktimer_tick(uint32_t now) {
+    bool expired = ktimer_wheel_advance(&system_wheel, now);
+    request_next_expiry();
+    return expired;
+}
+
+void ktimer_run_expired() {
+    if (ktimer_wheel_run_expired(&system_wheel)) request_next_expiry();
+}
+
+bool ktimer_next_expiry(uint32_t *tick) {
+    return ktimer_wheel_next_expiry(&system_wheel, tick);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Software timers on a hierarchical timing wheel, in timer ticks.
+ *
+ * Level 0 has one slot per tick for the next 256 ticks; each of the four
+ * levels above covers 64 times the range of the one below, so the five
+ * levels span all 32 bits of tick time. A timer goes straight into the
+ * slot for its expiry and is unlinked in place, so adding and cancelling
+ * are O(1). Each tick empties one level 0 slot; every 256 ticks one
+ * slot of the next level is cascaded down, and so on up the levels.
+ *
+ * The tick only moves expired timers to a list. Their callbacks run
+ * later from ktimer_run_expired(), in process context.
+ */
+#define KTIMER_LEVEL0_BITS 8
+#define KTIMER_LEVEL_BITS 6
+#define KTIMER_LEVEL0_SIZE (1 << KTIMER_LEVEL0_BITS)
+#define KTIMER_LEVEL_SIZE (1 << KTIMER_LEVEL_BITS)
+#define KTIMER_UPPER_LEVELS 4
+
+typedef struct ktimer ktimer_t;
+typedef void (*ktimer_callback_t)(ktimer_t *timer, void *arg);
+
+struct ktimer {
+    ktimer_t *next;
+    ktimer_t **pprev; /* the link that points at this timer; 0 when not queued */
+    uint32_t expires; /* tick */
+    uint32_t period;  /* ticks between runs; 0 for a one-shot timer */
+    uint32_t slack;   /* ticks the expiry may be pushed back to share a slot */
+    uint16_t slot;    /* wheel slot, level * KTIMER_LEVEL0_SIZE + index */
+    bool expired;     /* on the expired list rather than in the wheel */
+    ktimer_callback_t callback;
+    void *arg;
+};
+
+typedef struct {
+    uint32_t ticks; /* next tick to process */
+    ktimer_t *level0[KTIMER_LEVEL0_SIZE];
+    ktimer_t *levels[KTIMER_UPPER_LEVELS][KTIMER_LEVEL_SIZE];
+    uint32_t level0_map[KTIMER_LEVEL0_SIZE / 32]; /* non-empty slots */
+    uint32_t level_map[KTIMER_UPPER_LEVELS][KTIMER_LEVEL_SIZE / 32];
+    ktimer_t *expired;
+    ktimer_t **expired_tail;
+    uint32_t pending; /* in the wheel or on the expired list */
+} ktimer_wheel_t;
+
+void ktimer_wheel_init(ktimer_wheel_t *wheel, uint32_t now);
+
+void ktimer_init(ktimer_t *timer, ktimer_callback_t callback, void *arg);
+
+/* Queues timer for tick expires, pushed back by up to its slack; re-adding moves it */
+void ktimer_wheel_add(ktimer_wheel_t *wheel, ktimer_t *timer, uint32_t expires);
+
+/* Returns true if the timer was pending; a periodic timer also stops re-arming */
+bool ktimer_wheel_cancel(ktimer_wheel_t *wheel, ktimer_t *timer);
+
+/* Processes every tick up to and including now; returns true if any timer expired */
+bool ktimer_wheel_advance(ktimer_wheel_t *wheel, uint32_t now);
+
+/* Runs the callbacks of expired timers and re-arms periodic ones; returns how many ran */
+uint32_t ktimer_wheel_run_expired(ktimer_wheel_t *wheel);
+
+/*
+ * Earliest tick anything in the wheel can expire at, exact for the next
+ * 256 ticks and a lower bound (the next cascade) beyond that. False when
+ * nothing is pending.
+ */
+bool ktimer_wheel_next_expiry(ktimer_wheel_t *wheel, uint32_t *tick);
+
+/* The kernel's wheel, driven by the timer interrupt */
+void ktimer_system_init();
+
+/* One-shot: runs once, delay ticks from now (plus up to slack) */
+void ktimer_start(ktimer_t *timer, uint32_t delay, uint32_t slack);
+
+/* Runs every period ticks (each expiry plus up to slack) until cancelled */
+void ktimer_start_periodic(ktimer_t *timer, uint32_t period, uint32_t slack);
+
+bool ktimer_cancel(ktimer_t *timer);
+
+/* Timer interrupt: returns true when callbacks are waiting for ktimer_run_expired() */
+bool ktimer_tick(uint32_t now);
+
+/* Call from process context (the deferred work thread) */
+void ktimer_run_expired();
+
+bool ktimer_next_expiry(uint32_t *tick);
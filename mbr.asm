@@ -1,45 +1,133 @@
 [bits 16]
 [org 0x7c00]
 
-KERNEL_OFFSET equ 0x1000
-BOOT_DRIVE    db 0
-
-; Set VGA text mode (80x25)
-mov ax, 0x0003
-int 0x10
+KERNEL_ADDRESS equ 0x100000 ; kernel is linked and loaded at 1 MB
+BOUNCE_SEGMENT equ 0x1000   ; BIOS reads land at 0x10000, then get copied up
+CHUNK_SECTORS  equ 64       ; 32 KB per INT 13h call
+KERNEL_MAGIC   equ 0x4b534f42 ; "BOSK", see kernel-entry.asm
+LOAD_CYCLES    equ 0x4f0    ; rdtsc before and after loading, for the kernel to report
 
 ; Initialize segments and stack
+cli
 xor ax, ax
 mov ds, ax
 mov es, ax
 mov ss, ax
 mov sp, 0x7c00
+sti
+cld
 
 mov [BOOT_DRIVE], dl
 
+; Set VGA text mode (80x25)
+mov ax, 0x0003
+int 0x10
+
+; Fast A20 gate, so addresses above 1 MB don't wrap
+in al, 0x92
+or al, 2
+out 0x92, al
+
 call load_kernel
+call detect_memory
 call switch_to_32bit
 
 jmp $
 
 %include "disk.asm"
+%include "memory-map.asm"
 %include "gdt.asm"
 %include "switch-to-32bit.asm"
 
 [bits 16]
+; Reads the sector counts from the kernel header, then loads the image to
+; KERNEL_ADDRESS and the initrd that follows it on disk to the address the
+; header gives
 load_kernel:
-    mov ax, 0x0000
-    mov es, ax
-    mov bx, KERNEL_OFFSET ; ES:BX = 0x0000:0x1000
-    mov dh, 15            ; Load 15 sectors (~7.5KB)
+    rdtsc
+    mov [LOAD_CYCLES], eax
+    mov [LOAD_CYCLES + 4], edx
+
+    mov ah, 0x41            ; INT 13h extensions present?
+    mov bx, 0x55aa
     mov dl, [BOOT_DRIVE]
-    call disk_load
+    int 0x13
+    jc disk_error
+
+    mov dword [dap_lba], 1
+    mov cx, 1
+    call disk_read_lba
+    mov ax, BOUNCE_SEGMENT
+    mov es, ax
+    cmp dword [es:4], KERNEL_MAGIC
+    jne header_error
+    mov ebp, [es:8]         ; kernel sectors
+    push dword [es:16]      ; initrd address
+    push dword [es:12]      ; initrd sectors, 0 without one
+    xor ax, ax
+    mov es, ax
+    dec word [dap_lba]      ; start over at the header sector
+    mov edi, KERNEL_ADDRESS
+    call load_sectors
+    pop ebp
+    pop edi
+    call load_sectors
+
+    rdtsc
+    mov [LOAD_CYCLES + 8], eax
+    mov [LOAD_CYCLES + 12], edx
+    ret
+
+; Copies ebp sectors from [dap_lba] on to edi in CHUNK_SECTORS pieces
+; through the bounce buffer
+load_sectors:
+    test ebp, ebp
+    jz .done
+    mov cx, CHUNK_SECTORS
+    cmp ebp, CHUNK_SECTORS
+    jae .read
+    mov cx, bp
+.read:
+    call disk_read_lba
+    movzx ecx, cx
+    sub ebp, ecx
+    shl ecx, 7              ; dwords
+    call enter_unreal
+    mov esi, BOUNCE_SEGMENT << 4
+    a32 rep movsd
+    jmp load_sectors
+.done:
+    ret
+
+; Briefly enters protected mode to load DS and ES with the flat 4 GB data
+; segment, then drops back; the cached limits survive in real mode. Redone
+; for every chunk because the BIOS may reload the segment registers.
+; DS and ES go back to 0 before sti: a BIOS handler that pushes and pops
+; them while still 0x10 would leave a real-mode base of 0x100.
+enter_unreal:
+    cli
+    lgdt [gdt_descriptor]
+    mov eax, cr0
+    or al, 1
+    mov cr0, eax
+    jmp $ + 2
+    mov bx, DATA_SEG
+    mov ds, bx
+    mov es, bx
+    and al, 0xfe
+    mov cr0, eax
+    xor bx, bx
+    mov ds, bx
+    mov es, bx
+    sti
     ret
 
 [bits 32]
 BEGIN_32BIT:
-    call KERNEL_OFFSET ; Jump to kernel
+    call KERNEL_ADDRESS ; Jump to kernel
     jmp $
 
+BOOT_DRIVE db 0
+
 times 510-($-$$) db 0
-dw 0xaa55
\ No newline at end of file
+dw 0xaa55
@@ -0,0 +1,38 @@
+[bits 16]
+; Collects the BIOS INT 15h E820 memory map for the kernel:
+; dword count at E820_COUNT, 24-byte entries from E820_ENTRIES
+E820_COUNT       equ 0x500
+E820_ENTRIES     equ 0x504
+E820_MAX_ENTRIES equ 64
+E820_SMAP        equ 0x534d4150
+
+detect_memory:
+    pusha
+    xor ax, ax
+    mov es, ax
+    mov di, E820_ENTRIES
+    xor ebx, ebx
+    xor ebp, ebp
+.next_entry:
+    mov eax, 0xe820
+    mov edx, E820_SMAP
+    mov ecx, 24
+    mov dword [es:di + 20], 1 ; ACPI "valid" bit, for BIOSes that return 20 bytes
+    int 0x15
+    jc .done                  ; carry on the first call means no E820, else end of list
+    cmp eax, E820_SMAP
+    jne .done
+    mov eax, [es:di + 8]      ; skip zero-length entries
+    or eax, [es:di + 12]
+    jz .skip
+    inc bp
+    add di, 24
+.skip:
+    test ebx, ebx
+    jz .done
+    cmp bp, E820_MAX_ENTRIES
+    jb .next_entry
+.done:
+    mov [E820_COUNT], ebp
+    popa
+    ret
@@ -1,9 +1,12 @@
 #include "memory.h"
 #include <stdint.h>
 #include <stdbool.h>
-#include <string.h>
-#include <math.h>
-#include <stdlib.h>
+#include "cpu.h"
+#include "display.h"
+#include "kstring.h"
+#include "paging.h"
+#include "pmm.h"
+#include "spinlock.h"
 
 // 🧠 Neural Network Parameters
 #define INPUT_NODES 5
@@ -12,8 +15,19 @@
 #define LEARNING_RATE 0.1
 
 // 📦 Memory Management Variables
-static uint8_t dynamic_mem_area[DYNAMIC_MEM_TOTAL_SIZE];
-static dynamic_mem_node_t *dynamic_mem_start;
+static uint8_t dynamic_mem_area[DYNAMIC_MEM_TOTAL_SIZE] __attribute__((aligned(TLSF_ALIGN_SIZE)));
+
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[TLSF_FL_INDEX_COUNT];
+static dynamic_mem_node_t *free_blocks[TLSF_FL_INDEX_COUNT][TLSF_SL_INDEX_COUNT];
+
+// 🔒 Free lists, pools and counters; heap growth runs under it and takes the pmm lock inside
+static lock_class_t heap_lock_class = LOCK_CLASS("heap");
+static spinlock_t heap_lock = SPINLOCK_INIT(&heap_lock_class);
+static uint32_t heap_total;
+static uint32_t heap_used;
+static uint32_t heap_allocations;
+static uint32_t heap_grows;
 
 // 🔢 Neural Network Weights
 float weights_input_hidden[INPUT_NODES][HIDDEN_NODES];
@@ -22,9 +36,34 @@ float weights_hidden_output[HIDDEN_NODES][OUTPUT_NODES];
 // 🧠 AI Memory Tracking Buffer
 size_t recent_allocations[INPUT_NODES] = {128, 256, 512, 1024, 2048};
 
+// 📜 Filled by mem_alloc, consumed by mem_train_predictor
+static uint32_t alloc_history[ALLOC_HISTORY_SIZE];
+static volatile uint32_t alloc_history_head;
+static uint32_t alloc_history_tail;
+static volatile uint32_t predicted_size;
+
+static uint32_t rand_state = 1;
+
+static int nn_rand() {
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16) & 0x7fff;
+}
+
+// e^x by range reduction to |r| < ln 2 and a short series; good to ~1e-6
+static float nn_exp(float x) {
+    if (x > 80.0f) x = 80.0f;
+    if (x < -80.0f) return 0.0f;
+    int k = (int)(x * 1.4426950f);
+    float r = x - (float)k * 0.6931472f;
+    float e = 1.0f + r * (1.0f + r * (0.5f + r * (1.0f / 6 + r * (1.0f / 24 + r * (1.0f / 120 + r / 720)))));
+    for (; k > 0; k--) e *= 2.0f;
+    for (; k < 0; k++) e *= 0.5f;
+    return e;
+}
+
 // 📈 Activation Function (Sigmoid)
 float sigmoid(float x) {
-    return 1.0 / (1.0 + exp(-x));
+    return 1.0 / (1.0 + nn_exp(-x));
 }
 
 // 🔮 Predict the Next Memory Allocation Size
@@ -86,108 +125,343 @@ void train_fnn(size_t actual_size) {
     }
 }
 
-dynamic_mem_node_t *find_best_mem_block(dynamic_mem_node_t *dynamic_mem, size_t size) {
-    dynamic_mem_node_t *best_mem_block = NULL_POINTER;
-    uint32_t best_mem_block_size = DYNAMIC_MEM_TOTAL_SIZE + 1;
+// 🧮 TLSF index helpers
+static inline int fls_u32(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+static inline int ffs_u32(uint32_t x) {
+    return __builtin_ctz(x);
+}
+
+static inline uint32_t block_size(dynamic_mem_node_t *block) {
+    return block->size & ~DYNAMIC_MEM_FREE;
+}
+
+static inline bool block_is_free(dynamic_mem_node_t *block) {
+    return block->size & DYNAMIC_MEM_FREE;
+}
+
+static inline void *block_payload(dynamic_mem_node_t *block) {
+    return (uint8_t *)block + DYNAMIC_MEM_NODE_SIZE;
+}
+
+static inline dynamic_mem_node_t *block_next(dynamic_mem_node_t *block) {
+    return (dynamic_mem_node_t *)((uint8_t *)block_payload(block) + block_size(block));
+}
+
+static void mapping_insert(uint32_t size, int *fl, int *sl) {
+    if (size < TLSF_SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = size / (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_INDEX_COUNT);
+    } else {
+        int f = fls_u32(size);
+        *sl = (size >> (f - TLSF_SL_INDEX_COUNT_LOG2)) ^ TLSF_SL_INDEX_COUNT;
+        *fl = f - (TLSF_FL_INDEX_SHIFT - 1);
+    }
+}
+
+// Rounds the request up to the next list boundary so any block found there fits
+static void mapping_search(uint32_t size, int *fl, int *sl) {
+    if (size >= TLSF_SMALL_BLOCK_SIZE) {
+        size += (1 << (fls_u32(size) - TLSF_SL_INDEX_COUNT_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static dynamic_mem_node_t *search_suitable_block(int fl, int sl) {
+    if (fl >= TLSF_FL_INDEX_COUNT) return NULL_POINTER;
 
-    dynamic_mem_node_t *current_mem_block = dynamic_mem;
-    while (current_mem_block) {
-        if (!current_mem_block->used &&
-            current_mem_block->size >= (size + DYNAMIC_MEM_NODE_SIZE) &&
-            current_mem_block->size < best_mem_block_size) {
-            best_mem_block = current_mem_block;
-            best_mem_block_size = current_mem_block->size;
-            }
-        current_mem_block = current_mem_block->next;
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        uint32_t fl_map = fl_bitmap & (~0U << (fl + 1));
+        if (!fl_map) return NULL_POINTER;
+        fl = ffs_u32(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = ffs_u32(sl_map);
+    return free_blocks[fl][sl];
+}
+
+static void insert_free_block(dynamic_mem_node_t *block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    dynamic_mem_node_t *head = free_blocks[fl][sl];
+    block->next_free = head;
+    block->prev_free = NULL_POINTER;
+    if (head) head->prev_free = block;
+    free_blocks[fl][sl] = block;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+    block->size |= DYNAMIC_MEM_FREE;
+}
+
+static void remove_free_block(dynamic_mem_node_t *block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    if (block->prev_free) block->prev_free->next_free = block->next_free;
+    if (block->next_free) block->next_free->prev_free = block->prev_free;
+    if (free_blocks[fl][sl] == block) {
+        free_blocks[fl][sl] = block->next_free;
+        if (!block->next_free) {
+            sl_bitmap[fl] &= ~(1U << sl);
+            if (!sl_bitmap[fl]) fl_bitmap &= ~(1U << fl);
+        }
     }
-    return best_mem_block;
+    block->size &= ~DYNAMIC_MEM_FREE;
+}
+
+// Cuts a used block down to size, returning the tail to the free lists
+static void trim_block(dynamic_mem_node_t *block, uint32_t size) {
+    uint32_t total = block_size(block);
+    if (total < size + DYNAMIC_MEM_NODE_SIZE + DYNAMIC_MEM_MIN_PAYLOAD) return;
+
+    dynamic_mem_node_t *rest = (dynamic_mem_node_t *)((uint8_t *)block_payload(block) + size);
+    rest->prev_phys = block;
+    rest->size = total - size - DYNAMIC_MEM_NODE_SIZE;
+    block->size = size;
+    block_next(rest)->prev_phys = rest;
+
+    // The old next neighbour was in use (free blocks never touch), so no merge is needed
+    insert_free_block(rest);
+}
+
+static uint32_t adjust_request_size(size_t size) {
+    if (size > (1U << TLSF_FL_INDEX_MAX)) return 0;
+    uint32_t adjusted = (size + TLSF_ALIGN_SIZE - 1) & ~(TLSF_ALIGN_SIZE - 1);
+    return adjusted < DYNAMIC_MEM_MIN_PAYLOAD ? DYNAMIC_MEM_MIN_PAYLOAD : adjusted;
+}
+
+// ➕ Pool layout: one free block spanning the region, then a zero-sized used sentinel
+static void add_pool_locked(void *start, size_t size) {
+    uintptr_t base = ((uintptr_t)start + TLSF_ALIGN_SIZE - 1) & ~(uintptr_t)(TLSF_ALIGN_SIZE - 1);
+    uintptr_t end = ((uintptr_t)start + size) & ~(uintptr_t)(TLSF_ALIGN_SIZE - 1);
+    if (end <= base || end - base < 2 * DYNAMIC_MEM_NODE_SIZE + DYNAMIC_MEM_MIN_PAYLOAD) return;
+
+    dynamic_mem_node_t *block = (dynamic_mem_node_t *)base;
+    block->prev_phys = NULL_POINTER;
+    block->size = end - base - 2 * DYNAMIC_MEM_NODE_SIZE;
+
+    dynamic_mem_node_t *sentinel = block_next(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+
+    heap_total += block_size(block);
+    insert_free_block(block);
 }
 
+void mem_add_pool(void *start, size_t size) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    add_pool_locked(start, size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
 
 // 🏗️ Initialize Memory Manager and AI Model
 void init_dynamic_mem() {
-    dynamic_mem_start = (dynamic_mem_node_t *)dynamic_mem_area;
-    dynamic_mem_start->size = DYNAMIC_MEM_TOTAL_SIZE - DYNAMIC_MEM_NODE_SIZE;
-    dynamic_mem_start->next = NULL_POINTER;
-    dynamic_mem_start->prev = NULL_POINTER;
+    mem_add_pool(dynamic_mem_area, DYNAMIC_MEM_TOTAL_SIZE);
 
     // 🔄 Initialize Neural Network Weights
     for (int i = 0; i < INPUT_NODES; i++) {
         for (int j = 0; j < HIDDEN_NODES; j++) {
-            weights_input_hidden[i][j] = (float)(rand() % 100) / 1000.0;
+            weights_input_hidden[i][j] = (float)(nn_rand() % 100) / 1000.0;
         }
     }
 
     for (int i = 0; i < HIDDEN_NODES; i++) {
         for (int j = 0; j < OUTPUT_NODES; j++) {
-            weights_hidden_output[i][j] = (float)(rand() % 100) / 1000.0;
+            weights_hidden_output[i][j] = (float)(nn_rand() % 100) / 1000.0;
         }
     }
+
+    predicted_size = predict_next_allocation_size();
 }
 
-// 📦 AI-Powered Memory Allocation
+// 🌱 Grows the heap by enough memory that a block of size is found afterwards
+static bool heap_grow(uint32_t size) {
+    uint32_t bytes = size + (size >> 2) + 4 * DYNAMIC_MEM_NODE_SIZE;
+
+    // Demand-zero memory is only backed by frames as the heap touches it
+    uint32_t reserve = bytes < HEAP_GROW_MIN_SIZE ? HEAP_GROW_MIN_SIZE : bytes;
+    void *region = vm_alloc_anon(reserve);
+    if (region != NULL_POINTER) {
+        add_pool_locked(region, reserve);
+        heap_grows++;
+        return true;
+    }
+
+    // Before paging is up, take physical frames directly
+    int order = pmm_order_for(bytes);
+    if (order < HEAP_GROW_MIN_ORDER) order = HEAP_GROW_MIN_ORDER;
+    if (order > PMM_MAX_ORDER) return false;
+
+    uint32_t frames = pmm_alloc_pages(order);
+    if (!frames) return false;
+    add_pool_locked((void *)(uintptr_t)frames, PAGE_SIZE << order);
+    heap_grows++;
+    return true;
+}
+
+// Takes a free block of at least size off its list, growing the heap once if none fits
+static dynamic_mem_node_t *take_block(uint32_t size) {
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+
+    dynamic_mem_node_t *block = search_suitable_block(fl, sl);
+    if (block == NULL_POINTER && heap_grow(size)) {
+        block = search_suitable_block(fl, sl);
+    }
+    if (block != NULL_POINTER) remove_free_block(block);
+    return block;
+}
+
+// 📦 Memory Allocation: only reads the cached prediction, never runs the network
 void *mem_alloc(size_t size) {
-    size_t predicted_size = predict_next_allocation_size();
+    if (size == 0) return NULL_POINTER;
+    uint32_t requested = size;
 
-    if (abs((int)size - (int)predicted_size) < 128) {
-        size = predicted_size;
+    uint32_t predicted = predicted_size;
+    if (predicted > size && predicted - size < 128) {
+        size = predicted;
     }
 
-    dynamic_mem_node_t *best_mem_block =
-        (dynamic_mem_node_t *)find_best_mem_block(dynamic_mem_start, size);
+    uint32_t adjusted = adjust_request_size(size);
+    if (!adjusted) return NULL_POINTER;
 
-    if (best_mem_block != NULL_POINTER) {
-        best_mem_block->size -= size + DYNAMIC_MEM_NODE_SIZE;
-        dynamic_mem_node_t *mem_node_allocate =
-            (dynamic_mem_node_t *)(((uint8_t *)best_mem_block) + DYNAMIC_MEM_NODE_SIZE + best_mem_block->size);
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    dynamic_mem_node_t *block = take_block(adjusted);
+    if (block == NULL_POINTER) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return NULL_POINTER;
+    }
 
-        mem_node_allocate->size = size;
-        mem_node_allocate->used = true;
-        mem_node_allocate->next = best_mem_block->next;
-        mem_node_allocate->prev = best_mem_block;
+    trim_block(block, adjusted);
+    heap_used += block_size(block);
+    heap_allocations++;
 
-        if (best_mem_block->next != NULL_POINTER) {
-            best_mem_block->next->prev = mem_node_allocate;
-        }
-        best_mem_block->next = mem_node_allocate;
+    alloc_history[alloc_history_head % ALLOC_HISTORY_SIZE] = requested;
+    alloc_history_head++;
+    spin_unlock_irqrestore(&heap_lock, flags);
 
-        memmove(&recent_allocations[1], &recent_allocations[0], (INPUT_NODES - 1) * sizeof(size_t));
-        recent_allocations[0] = size;
+    return block_payload(block);
+}
 
-        train_fnn(size);
+// 📐 Aligned allocation: over-allocate, then give the unaligned head back as a free block
+void *mem_alloc_aligned(size_t size, size_t align) {
+    if (align <= TLSF_ALIGN_SIZE) return mem_alloc(size);
+
+    uint32_t adjusted = adjust_request_size(size);
+    if (!adjusted) return NULL_POINTER;
+
+    uint32_t gap_min = DYNAMIC_MEM_NODE_SIZE + DYNAMIC_MEM_MIN_PAYLOAD;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    dynamic_mem_node_t *block = take_block(adjusted + align + gap_min);
+    if (block == NULL_POINTER) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return NULL_POINTER;
+    }
 
-        return (void *)((uint8_t *)mem_node_allocate + DYNAMIC_MEM_NODE_SIZE);
+    uintptr_t payload = (uintptr_t)block_payload(block);
+    uintptr_t aligned = (payload + align - 1) & ~(uintptr_t)(align - 1);
+    if (aligned != payload && aligned - payload < gap_min) {
+        aligned = (payload + gap_min + align - 1) & ~(uintptr_t)(align - 1);
     }
 
-    return NULL_POINTER;
+    if (aligned != payload) {
+        // The block came off a free list, so its lower neighbour is in use: no merge
+        uint32_t gap = (uint32_t)(aligned - payload);
+        dynamic_mem_node_t *moved = (dynamic_mem_node_t *)(aligned - DYNAMIC_MEM_NODE_SIZE);
+        moved->prev_phys = block;
+        moved->size = block_size(block) - gap;
+        block->size = gap - DYNAMIC_MEM_NODE_SIZE;
+        block_next(moved)->prev_phys = moved;
+        insert_free_block(block);
+        block = moved;
+    }
+
+    trim_block(block, adjusted);
+    heap_used += block_size(block);
+    heap_allocations++;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    return block_payload(block);
 }
 
-// ♻️ Memory Deallocation with AI-Based Merging
+// ♻️ Memory Deallocation with boundary-tag merging
 void mem_free(void *p) {
     if (p == NULL_POINTER) return;
 
-    dynamic_mem_node_t *current_mem_node =
-        (dynamic_mem_node_t *)((uint8_t *)p - DYNAMIC_MEM_NODE_SIZE);
+    dynamic_mem_node_t *block = (dynamic_mem_node_t *)((uint8_t *)p - DYNAMIC_MEM_NODE_SIZE);
 
-    if (current_mem_node == NULL_POINTER) return;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    heap_used -= block_size(block);
+    heap_allocations--;
 
-    current_mem_node->used = false;
+    dynamic_mem_node_t *prev = block->prev_phys;
+    if (prev != NULL_POINTER && block_is_free(prev)) {
+        remove_free_block(prev);
+        prev->size += DYNAMIC_MEM_NODE_SIZE + block_size(block);
+        block = prev;
+        block_next(block)->prev_phys = block;
+    }
 
-    dynamic_mem_node_t *next_mem_node = current_mem_node->next;
-    if (next_mem_node != NULL_POINTER && !next_mem_node->used) {
-        current_mem_node->size += next_mem_node->size + DYNAMIC_MEM_NODE_SIZE;
-        current_mem_node->next = next_mem_node->next;
-        if (next_mem_node->next != NULL_POINTER) {
-            next_mem_node->next->prev = current_mem_node;
-        }
+    dynamic_mem_node_t *next = block_next(block);
+    if (block_is_free(next)) {
+        remove_free_block(next);
+        block->size += DYNAMIC_MEM_NODE_SIZE + block_size(next);
+        block_next(block)->prev_phys = block;
     }
 
-    dynamic_mem_node_t *prev_mem_node = current_mem_node->prev;
-    if (prev_mem_node != NULL_POINTER && !prev_mem_node->used) {
-        prev_mem_node->size += current_mem_node->size + DYNAMIC_MEM_NODE_SIZE;
-        prev_mem_node->next = current_mem_node->next;
-        if (current_mem_node->next != NULL_POINTER) {
-            current_mem_node->next->prev = prev_mem_node;
+    insert_free_block(block);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+// 🎓 Deferred training: replay up to a batch of recorded sizes, then refresh the cached prediction
+void mem_train_predictor() {
+    uint32_t head = alloc_history_head;
+    if (head == alloc_history_tail) return;
+
+    // Entries older than the ring are gone; train on what is left
+    if (head - alloc_history_tail > ALLOC_HISTORY_SIZE) {
+        alloc_history_tail = head - ALLOC_HISTORY_SIZE;
+    }
+
+    for (int n = 0; n < PREDICTOR_BATCH_SIZE && alloc_history_tail != head; n++) {
+        uint32_t size = alloc_history[alloc_history_tail % ALLOC_HISTORY_SIZE];
+        alloc_history_tail++;
+
+        memmove(&recent_allocations[1], &recent_allocations[0], (INPUT_NODES - 1) * sizeof(size_t));
+        recent_allocations[0] = size;
+        train_fnn(size);
+    }
+
+    predicted_size = predict_next_allocation_size();
+}
+
+void print_dynamic_node_size() {
+    char buf[64];
+    ksnprintf(buf, sizeof(buf), "DYNAMIC NODE SIZE: %u\n", DYNAMIC_MEM_NODE_SIZE);
+    print_string(buf);
+}
+
+void print_dynamic_mem() {
+    char buf[128];
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    uint32_t total = heap_total, used = heap_used, count = heap_allocations, grows = heap_grows;
+    uint32_t largest = 0;
+    if (fl_bitmap) {
+        int fl = fls_u32(fl_bitmap);
+        int sl = fls_u32(sl_bitmap[fl]);
+        for (dynamic_mem_node_t *b = free_blocks[fl][sl]; b; b = b->next_free) {
+            if (block_size(b) > largest) largest = block_size(b);
         }
     }
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    ksnprintf(buf, sizeof(buf), "heap: %u bytes (%u grows), %u used in %u blocks, largest free %u\n",
+              total, grows, used, count, largest);
+    print_string(buf);
+    ksnprintf(buf, sizeof(buf), "predicted next allocation: %u bytes\n", (uint32_t)predicted_size);
+    print_string(buf);
 }
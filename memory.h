@@ -4,27 +4,60 @@
 #include <stdint.h>
 #include <stddef.h>
 
+/*
+ * Two-level segregated fit (TLSF). Free blocks are kept in lists indexed
+ * by (first level = power of two, second level = one of 16 linear steps
+ * within it), with a bitmap per level, so finding a fitting block and
+ * freeing one are both a handful of bit scans and list operations.
+ */
+#define TLSF_ALIGN_SIZE 8
+#define TLSF_SL_INDEX_COUNT_LOG2 4
+#define TLSF_SL_INDEX_COUNT (1 << TLSF_SL_INDEX_COUNT_LOG2)
+#define TLSF_FL_INDEX_MAX 30 /* blocks up to 1 GB */
+#define TLSF_FL_INDEX_SHIFT (TLSF_SL_INDEX_COUNT_LOG2 + 3)
+#define TLSF_FL_INDEX_COUNT (TLSF_FL_INDEX_MAX - TLSF_FL_INDEX_SHIFT + 1)
+#define TLSF_SMALL_BLOCK_SIZE (1 << TLSF_FL_INDEX_SHIFT)
+
+/* Every block starts with this header; next_free/prev_free only exist while it is free */
 typedef struct dynamic_mem_node {
-    uint32_t size;
-    bool used;
-    struct dynamic_mem_node *next;
-    struct dynamic_mem_node *prev;
+    struct dynamic_mem_node *prev_phys; /* block just below in memory, 0 for the first */
+    uint32_t size;                      /* payload bytes | DYNAMIC_MEM_FREE */
+    struct dynamic_mem_node *next_free;
+    struct dynamic_mem_node *prev_free;
 } dynamic_mem_node_t;
 
 #define NULL_POINTER ((void*)0)
 #define DYNAMIC_MEM_TOTAL_SIZE 4*1024
-#define DYNAMIC_MEM_NODE_SIZE sizeof(dynamic_mem_node_t) // 16
+/* prev_phys + size (8 bytes here); the free links live in the payload */
+#define DYNAMIC_MEM_NODE_SIZE offsetof(dynamic_mem_node_t, next_free)
+#define DYNAMIC_MEM_MIN_PAYLOAD (2 * sizeof(void *))
+#define DYNAMIC_MEM_FREE 0x1
 
-#pragma once
+/* Smallest anonymous region reserved when the heap runs out; backed lazily */
+#define HEAP_GROW_MIN_SIZE (4 * 1024 * 1024)
+
+/* Smallest run taken from the frame allocator before paging is up: 2^4 pages = 64 KB */
+#define HEAP_GROW_MIN_ORDER 4
 
-void memory_copy(uint8_t *source, uint8_t *dest, uint32_t nbytes);
+/* Sizes of recent allocations kept for the deferred predictor training */
+#define ALLOC_HISTORY_SIZE 64
+#define PREDICTOR_BATCH_SIZE 16
 
 void init_dynamic_mem();
 
+/* Adds a region of memory to the heap */
+void mem_add_pool(void *start, size_t size);
+
 void print_dynamic_node_size();
 
 void print_dynamic_mem();
 
 void *mem_alloc(size_t size);
 
-void mem_free(void *p);
\ No newline at end of file
+/* align must be a power of two; 8 or less is what mem_alloc already gives */
+void *mem_alloc_aligned(size_t size, size_t align);
+
+void mem_free(void *p);
+
+/* Trains the size predictor on allocations recorded since the last call */
+void mem_train_predictor();
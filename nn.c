@@ -0,0 +1,374 @@
+#include "nn.h"
+#include "cpu.h"
+#include "kernel.h"
+#include "klog.h"
+
+NeuralNetwork nn;
+nn_training_t nn_training;
+
+/* Q8 master weights the training steps accumulate in; nn.weights is their rounded view */
+static int32_t weights_fixed[4];
+static int32_t snapshot_fixed[4];
+static bool training_enabled = false;
+
+/* State of the slots being watched in the current training window */
+static uint32_t window_start; /* system_ticks when the window opened */
+static uint32_t window_members[(MAX_PROCESSES + 31) / 32];
+static uint32_t window_cpu[MAX_PROCESSES];
+static uint32_t window_wait[MAX_PROCESSES];
+static int32_t window_label[MAX_PROCESSES];
+static int32_t window_features[MAX_PROCESSES][4];
+
+/* lane_masks[bits][lane] is -1 when bit lane of bits is set */
+static int32_t lane_masks[16][4] __attribute__((aligned(16)));
+
+// Neural Network
+void init_neural_network() {
+    nn.weights[0] = 1;   // CPU time
+    nn.weights[1] = -2;  // Wait time
+    nn.weights[2] = 3;   // Priority
+    nn.weights[3] = 1;   // Memory
+    nn.threshold = 25;
+
+    for (int i = 0; i < 4; i++) {
+        weights_fixed[i] = nn.weights[i] << NN_FIXED_SHIFT;
+        snapshot_fixed[i] = weights_fixed[i];
+    }
+    nn_training.learning_rate = NN_LEARNING_RATE;
+
+    for (int bits = 0; bits < 16; bits++)
+        for (int lane = 0; lane < 4; lane++)
+            lane_masks[bits][lane] = bits & (1 << lane) ? -1 : 0;
+}
+
+static inline uint32_t div200(uint32_t x) {
+    return (uint32_t) (((uint64_t) x * NN_RECIPROCAL_25) >> 38);
+}
+
+static inline uint32_t div100(uint32_t x) {
+    return (uint32_t) (((uint64_t) x * NN_RECIPROCAL_25) >> 37);
+}
+
+int nn_activation(uint32_t cpu_time, uint32_t wait_time, int priority) {
+    int features[4] = {
+        div200(cpu_time),
+        div100(wait_time),
+        priority * 2,
+        1
+    };
+
+    int activation = 0;
+    for(int i = 0; i < 4; i++)
+        activation += features[i] * nn.weights[i];
+    return activation;
+}
+
+int calculate_activation(Process *p) {
+    return nn_activation(process_table.cpu_time[p->slot], process_table.wait_time[p->slot],
+                         process_table.priority[p->slot]);
+}
+
+/* Constants and running argmax for score4; only touched with interrupts off */
+static struct {
+    uint32_t reciprocal[4];
+    uint32_t low_mask[4];  /* low dword of each qword */
+    uint32_t high_mask[4]; /* high dword of each qword */
+    int32_t weights[4][4]; /* each weight broadcast to all lanes */
+    int32_t int_min[4];
+    int32_t best[4];
+    int32_t best_slot[4];
+    int32_t slot[4];
+    int32_t step[4];
+} __attribute__((aligned(16))) score;
+
+/* The kernel builds without -msse, where gcc never uses xmm registers and can't name them */
+#ifdef __SSE__
+#define SCORE4_CLOBBERS "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "memory"
+#else
+#define SCORE4_CLOBBERS "memory"
+#endif
+
+/*
+ * Scores four slots. SSE2 has no 32-bit low multiply, so every product is
+ * two pmuludq (even and odd lanes) merged back together; the divisions
+ * keep the high halves of the reciprocal products instead.
+ */
+static void score4(uint32_t *cpu_time, uint32_t *wait_time, int32_t *priority, int32_t *out, int32_t *mask) {
+    asm volatile(
+        // cpu_time / 200
+        "movdqu (%[cpu]), %%xmm0\n"
+        "movdqa %%xmm0, %%xmm1\n"
+        "psrlq $32, %%xmm1\n"
+        "pmuludq %[recip], %%xmm0\n"
+        "pmuludq %[recip], %%xmm1\n"
+        "psrlq $32, %%xmm0\n"
+        "pand %[high], %%xmm1\n"
+        "por %%xmm1, %%xmm0\n"
+        "psrld $6, %%xmm0\n"
+        // * weights[0]
+        "movdqa %%xmm0, %%xmm1\n"
+        "psrlq $32, %%xmm1\n"
+        "pmuludq %[w0], %%xmm0\n"
+        "pmuludq %[w0], %%xmm1\n"
+        "pand %[low], %%xmm0\n"
+        "psllq $32, %%xmm1\n"
+        "por %%xmm1, %%xmm0\n"
+        "movdqa %%xmm0, %%xmm6\n"
+        // wait_time / 100
+        "movdqu (%[wait]), %%xmm0\n"
+        "movdqa %%xmm0, %%xmm1\n"
+        "psrlq $32, %%xmm1\n"
+        "pmuludq %[recip], %%xmm0\n"
+        "pmuludq %[recip], %%xmm1\n"
+        "psrlq $32, %%xmm0\n"
+        "pand %[high], %%xmm1\n"
+        "por %%xmm1, %%xmm0\n"
+        "psrld $5, %%xmm0\n"
+        // * weights[1]
+        "movdqa %%xmm0, %%xmm1\n"
+        "psrlq $32, %%xmm1\n"
+        "pmuludq %[w1], %%xmm0\n"
+        "pmuludq %[w1], %%xmm1\n"
+        "pand %[low], %%xmm0\n"
+        "psllq $32, %%xmm1\n"
+        "por %%xmm1, %%xmm0\n"
+        "paddd %%xmm0, %%xmm6\n"
+        // priority * 2 * weights[2]
+        "movdqu (%[prio]), %%xmm0\n"
+        "pslld $1, %%xmm0\n"
+        "movdqa %%xmm0, %%xmm1\n"
+        "psrlq $32, %%xmm1\n"
+        "pmuludq %[w2], %%xmm0\n"
+        "pmuludq %[w2], %%xmm1\n"
+        "pand %[low], %%xmm0\n"
+        "psllq $32, %%xmm1\n"
+        "por %%xmm1, %%xmm0\n"
+        "paddd %%xmm0, %%xmm6\n"
+        // + weights[3], inactive lanes forced to INT32_MIN
+        "paddd %[w3], %%xmm6\n"
+        "movdqa (%[mask]), %%xmm2\n"
+        "pand %%xmm2, %%xmm6\n"
+        "pandn %[int_min], %%xmm2\n"
+        "por %%xmm2, %%xmm6\n"
+        "movdqu %%xmm6, (%[out])\n"
+        // per-lane running max and the slot it came from
+        "movdqa %[best], %%xmm4\n"
+        "movdqa %%xmm6, %%xmm5\n"
+        "pcmpgtd %%xmm4, %%xmm5\n"
+        "movdqa %%xmm5, %%xmm0\n"
+        "pand %%xmm6, %%xmm0\n"
+        "movdqa %%xmm5, %%xmm1\n"
+        "pandn %%xmm4, %%xmm1\n"
+        "por %%xmm1, %%xmm0\n"
+        "movdqa %%xmm0, %[best]\n"
+        "movdqa %[slot], %%xmm2\n"
+        "movdqa %%xmm5, %%xmm0\n"
+        "pand %%xmm2, %%xmm0\n"
+        "pandn %[best_slot], %%xmm5\n"
+        "por %%xmm5, %%xmm0\n"
+        "movdqa %%xmm0, %[best_slot]\n"
+        "paddd %[step], %%xmm2\n"
+        "movdqa %%xmm2, %[slot]\n"
+        : [best] "+m" (score.best), [best_slot] "+m" (score.best_slot), [slot] "+m" (score.slot)
+        : [cpu] "r" (cpu_time), [wait] "r" (wait_time), [prio] "r" (priority), [out] "r" (out), [mask] "r" (mask),
+          [recip] "m" (score.reciprocal), [low] "m" (score.low_mask), [high] "m" (score.high_mask),
+          [w0] "m" (score.weights[0]), [w1] "m" (score.weights[1]), [w2] "m" (score.weights[2]),
+          [w3] "m" (score.weights[3]), [int_min] "m" (score.int_min), [step] "m" (score.step)
+        : SCORE4_CLOBBERS);
+}
+
+/* Loads the constants and the running argmax; the argmax lives in the caller between sections */
+static void score_load(int32_t *best, int32_t *best_slot, int32_t *slot) {
+    for (int lane = 0; lane < 4; lane++) {
+        score.reciprocal[lane] = NN_RECIPROCAL_25;
+        score.low_mask[lane] = lane & 1 ? 0 : 0xffffffff;
+        score.high_mask[lane] = lane & 1 ? 0xffffffff : 0;
+        for (int w = 0; w < 4; w++) score.weights[w][lane] = nn.weights[w];
+        score.int_min[lane] = INT32_MIN;
+        score.best[lane] = best[lane];
+        score.best_slot[lane] = best_slot[lane];
+        score.slot[lane] = slot[lane];
+        score.step[lane] = 4;
+    }
+}
+
+static void score_store(int32_t *best, int32_t *best_slot, int32_t *slot) {
+    for (int lane = 0; lane < 4; lane++) {
+        best[lane] = score.best[lane];
+        best_slot[lane] = score.best_slot[lane];
+        slot[lane] = score.slot[lane];
+    }
+}
+
+int nn_score_batch(ProcessTable *table, int32_t *activations) {
+    int best_slot = -1;
+    int32_t best = INT32_MIN;
+    int i = 0;
+
+    if (cpu_has(CPU_FEATURE_SSE2) && table->count >= 4) {
+        int32_t lane_best[4] = {INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN};
+        int32_t lane_best_slot[4] = {-1, -1, -1, -1};
+        int32_t lane_slot[4] = {0, 1, 2, 3};
+        int vector_end = table->count & ~3;
+        while (i < vector_end) {
+            int chunk_end = i + NN_BATCH_CHUNK < vector_end ? i + NN_BATCH_CHUNK : vector_end;
+            // The xmm registers are not saved by interrupt handlers (see kstring.c)
+            uint32_t flags = irq_save();
+            score_load(lane_best, lane_best_slot, lane_slot);
+            for (; i < chunk_end; i += 4) {
+                uint32_t bits = (table->active[i >> 5] >> (i & 31)) & 0xf;
+                score4(&table->cpu_time[i], &table->wait_time[i], &table->priority[i], &activations[i],
+                       lane_masks[bits]);
+            }
+            score_store(lane_best, lane_best_slot, lane_slot);
+            irq_restore(flags);
+        }
+        for (int lane = 0; lane < 4; lane++) {
+            if (lane_best_slot[lane] < 0) continue;
+            if (lane_best[lane] > best || (lane_best[lane] == best && lane_best_slot[lane] < best_slot)) {
+                best = lane_best[lane];
+                best_slot = lane_best_slot[lane];
+            }
+        }
+    }
+
+    for (; i < table->count; i++) {
+        if (!(table->active[i >> 5] & (1u << (i & 31)))) {
+            activations[i] = INT32_MIN;
+            continue;
+        }
+        activations[i] = nn_activation(table->cpu_time[i], table->wait_time[i], table->priority[i]);
+        if (activations[i] > best) {
+            best = activations[i];
+            best_slot = i;
+        }
+    }
+    return best_slot;
+}
+
+int nn_predict(int activation) {
+    return activation > nn.threshold ? 1 : 0;
+}
+
+/* Feature magnitudes are capped for the update so one long-running thread can't swamp a step */
+#define NN_FEATURE_LIMIT 64
+
+static int32_t clamp(int32_t value, int32_t low, int32_t high) {
+    return value < low ? low : value > high ? high : value;
+}
+
+static void open_window() {
+    window_start = system_ticks;
+    for (int slot = 0; slot < MAX_PROCESSES; slot++) {
+        window_members[slot >> 5] = process_table.active[slot >> 5];
+        if (!(window_members[slot >> 5] & (1u << (slot & 31)))) continue;
+
+        uint32_t cpu = process_table.cpu_time[slot], wait = process_table.wait_time[slot];
+        int32_t priority = process_table.priority[slot];
+        window_cpu[slot] = cpu;
+        window_wait[slot] = wait;
+        window_label[slot] = nn_predict(nn_activation(cpu, wait, priority)) ? 1 : -1;
+        window_features[slot][0] = clamp(div200(cpu), 0, NN_FEATURE_LIMIT);
+        window_features[slot][1] = clamp(div100(wait), 0, NN_FEATURE_LIMIT);
+        window_features[slot][2] = clamp(priority * 2, -NN_FEATURE_LIMIT, NN_FEATURE_LIMIT);
+        window_features[slot][3] = 1;
+    }
+}
+
+static void close_window(uint32_t window_ticks) {
+    uint32_t members = 0, busy = 0, waited = 0, sum_squares = 0;
+    int32_t gradient[4] = {0, 0, 0, 0};
+
+    for (int slot = 0; slot < MAX_PROCESSES; slot++) {
+        uint32_t bit = 1u << (slot & 31);
+        if (!(window_members[slot >> 5] & process_table.active[slot >> 5] & bit)) continue;
+
+        // Only threads that wanted the CPU count; a thread blocked all window says nothing
+        uint32_t ran = process_table.cpu_time[slot] - window_cpu[slot];
+        uint32_t ready = process_table.wait_time[slot] - window_wait[slot];
+        if (ran + ready == 0) continue;
+        members++;
+        busy += ran;
+        waited += ready;
+        sum_squares += ran * ran;
+        for (int i = 0; i < 4; i++) gradient[i] += window_label[slot] * window_features[slot][i];
+    }
+    if (members == 0) return;
+
+    // Reward: busy fraction + Jain's fairness - ready ticks per running tick, all Q8
+    nn_training.throughput = clamp((busy << NN_FIXED_SHIFT) / window_ticks, 0, 1 << NN_FIXED_SHIFT);
+    nn_training.wait = clamp((waited << NN_FIXED_SHIFT) / (busy ? busy : 1), 0, 4 << NN_FIXED_SHIFT);
+    nn_training.fairness = sum_squares ? (busy * busy << NN_FIXED_SHIFT) / (members * sum_squares)
+                                       : 1 << NN_FIXED_SHIFT;
+    nn_training.reward = nn_training.throughput + nn_training.fairness - nn_training.wait;
+
+    if (nn_training.updates == 0) nn_training.baseline = nn_training.reward;
+    int32_t advantage = nn_training.reward - nn_training.baseline;
+    nn_training.baseline += (nn_training.reward - nn_training.baseline) >> 3;
+    nn_training.updates++;
+    if (nn_training.frozen) return;
+
+    // Better than usual: push the weights towards the labels given; worse: away from them
+    int32_t step = (nn_training.learning_rate * advantage) >> NN_FIXED_SHIFT;
+    int32_t limit = NN_WEIGHT_LIMIT << NN_FIXED_SHIFT;
+    for (int i = 0; i < 4; i++) {
+        weights_fixed[i] = clamp(weights_fixed[i] + step * gradient[i] / (int32_t) members, -limit, limit);
+        nn.weights[i] = (weights_fixed[i] + (1 << (NN_FIXED_SHIFT - 1))) >> NN_FIXED_SHIFT;
+    }
+
+    if (nn_training.updates % NN_LEARNING_RATE_HALVING == 0 && nn_training.learning_rate > NN_LEARNING_RATE_MIN) {
+        nn_training.learning_rate >>= 1;
+    }
+}
+
+/* Windows are measured in system_ticks: in tickless mode an interrupt can stand for several ticks */
+void nn_train_tick() {
+    if (!training_enabled) return;
+    uint32_t window_ticks = system_ticks - window_start;
+    if (window_ticks < NN_TRAIN_INTERVAL) return;
+    close_window(window_ticks);
+    open_window();
+}
+
+void nn_set_training(bool enabled) {
+    uint32_t flags = irq_save();
+    training_enabled = enabled;
+    if (enabled) open_window();
+    irq_restore(flags);
+}
+
+void nn_freeze(bool frozen) {
+    nn_training.frozen = frozen;
+}
+
+void nn_snapshot() {
+    uint32_t flags = irq_save();
+    for (int i = 0; i < 4; i++) snapshot_fixed[i] = weights_fixed[i];
+    irq_restore(flags);
+}
+
+void nn_restore() {
+    uint32_t flags = irq_save();
+    for (int i = 0; i < 4; i++) {
+        weights_fixed[i] = snapshot_fixed[i];
+        nn.weights[i] = (weights_fixed[i] + (1 << (NN_FIXED_SHIFT - 1))) >> NN_FIXED_SHIFT;
+    }
+    irq_restore(flags);
+}
+
+/* Q8 as hundredths, so kprintf can show it as an integer */
+static int32_t hundredths(int32_t fixed) {
+    return fixed * 100 / (1 << NN_FIXED_SHIFT);
+}
+
+void nn_print_state() {
+    kprintf(KLOG_CONT, "weights %d %d %d %d (x100: %d %d %d %d), threshold %d\n",
+            nn.weights[0], nn.weights[1], nn.weights[2], nn.weights[3],
+            hundredths(weights_fixed[0]), hundredths(weights_fixed[1]),
+            hundredths(weights_fixed[2]), hundredths(weights_fixed[3]), nn.threshold);
+    kprintf(KLOG_CONT, "training %s%s, %u updates, rate x100 %d\n", training_enabled ? "on" : "off",
+            nn_training.frozen ? " (frozen)" : "", nn_training.updates, hundredths(nn_training.learning_rate));
+    kprintf(KLOG_CONT, "last window x100: reward %d (baseline %d) = throughput %d + fairness %d - wait %d\n",
+            hundredths(nn_training.reward), hundredths(nn_training.baseline), hundredths(nn_training.throughput),
+            hundredths(nn_training.fairness), hundredths(nn_training.wait));
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "sched.h"
+#include <stdint.h>
+
+typedef struct {
+    int weights[4];
+    int threshold;
+} NeuralNetwork;
+
+/*
+ * Online training. Every NN_TRAIN_INTERVAL ticks the window's throughput,
+ * wait time and fairness give a reward; its difference from a running
+ * baseline scales a perceptron step that reinforces (or reverses) the
+ * OPTIMAL/SUBOPTIMAL labels given in that window. All fixed point, Q8.
+ */
+#define NN_FIXED_SHIFT 8
+#define NN_TRAIN_INTERVAL 100 /* ticks */
+#define NN_WEIGHT_LIMIT 16    /* weights are clamped to +-this */
+#define NN_LEARNING_RATE 64   /* Q8, initial */
+#define NN_LEARNING_RATE_MIN 4
+#define NN_LEARNING_RATE_HALVING 32 /* updates between halvings */
+
+typedef struct {
+    int32_t reward;     /* Q8, last window */
+    int32_t baseline;   /* Q8, running average of reward */
+    int32_t throughput; /* Q8, busy fraction of the last window */
+    int32_t wait;       /* Q8, ready ticks per running tick */
+    int32_t fairness;   /* Q8, Jain's index over per-thread run time */
+    uint32_t updates;
+    int32_t learning_rate;
+    bool frozen;
+} nn_training_t;
+
+extern nn_training_t nn_training;
+
+extern NeuralNetwork nn;
+
+/* x / 25 == (x * NN_RECIPROCAL_25) >> 35 for every 32-bit x; /100 and /200 shift 2 and 3 more */
+#define NN_RECIPROCAL_25 0x51eb851fu
+
+/* Slots scored per irq_save section by nn_score_batch */
+#define NN_BATCH_CHUNK 64
+
+void init_neural_network();
+
+int nn_activation(uint32_t cpu_time, uint32_t wait_time, int priority);
+
+int calculate_activation(Process *p);
+
+/* Scores every slot into activations (INT32_MIN for inactive ones); returns the best active slot or -1 */
+int nn_score_batch(ProcessTable *table, int32_t *activations);
+
+int nn_predict(int activation);
+
+/* Scheduler tick hook: closes a training window every NN_TRAIN_INTERVAL ticks */
+void nn_train_tick();
+
+void nn_set_training(bool enabled);
+
+/* Frozen weights still score threads but stop learning */
+void nn_freeze(bool frozen);
+
+void nn_snapshot();
+
+/* Back to the last snapshot, or the initial weights if none was taken */
+void nn_restore();
+
+void nn_print_state();
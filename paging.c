@@ -0,0 +1,193 @@
+#include "paging.h"
+#include "cpu.h"
+#include "isr.h"
+#include "klog.h"
+#include "kstring.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include <stdbool.h>
+
+#define CR0_WP (1 << 16)
+#define CR0_PG (1U << 31)
+#define CR4_PSE (1 << 4)
+
+static uint32_t page_directory[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t identity_limit;
+static bool paging_enabled;
+static bool large_pages;
+
+static uint32_t anon_next = VM_ANON_START;
+static uint32_t fault_count;
+
+/* Protected by vm_lock: page tables and anon_next, shared by every CPU through the one page directory */
+static lock_class_t vm_lock_class = LOCK_CLASS("vm");
+static spinlock_t vm_lock = SPINLOCK_INIT(&vm_lock_class);
+
+/*
+ * Page tables come straight from the frame allocator and are reached
+ * through the identity map. They are cleared with rep stosd: this also
+ * runs inside the fault handler, which may have interrupted an SSE2
+ * copy whose xmm registers it must not touch.
+ */
+static uint32_t *page_table_for(uint32_t virt, bool create) {
+    uint32_t *pde = &page_directory[virt >> 22];
+    if (!(*pde & PAGE_PRESENT)) {
+        if (!create) return 0;
+        uint32_t table = pmm_alloc_pages(0);
+        if (!table) return 0;
+        memset_rep((void *) table, 0, PAGE_SIZE);
+        *pde = table | PAGE_WRITE | PAGE_PRESENT;
+    }
+    if (*pde & PAGE_LARGE) return 0;
+    return (uint32_t *) (*pde & ~(PAGE_SIZE - 1));
+}
+
+bool vm_map_page(uint32_t virt, uint32_t phys, uint32_t flags) {
+    uint32_t irq_flags = spin_lock_irqsave(&vm_lock);
+    uint32_t *table = page_table_for(virt, true);
+    if (table) {
+        table[(virt >> PAGE_SHIFT) & 1023] = (phys & ~(PAGE_SIZE - 1)) | flags | PAGE_PRESENT;
+        invlpg(virt);
+    }
+    spin_unlock_irqrestore(&vm_lock, irq_flags);
+    return table != 0;
+}
+
+uint32_t vm_unmap_page(uint32_t virt) {
+    uint32_t flags = spin_lock_irqsave(&vm_lock);
+    uint32_t *table = page_table_for(virt, false);
+    uint32_t frame = 0;
+    if (table) {
+        uint32_t *pte = &table[(virt >> PAGE_SHIFT) & 1023];
+        if (*pte & PAGE_PRESENT) {
+            frame = *pte & ~(PAGE_SIZE - 1);
+            *pte = 0;
+            invlpg(virt);
+        }
+    }
+    spin_unlock_irqrestore(&vm_lock, flags);
+    return frame;
+}
+
+uint32_t vm_virt_to_phys(uint32_t virt) {
+    if (!paging_enabled) return virt;
+    uint32_t pde = page_directory[virt >> 22];
+    if (!(pde & PAGE_PRESENT)) return 0;
+    if (pde & PAGE_LARGE) return (pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+
+    uint32_t pte = ((uint32_t *) (pde & ~(PAGE_SIZE - 1)))[(virt >> PAGE_SHIFT) & 1023];
+    if (!(pte & PAGE_PRESENT)) return 0;
+    return (pte & ~(PAGE_SIZE - 1)) | (virt & (PAGE_SIZE - 1));
+}
+
+void *vm_alloc_anon(uint32_t bytes) {
+    if (!paging_enabled || bytes == 0) return 0;
+    bytes = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    uint32_t flags = spin_lock_irqsave(&vm_lock);
+    if (bytes > VM_ANON_END - anon_next) {
+        spin_unlock_irqrestore(&vm_lock, flags);
+        return 0;
+    }
+    uint32_t start = anon_next;
+    anon_next += bytes;
+    spin_unlock_irqrestore(&vm_lock, flags);
+
+    return (void *) start;
+}
+
+void vm_release_anon(void *start, uint32_t bytes) {
+    uint32_t end = (uint32_t) start + bytes;
+    for (uint32_t page = (uint32_t) start & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+        uint32_t frame = vm_unmap_page(page);
+        if (frame) pmm_free_pages(frame, 0);
+    }
+}
+
+uint32_t vm_fault_count() {
+    return fault_count;
+}
+
+/*
+ * Backs an anonymous page with frame unless another CPU faulting on the
+ * same page got there first. Returns the frame the page ends up with, or
+ * 0 if there was no memory for its page table.
+ */
+static uint32_t map_anon_page(uint32_t page, uint32_t frame) {
+    uint32_t flags = spin_lock_irqsave(&vm_lock);
+    uint32_t *table = page_table_for(page, true);
+    uint32_t mapped = 0;
+    if (table) {
+        uint32_t *pte = &table[(page >> PAGE_SHIFT) & 1023];
+        if (!(*pte & PAGE_PRESENT)) {
+            *pte = frame | PAGE_WRITE | PAGE_PRESENT;
+            invlpg(page);
+        }
+        mapped = *pte & ~(PAGE_SIZE - 1);
+    }
+    spin_unlock_irqrestore(&vm_lock, flags);
+    return mapped;
+}
+
+/* Runs with interrupts off (interrupt gate) */
+static void page_fault_handler(registers_t *r) {
+    uint32_t address;
+    asm volatile("mov %%cr2, %0" : "=r" (address));
+
+    if (!(r->err_code & PAGE_FAULT_PRESENT) && address >= VM_ANON_START && address < anon_next) {
+        uint32_t frame = pmm_alloc_pages(0);
+        if (frame) {
+            memset_rep((void *) frame, 0, PAGE_SIZE);
+            uint32_t mapped = map_anon_page(address & ~(PAGE_SIZE - 1), frame);
+            if (mapped == frame) fault_count++;
+            else pmm_free_pages(frame, 0);
+            if (mapped) return;
+        }
+        kprintf(KLOG_PANIC, "Out of memory backing %x\n", address);
+    }
+
+    kprintf(KLOG_PANIC, "Page fault at %x (eip %x, %s, %s)\nHalting...\n", address, r->eip,
+            r->err_code & PAGE_FAULT_PRESENT ? "protection" : "not present",
+            r->err_code & PAGE_FAULT_WRITE ? "write" : "read");
+    klog_panic();
+
+    while (1) { asm volatile("hlt"); }
+}
+
+void paging_init() {
+    // Identity map all the RAM the frame allocator knows about, at least the first 4 MB
+    identity_limit = pmm_highest_address();
+    if (identity_limit < LARGE_PAGE_SIZE) identity_limit = LARGE_PAGE_SIZE;
+    identity_limit = (identity_limit + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+
+    large_pages = cpu_has(CPU_FEATURE_PSE);
+    for (uint32_t addr = 0; addr < identity_limit; addr += LARGE_PAGE_SIZE) {
+        if (large_pages) {
+            page_directory[addr >> 22] = addr | PAGE_LARGE | PAGE_WRITE | PAGE_PRESENT;
+            continue;
+        }
+        for (uint32_t page = addr; page < addr + LARGE_PAGE_SIZE; page += PAGE_SIZE) {
+            if (!vm_map_page(page, page, PAGE_WRITE)) {
+                identity_limit = page;
+                break;
+            }
+        }
+    }
+
+    register_interrupt_handler(PAGE_FAULT_VECTOR, page_fault_handler);
+
+    uint32_t cr4, cr0;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    if (large_pages) cr4 |= CR4_PSE;
+    asm volatile("mov %0, %%cr4" : : "r" (cr4));
+    asm volatile("mov %0, %%cr3" : : "r" (page_directory) : "memory");
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    cr0 |= CR0_PG | CR0_WP;
+    asm volatile("mov %0, %%cr0" : : "r" (cr0) : "memory");
+    paging_enabled = true;
+}
+
+void paging_report() {
+    kprintf(KLOG_INFO, "paging: %u MB identity mapped with %s pages, %u KB anonymous reserved, %u demand-zero faults\n",
+            identity_limit >> 20, large_pages ? "4 MB" : "4 KB", (anon_next - VM_ANON_START) >> 10, fault_count);
+}
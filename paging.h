@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Page directory / table entry flags */
+#define PAGE_PRESENT 0x1
+#define PAGE_WRITE 0x2
+#define PAGE_CACHE_DISABLE 0x10 /* device registers */
+#define PAGE_LARGE 0x80 /* PDE maps 4 MB directly (needs CR4.PSE) */
+
+#define LARGE_PAGE_SIZE 0x400000
+#define PAGE_FAULT_VECTOR 14
+
+/* Page fault error code bits */
+#define PAGE_FAULT_PRESENT 0x1
+#define PAGE_FAULT_WRITE 0x2
+
+/*
+ * Demand-zero anonymous memory is carved from this window; a fault
+ * anywhere in the part handed out so far maps a fresh zeroed frame.
+ */
+#define VM_ANON_START 0xD0000000
+#define VM_ANON_END 0xF0000000
+
+void paging_init();
+
+/* Maps one 4 KB page, allocating its page table if needed; false when out of frames */
+bool vm_map_page(uint32_t virt, uint32_t phys, uint32_t flags);
+
+/* Clears the mapping and flushes it from the TLB; returns the frame it mapped, or 0 */
+uint32_t vm_unmap_page(uint32_t virt);
+
+/* Physical address behind virt, for handing buffers to DMA; 0 if it isn't mapped */
+uint32_t vm_virt_to_phys(uint32_t virt);
+
+/* Reserves page-aligned anonymous memory; nothing is backed until touched */
+void *vm_alloc_anon(uint32_t bytes);
+
+/* Gives the frames behind an anonymous range back; the next touch faults in zeroes again */
+void vm_release_anon(void *start, uint32_t bytes);
+
+uint32_t vm_fault_count();
+
+void paging_report();
+
+static inline void invlpg(uint32_t virt) {
+    asm volatile("invlpg (%0)" : : "r" (virt) : "memory");
+}
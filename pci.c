@@ -0,0 +1,98 @@
+#include "pci.h"
+#include "cpu.h"
+#include "klog.h"
+#include "ports.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The address/data pair is one shared register window, so each access is atomic */
+uint32_t pci_read32(pci_address_t device, uint8_t offset) {
+    uint32_t flags = irq_save();
+    port_dword_out(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | device | (offset & 0xfc));
+    uint32_t value = port_dword_in(PCI_CONFIG_DATA);
+    irq_restore(flags);
+    return value;
+}
+
+uint16_t pci_read16(pci_address_t device, uint8_t offset) {
+    return (uint16_t) (pci_read32(device, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t pci_read8(pci_address_t device, uint8_t offset) {
+    return (uint8_t) (pci_read32(device, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(pci_address_t device, uint8_t offset, uint32_t value) {
+    uint32_t flags = irq_save();
+    port_dword_out(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | device | (offset & 0xfc));
+    port_dword_out(PCI_CONFIG_DATA, value);
+    irq_restore(flags);
+}
+
+/*
+ * A word-sized access to the data window, not a read-modify-write of the
+ * dword: writing COMMAND that way would write STATUS back and clear its
+ * write-1-to-clear bits.
+ */
+void pci_write16(pci_address_t device, uint8_t offset, uint16_t value) {
+    uint32_t flags = irq_save();
+    port_dword_out(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | device | (offset & 0xfc));
+    port_word_out(PCI_CONFIG_DATA + (offset & 2), value);
+    irq_restore(flags);
+}
+
+/*
+ * Calls visit for every function present until it returns true. Functions
+ * 1-7 are only probed when function 0 says the device has them.
+ */
+static bool pci_scan(bool (*visit)(pci_address_t device, void *arg), void *arg) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint32_t slot = 0; slot < 32; slot++) {
+            pci_address_t first = PCI_ADDRESS(bus, slot, 0);
+            if (pci_read16(first, PCI_VENDOR_ID) == PCI_NO_VENDOR) continue;
+            int functions = pci_read8(first, PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION ? 8 : 1;
+            for (int function = 0; function < functions; function++) {
+                pci_address_t device = PCI_ADDRESS(bus, slot, function);
+                if (pci_read16(device, PCI_VENDOR_ID) == PCI_NO_VENDOR) continue;
+                if (visit(device, arg)) return true;
+            }
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    uint8_t class_code;
+    uint8_t subclass;
+    pci_address_t found;
+} class_search_t;
+
+static bool match_class(pci_address_t device, void *arg) {
+    class_search_t *search = arg;
+    if (pci_read8(device, PCI_CLASS) != search->class_code) return false;
+    if (pci_read8(device, PCI_SUBCLASS) != search->subclass) return false;
+    search->found = device;
+    return true;
+}
+
+bool pci_find_class(uint8_t class_code, uint8_t subclass, pci_address_t *found) {
+    class_search_t search = {class_code, subclass, 0};
+    if (!pci_scan(match_class, &search)) return false;
+    *found = search.found;
+    return true;
+}
+
+static bool report_device(pci_address_t device, void *arg) {
+    (void) arg;
+    kprintf(KLOG_INFO, "pci: %02x:%02x.%u %04x:%04x class %02x%02x%02x irq %u\n",
+            device >> 16, (device >> 11) & 31, (device >> 8) & 7,
+            pci_read16(device, PCI_VENDOR_ID), pci_read16(device, PCI_DEVICE_ID),
+            pci_read8(device, PCI_CLASS), pci_read8(device, PCI_SUBCLASS), pci_read8(device, PCI_PROG_IF),
+            pci_read8(device, PCI_INTERRUPT_LINE));
+    return false;
+}
+
+void pci_report() {
+    pci_scan(report_device, 0);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Configuration mechanism #1 */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_CONFIG_ENABLE 0x80000000u
+
+/* Configuration space offsets, type 0 header */
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0a
+#define PCI_CLASS 0x0b
+#define PCI_HEADER_TYPE 0x0e
+#define PCI_BAR0 0x10
+#define PCI_BAR4 0x20
+#define PCI_INTERRUPT_LINE 0x3c
+
+#define PCI_COMMAND_IO 0x1
+#define PCI_COMMAND_MASTER 0x4
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_BAR_IO 0x1
+#define PCI_NO_VENDOR 0xffff
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_IDE_NATIVE 0x05 /* prog-if: either channel in native (PCI) mode */
+
+/* bus << 16 | device << 11 | function << 8, the layout PCI_CONFIG_ADDRESS takes */
+typedef uint32_t pci_address_t;
+
+#define PCI_ADDRESS(bus, device, function) (((bus) << 16) | ((device) << 11) | ((function) << 8))
+
+uint32_t pci_read32(pci_address_t device, uint8_t offset);
+
+uint16_t pci_read16(pci_address_t device, uint8_t offset);
+
+uint8_t pci_read8(pci_address_t device, uint8_t offset);
+
+void pci_write32(pci_address_t device, uint8_t offset, uint32_t value);
+
+void pci_write16(pci_address_t device, uint8_t offset, uint16_t value);
+
+/* First function with this class and subclass, scanning every bus; false if there is none */
+bool pci_find_class(uint8_t class_code, uint8_t subclass, pci_address_t *found);
+
+/* One line per function present */
+void pci_report();
@@ -0,0 +1,51 @@
+#include "percpu.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GDT_CODE 1
+#define GDT_DATA 2
+#define GDT_FIRST_CPU 3 /* then one data segment per CPU */
+#define SEGMENT_CODE 0x9a /* present, ring 0, execute/read */
+#define SEGMENT_DATA 0x92 /* present, ring 0, read/write */
+#define SEGMENT_4K_32BIT 0xc0
+#define SEGMENT_BYTE_32BIT 0x40
+
+cpu_t cpus[SMP_MAX_CPUS];
+
+_Static_assert(offsetof(cpu_t, irq_entry_tsc) == 8, "irq_common_stub stores the entry rdtsc at [gs:8]");
+
+/* The flat code and data segments of gdt.asm, at the same selectors */
+static uint64_t gdt[GDT_FIRST_CPU + SMP_MAX_CPUS] __attribute__((aligned(8)));
+
+static struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) gdt_register;
+
+static uint64_t segment(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    return (limit & 0xffff)
+         | (uint64_t) (base & 0xffffff) << 16
+         | (uint64_t) access << 40
+         | (uint64_t) ((limit >> 16) & 0xf) << 48
+         | (uint64_t) (flags & 0xf0) << 48
+         | (uint64_t) (base >> 24) << 56;
+}
+
+void percpu_init(uint32_t id) {
+    if (id == 0) {
+        gdt[GDT_CODE] = segment(0, 0xfffff, SEGMENT_CODE, SEGMENT_4K_32BIT);
+        gdt[GDT_DATA] = segment(0, 0xfffff, SEGMENT_DATA, SEGMENT_4K_32BIT);
+        for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+            gdt[GDT_FIRST_CPU + i] = segment((uint32_t) &cpus[i], sizeof(cpu_t) - 1,
+                                             SEGMENT_DATA, SEGMENT_BYTE_32BIT);
+        }
+        gdt_register.limit = sizeof(gdt) - 1;
+        gdt_register.base = (uint32_t) gdt;
+    }
+
+    cpus[id].self = &cpus[id];
+    cpus[id].id = id;
+    asm volatile("lgdt (%0)" : : "r" (&gdt_register) : "memory");
+    asm volatile("mov %0, %%gs" : : "r" ((uint16_t) ((GDT_FIRST_CPU + id) * 8)) : "memory");
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SMP_MAX_CPUS 8
+#define SCHED_PRIORITIES 32 /* run queue levels; 0 is the idle thread only */
+
+struct Process;
+
+/*
+ * One FIFO per priority level plus a bitmap of the non-empty levels: the
+ * next thread is the head of the level found by a single bsr, whatever
+ * the number of threads. The idle thread is never queued; it runs when
+ * the bitmap is empty.
+ */
+typedef struct {
+    struct Process *levels[SCHED_PRIORITIES];
+    uint32_t bitmap;
+    uint32_t count;
+} run_queue_t;
+
+/*
+ * Everything a CPU owns. GS holds a segment based at the CPU's own
+ * entry, so this_cpu() is one load whichever CPU runs it. Entries are
+ * cache-line aligned so CPUs don't share lines they write every tick.
+ */
+typedef struct cpu {
+    struct cpu *self;          /* offset 0, read by this_cpu() */
+    uint32_t id;               /* index in cpus[] */
+    uint64_t irq_entry_tsc;    /* offset 8, written by irq_common_stub */
+    uint32_t apic_id;
+    volatile bool online;
+    struct Process *current;
+    struct Process *idle;
+    struct Process *switched_from; /* until switch_context is off its stack */
+    volatile bool need_resched;
+    uint32_t ticks;            /* timer interrupts taken */
+    uint32_t charged_tick;     /* clock_ticks_now() the running thread was last charged up to */
+    uint32_t irq_depth;
+    uint32_t steals;           /* threads taken from other CPUs' queues */
+    run_queue_t run_queue;
+} __attribute__((aligned(64))) cpu_t;
+
+extern cpu_t cpus[SMP_MAX_CPUS];
+
+/* Loads the GDT with this CPU's segment and points GS at cpus[id]; first thing on every CPU */
+void percpu_init(uint32_t id);
+
+static inline cpu_t *this_cpu() {
+    cpu_t *cpu;
+    asm volatile("mov %%gs:0, %0" : "=r" (cpu));
+    return cpu;
+}
@@ -0,0 +1,201 @@
+#include "pmm.h"
+#include "cpu.h"
+#include "kernel.h"
+#include "klog.h"
+#include "kstring.h"
+#include "spinlock.h"
+#include <stdbool.h>
+
+/*
+ * Buddy allocator over 4 KB frames. A free run of 2^k frames starts at a
+ * frame number that is a multiple of 2^k; its buddy is the run at
+ * pfn ^ 2^k. Free runs are linked through their own first bytes, which
+ * works because physical memory is addressed directly.
+ */
+typedef struct free_run {
+    struct free_run *next;
+    struct free_run *prev;
+} free_run_t;
+
+/* frame_state[pfn] for the first frame of a free run; 0 for anything else */
+#define FRAME_FREE_HEAD 0x80
+
+static free_run_t *free_lists[PMM_MAX_ORDER + 1];
+static uint8_t *frame_state;
+static uint32_t frame_count;
+static uint32_t free_frames;
+static uint32_t usable_frames;
+
+/* Protected by pmm_lock: free lists, frame_state, free_frames; taken inside the heap lock when the heap grows */
+static lock_class_t pmm_lock_class = LOCK_CLASS("pmm");
+static spinlock_t pmm_lock = SPINLOCK_INIT(&pmm_lock_class);
+
+/* From the linker: first byte past the kernel's .bss */
+extern uint8_t _end[];
+
+static inline free_run_t *run_at(uint32_t pfn) {
+    return (free_run_t *) (pfn << PAGE_SHIFT);
+}
+
+static void push_run(uint32_t pfn, int order) {
+    free_run_t *run = run_at(pfn);
+    run->prev = 0;
+    run->next = free_lists[order];
+    if (run->next) run->next->prev = run;
+    free_lists[order] = run;
+    frame_state[pfn] = FRAME_FREE_HEAD | order;
+}
+
+static void remove_run(uint32_t pfn, int order) {
+    free_run_t *run = run_at(pfn);
+    if (run->prev) run->prev->next = run->next;
+    else free_lists[order] = run->next;
+    if (run->next) run->next->prev = run->prev;
+    frame_state[pfn] = 0;
+}
+
+uint32_t pmm_alloc_pages(int order) {
+    if (order < 0 || order > PMM_MAX_ORDER) return 0;
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    int o = order;
+    while (o <= PMM_MAX_ORDER && !free_lists[o]) o++;
+    if (o > PMM_MAX_ORDER) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return 0;
+    }
+
+    uint32_t pfn = (uint32_t) free_lists[o] >> PAGE_SHIFT;
+    remove_run(pfn, o);
+    // Split down, returning the upper halves
+    while (o > order) {
+        o--;
+        push_run(pfn + (1U << o), o);
+    }
+    free_frames -= 1U << order;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    return pfn << PAGE_SHIFT;
+}
+
+static void free_run(uint32_t pfn, int order) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1U << order);
+        if (buddy >= frame_count || frame_state[buddy] != (FRAME_FREE_HEAD | order)) break;
+        remove_run(buddy, order);
+        pfn &= ~(1U << order);
+        order++;
+    }
+    push_run(pfn, order);
+}
+
+void pmm_free_pages(uint32_t address, int order) {
+    if (!address || order < 0 || order > PMM_MAX_ORDER) return;
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    free_frames += 1U << order;
+    free_run(address >> PAGE_SHIFT, order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+int pmm_order_for(uint32_t bytes) {
+    int order = 0;
+    while (order <= PMM_MAX_ORDER && ((uint32_t) PAGE_SIZE << order) < bytes) order++;
+    return order;
+}
+
+uint32_t pmm_free_frames() {
+    return free_frames;
+}
+
+uint32_t pmm_usable_frames() {
+    return usable_frames;
+}
+
+uint32_t pmm_highest_address() {
+    return frame_count << PAGE_SHIFT;
+}
+
+/* Hands frames [start, end) to the allocator as the largest aligned runs that fit */
+static void add_frames(uint32_t start, uint32_t end) {
+    while (start < end) {
+        int order = PMM_MAX_ORDER;
+        while (order > 0 && ((start & ((1U << order) - 1)) || start + (1U << order) > end)) order--;
+        free_run(start, order);
+        free_frames += 1U << order;
+        usable_frames += 1U << order;
+        start += 1U << order;
+    }
+}
+
+/* First byte past what the MBR loaded: the kernel with its .bss, then the initrd if there is one */
+static uint32_t image_end() {
+    uint32_t end = (uint32_t) _end > PMM_LOW_MEMORY ? (uint32_t) _end : PMM_LOW_MEMORY;
+    uint32_t initrd_end = initrd_address + initrd_sectors * 512;
+    if (initrd_sectors && initrd_end > end) end = initrd_end;
+    return end;
+}
+
+/* Usable frames of an E820 entry, clipped to [end of the image, PMM_HIGH_LIMIT); false if none */
+static bool usable_range(e820_entry_t *entry, uint32_t *start, uint32_t *end) {
+    if (entry->type != E820_USABLE) return false;
+
+    uint64_t base = entry->base;
+    uint64_t limit = entry->base + entry->length;
+    uint32_t kernel_end = image_end();
+    if (base < kernel_end) base = kernel_end;
+    if (limit > PMM_HIGH_LIMIT) limit = PMM_HIGH_LIMIT;
+    if (limit <= base) return false;
+
+    *start = (uint32_t) ((base + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    *end = (uint32_t) (limit >> PAGE_SHIFT);
+    return *end > *start;
+}
+
+void pmm_init() {
+    uint32_t count = *(uint32_t *) E820_COUNT_ADDRESS;
+    e820_entry_t *map = (e820_entry_t *) E820_ENTRIES_ADDRESS;
+    if (count > E820_MAX_ENTRIES) count = 0;
+
+    uint32_t start, end;
+    for (uint32_t i = 0; i < count; i++) {
+        if (usable_range(&map[i], &start, &end) && end > frame_count) frame_count = end;
+    }
+
+    // One state byte per frame, carved from the front of the first range large enough
+    uint32_t state_frames = (frame_count + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint32_t state_start = 0;
+    for (uint32_t i = 0; i < count && !frame_state; i++) {
+        if (usable_range(&map[i], &start, &end) && end - start > state_frames) {
+            state_start = start;
+            frame_state = (uint8_t *) (start << PAGE_SHIFT);
+        }
+    }
+    if (!frame_state) {
+        frame_count = 0;
+        kprintf(KLOG_WARN, "pmm: no usable memory above 1 MB in the E820 map (%u entries)\n", count);
+        return;
+    }
+    memset(frame_state, 0, frame_count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!usable_range(&map[i], &start, &end)) continue;
+        if (start == state_start) start += state_frames;
+        add_frames(start, end);
+    }
+}
+
+void pmm_report() {
+    uint32_t count = *(uint32_t *) E820_COUNT_ADDRESS;
+    e820_entry_t *map = (e820_entry_t *) E820_ENTRIES_ADDRESS;
+    if (count > E820_MAX_ENTRIES) count = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t limit = map[i].base + map[i].length - 1;
+        kprintf(KLOG_INFO, "e820: %08x%08x-%08x%08x type %u\n",
+                (uint32_t) (map[i].base >> 32), (uint32_t) map[i].base,
+                (uint32_t) (limit >> 32), (uint32_t) limit, map[i].type);
+    }
+    kprintf(KLOG_INFO, "pmm: %u KB usable above 1 MB, %u KB free, %u frames tracked\n",
+            usable_frames * (PAGE_SIZE / 1024), free_frames * (PAGE_SIZE / 1024), frame_count);
+}
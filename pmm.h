@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+
+/* Where mbr.asm leaves the E820 map (see memory-map.asm) */
+#define E820_COUNT_ADDRESS 0x500
+#define E820_ENTRIES_ADDRESS 0x504
+#define E820_MAX_ENTRIES 64
+#define E820_USABLE 1
+
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;
+} __attribute__((packed)) e820_entry_t;
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+
+/* Largest run handed out at once: 2^10 frames = 4 MB */
+#define PMM_MAX_ORDER 10
+
+/* Everything below this stays reserved: IVT, BDA, SMP trampoline, boot stack, VGA, BIOS. The kernel image
+ * sits right above it and is reserved up to its _end symbol, or the end of the initrd. */
+#define PMM_LOW_MEMORY 0x100000
+
+/* Frames above this are ignored so the identity map never runs into the VM_ANON window */
+#define PMM_HIGH_LIMIT 0xC0000000
+
+void pmm_init();
+
+/* Physical address of 2^order contiguous, naturally aligned frames, or 0 */
+uint32_t pmm_alloc_pages(int order);
+
+void pmm_free_pages(uint32_t address, int order);
+
+/* Smallest order whose run holds bytes */
+int pmm_order_for(uint32_t bytes);
+
+uint32_t pmm_free_frames();
+
+uint32_t pmm_usable_frames();
+
+/* End of the highest frame the allocator can hand out */
+uint32_t pmm_highest_address();
+
+void pmm_report();
@@ -34,4 +34,23 @@ unsigned short port_word_in(uint16_t port) {
 
 void port_word_out(uint16_t port, uint16_t data) {
     asm("out %%ax, %%dx" : : "a" (data), "d" (port));
-}
\ No newline at end of file
+}
+
+uint32_t port_dword_in(uint16_t port) {
+    uint32_t result;
+    asm("in %%dx, %%eax" : "=a" (result) : "d" (port));
+    return result;
+}
+
+void port_dword_out(uint16_t port, uint32_t data) {
+    asm("out %%eax, %%dx" : : "a" (data), "d" (port));
+}
+
+/* count 16-bit reads from one port into buffer, e.g. a sector from an ATA data register */
+void port_words_in(uint16_t port, void *buffer, uint32_t count) {
+    asm volatile("rep insw" : "+D" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+void port_words_out(uint16_t port, const void *buffer, uint32_t count) {
+    asm volatile("rep outsw" : "+S" (buffer), "+c" (count) : "d" (port) : "memory");
+}
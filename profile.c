@@ -0,0 +1,140 @@
+#include "profile.h"
+#include "clock.h"
+#include "cpu.h"
+#include "klog.h"
+#include "serial.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PROFILE_SUMMARY_ENTRIES 10
+
+static profile_bucket_t buckets[PROFILE_BUCKETS];
+static volatile bool profiling = false;
+static uint32_t interval = PROFILE_DEFAULT_INTERVAL;
+static uint32_t ticks_left = 0;
+static uint32_t samples = 0;
+static uint32_t dropped = 0; /* no free bucket for a new stack */
+
+void profile_start(uint32_t interval_ticks) {
+    uint32_t flags = irq_save();
+    interval = interval_ticks ? interval_ticks : 1;
+    ticks_left = interval;
+    profiling = true;
+    irq_restore(flags);
+}
+
+void profile_stop() {
+    profiling = false;
+}
+
+void profile_reset() {
+    uint32_t flags = irq_save();
+    for (int i = 0; i < PROFILE_BUCKETS; i++) buckets[i].count = 0;
+    samples = 0;
+    dropped = 0;
+    irq_restore(flags);
+}
+
+/* Walks saved EBPs upwards from the interrupted frame, stopping at anything that doesn't look like one */
+static uint32_t walk_frames(registers_t *regs, uint32_t *pcs) {
+    uint32_t depth = 0;
+    pcs[depth++] = regs->eip;
+
+    uint32_t low = regs->esp;
+    uint32_t *frame = (uint32_t *) regs->ebp;
+    while (depth < PROFILE_MAX_DEPTH) {
+        uint32_t address = (uint32_t) frame;
+        if (address < low || address - regs->esp >= PROFILE_STACK_WINDOW || (address & 3)) break;
+        uint32_t return_address = frame[1];
+        if (return_address == 0) break;
+        pcs[depth++] = return_address;
+        low = address + 8;
+        frame = (uint32_t *) frame[0];
+    }
+    return depth;
+}
+
+static uint32_t hash_stack(uint32_t *pcs, uint32_t depth) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < depth; i++) hash = (hash ^ pcs[i]) * 16777619u;
+    return hash;
+}
+
+static bool same_stack(profile_bucket_t *bucket, uint32_t *pcs, uint32_t depth) {
+    if (bucket->depth != depth) return false;
+    for (uint32_t i = 0; i < depth; i++) {
+        if (bucket->pcs[i] != pcs[i]) return false;
+    }
+    return true;
+}
+
+void profile_tick(registers_t *regs) {
+    if (!profiling || --ticks_left > 0) return;
+    ticks_left = interval;
+
+    uint32_t pcs[PROFILE_MAX_DEPTH];
+    uint32_t depth = walk_frames(regs, pcs);
+    samples++;
+
+    /* Linear probing; a stack keeps its bucket until profile_reset() */
+    uint32_t index = hash_stack(pcs, depth) & (PROFILE_BUCKETS - 1);
+    for (int probe = 0; probe < PROFILE_BUCKETS; probe++) {
+        profile_bucket_t *bucket = &buckets[index];
+        if (bucket->count == 0) {
+            bucket->depth = depth;
+            for (uint32_t i = 0; i < depth; i++) bucket->pcs[i] = pcs[i];
+            bucket->count = 1;
+            return;
+        }
+        if (same_stack(bucket, pcs, depth)) {
+            bucket->count++;
+            return;
+        }
+        index = (index + 1) & (PROFILE_BUCKETS - 1);
+    }
+    dropped++;
+}
+
+void profile_dump() {
+    /* Stop sampling while the table is read: writing to COM1 can sleep */
+    bool was_profiling = profiling;
+    profiling = false;
+
+    char line[32 + 9 * PROFILE_MAX_DEPTH];
+    int length = ksnprintf(line, sizeof(line), "PROFILE-BEGIN hz %u samples %u dropped %u\n",
+                           TIMER_HZ / interval, samples, dropped);
+    serial_write(line, length);
+
+    int top[PROFILE_SUMMARY_ENTRIES];
+    int top_count = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        profile_bucket_t *bucket = &buckets[i];
+        if (bucket->count == 0) continue;
+
+        length = ksnprintf(line, sizeof(line), "PROFILE %u", bucket->count);
+        for (uint32_t d = 0; d < bucket->depth; d++) {
+            length += ksnprintf(line + length, sizeof(line) - length, " %x", bucket->pcs[d]);
+        }
+        length += ksnprintf(line + length, sizeof(line) - length, "\n");
+        serial_write(line, length);
+
+        /* Keep the heaviest stacks for the console summary, by insertion */
+        int position = top_count < PROFILE_SUMMARY_ENTRIES ? top_count++ : PROFILE_SUMMARY_ENTRIES;
+        while (position > 0 && buckets[top[position - 1]].count < bucket->count) {
+            if (position < PROFILE_SUMMARY_ENTRIES) top[position] = top[position - 1];
+            position--;
+        }
+        if (position < PROFILE_SUMMARY_ENTRIES) top[position] = i;
+    }
+    serial_write("PROFILE-END\n", 12);
+
+    kprintf(KLOG_CONT, "%u samples, %u dropped; busiest stacks (eip, caller):\n", samples, dropped);
+    for (int i = 0; i < top_count; i++) {
+        profile_bucket_t *bucket = &buckets[top[i]];
+        kprintf(KLOG_CONT, "%6u  %p  %p\n", bucket->count, (void *) bucket->pcs[0],
+                (void *) (bucket->depth > 1 ? bucket->pcs[1] : 0));
+    }
+    profiling = was_profiling;
+}
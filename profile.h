@@ -0,0 +1,37 @@
+#pragma once
+
+#include "isr.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sampling profiler. The timer interrupt records the interrupted eip and
+ * up to PROFILE_MAX_DEPTH - 1 return addresses from the EBP chain; equal
+ * stacks share one counted bucket. profile_dump() writes the buckets to
+ * COM1 for tools/profile.py to symbolize against kernel.map.
+ */
+#define PROFILE_BUCKETS 1024 /* powers of two */
+#define PROFILE_MAX_DEPTH 8
+#define PROFILE_DEFAULT_INTERVAL 1 /* ticks between samples */
+/* Frame pointers further than this above the interrupted esp end the walk */
+#define PROFILE_STACK_WINDOW (64 * 1024)
+
+typedef struct {
+    uint32_t count;
+    uint32_t depth;
+    uint32_t pcs[PROFILE_MAX_DEPTH]; /* pcs[0] is the sampled eip, then callers */
+} profile_bucket_t;
+
+/* Samples every interval_ticks timer ticks until profile_stop() */
+void profile_start(uint32_t interval_ticks);
+
+void profile_stop();
+
+void profile_reset();
+
+/* Timer interrupt hook */
+void profile_tick(registers_t *regs);
+
+/* Writes "PROFILE <count> <eip> <caller>..." lines to COM1 and a short summary to the console */
+void profile_dump();
@@ -0,0 +1,631 @@
+#include "sched.h"
+#include "acct.h"
+#include "apic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "idt.h"
+#include "isr.h"
+#include "kernel.h"
+#include "klog.h"
+#include "kstring.h"
+#include "nn.h"
+#include "percpu.h"
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EFLAGS_IF (1 << 9)
+#define KERNEL_DS 0x10
+#define IDLE_PRIORITY 0
+#define LOWEST_PRIORITY 1
+
+Process processes[MAX_PROCESSES] __attribute__((aligned(16)));
+
+static uint32_t table_cpu_time[MAX_PROCESSES] __attribute__((aligned(16)));
+static uint32_t table_wait_time[MAX_PROCESSES] __attribute__((aligned(16)));
+static int32_t table_priority[MAX_PROCESSES] __attribute__((aligned(16)));
+static uint32_t table_active[(MAX_PROCESSES + 31) / 32];
+
+ProcessTable process_table = {
+    .cpu_time = table_cpu_time,
+    .wait_time = table_wait_time,
+    .priority = table_priority,
+    .active = table_active,
+    .count = MAX_PROCESSES
+};
+
+/*
+ * Stacks stay eagerly backed rather than demand-zero: everything runs in
+ * ring 0 without a stack switch, so a fault on an untouched stack page
+ * would push its own frame onto that page and turn into a double fault.
+ */
+static uint8_t thread_stacks[MAX_PROCESSES][THREAD_STACK_SIZE] __attribute__((aligned(16)));
+
+/*
+ * Each CPU picks from its own run queue (percpu.h) and steals from the
+ * others' when that is empty. sched_lock covers every run queue, wait
+ * queue and the sleeper list, and thread states; it is taken with
+ * interrupts off since the timer and wake_up() from IRQs need it too.
+ * Every CPU takes it on each switch, so it is an MCS lock; never being
+ * nested, it needs one queue node per CPU.
+ */
+static lock_class_t sched_lock_class = LOCK_CLASS("sched");
+static mcs_lock_t sched_lock = MCS_LOCK_INIT(&sched_lock_class);
+
+static struct {
+    mcs_node_t node;
+} __attribute__((aligned(64))) sched_lock_nodes[SMP_MAX_CPUS];
+static int next_pid = 1;
+
+/* Sleeping threads by ascending sleep_deadline */
+static Process *sleepers = 0;
+
+static void sched_lock_acquire() {
+    mcs_lock(&sched_lock, &sched_lock_nodes[this_cpu()->id].node);
+}
+
+static void sched_lock_release() {
+    mcs_unlock(&sched_lock, &sched_lock_nodes[this_cpu()->id].node);
+}
+
+static uint8_t initial_fpu_state[512] __attribute__((aligned(16)));
+static bool use_fxsave = false;
+
+static void fpu_save(uint8_t *area) {
+    if (use_fxsave) {
+        asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+    } else {
+        asm volatile("fnsave (%0)" : : "r" (area) : "memory");
+    }
+}
+
+static void fpu_restore(uint8_t *area) {
+    if (use_fxsave) {
+        asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+    } else {
+        asm volatile("frstor (%0)" : : "r" (area) : "memory");
+    }
+}
+
+
+static void enqueue(cpu_t *cpu, Process *thread) {
+    run_queue_t *queue = &cpu->run_queue;
+    int level = thread->dynamic_priority;
+    Process *head = queue->levels[level];
+    if (head == 0) {
+        thread->next = thread;
+        thread->prev = thread;
+        queue->levels[level] = thread;
+        queue->bitmap |= 1u << level;
+    } else {
+        thread->next = head;
+        thread->prev = head->prev;
+        head->prev->next = thread;
+        head->prev = thread;
+    }
+    queue->count++;
+    thread->cpu = cpu->id;
+    thread->state = THREAD_READY;
+    thread->ready_since = clock_ticks_now();
+    acct_thread_ready(thread);
+}
+
+static void run_queue_remove(run_queue_t *queue, Process *thread) {
+    int level = thread->dynamic_priority;
+    if (thread->next == thread) {
+        queue->levels[level] = 0;
+        queue->bitmap &= ~(1u << level);
+    } else {
+        thread->prev->next = thread->next;
+        thread->next->prev = thread->prev;
+        if (queue->levels[level] == thread) queue->levels[level] = thread->next;
+    }
+    queue->count--;
+}
+
+static Process *dequeue_highest(run_queue_t *queue) {
+    if (queue->bitmap == 0) return 0;
+    Process *thread = queue->levels[31 - __builtin_clz(queue->bitmap)];
+    run_queue_remove(queue, thread);
+    return thread;
+}
+
+/* Another CPU may take it: not bound, and no CPU is still on its stack */
+static bool can_migrate(Process *thread) {
+    return thread->bound_cpu == SCHED_ANY_CPU && !thread->on_cpu;
+}
+
+static bool cache_hot(Process *thread) {
+    return system_ticks - thread->last_ran < SCHED_CACHE_HOT_TICKS;
+}
+
+static bool cpu_idle(cpu_t *cpu) {
+    return cpu->current == cpu->idle && cpu->run_queue.count == 0;
+}
+
+/*
+ * An empty queue takes the best thread queued on another CPU: one that
+ * has gone cold there first, since moving it costs nothing extra. A
+ * cache-hot thread is only taken from a CPU busy running something else,
+ * where it would otherwise wait anyway.
+ */
+static Process *steal(cpu_t *thief) {
+    Process *cold = 0;
+    Process *hot = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        cpu_t *victim = &cpus[i];
+        if (victim == thief || !victim->online || victim->run_queue.count == 0) continue;
+        bool busy = victim->current != victim->idle;
+
+        for (int level = SCHED_PRIORITIES - 1; level > IDLE_PRIORITY; level--) {
+            Process *head = victim->run_queue.levels[level];
+            if (head == 0) continue;
+            Process *thread = head;
+            do {
+                if (!can_migrate(thread)) {
+                    /* stays */
+                } else if (!cache_hot(thread)) {
+                    if (cold == 0 || level > cold->dynamic_priority) cold = thread;
+                } else if (busy && (hot == 0 || level > hot->dynamic_priority)) {
+                    hot = thread;
+                }
+                thread = thread->next;
+            } while (thread != head);
+        }
+    }
+
+    Process *thread = cold ? cold : hot;
+    if (thread == 0) return 0;
+    run_queue_remove(&cpus[thread->cpu].run_queue, thread);
+    thief->steals++;
+    return thread;
+}
+
+/*
+ * Where a thread that became ready goes: back to its last CPU if that is
+ * idle, else any idle CPU it may run on, else its last CPU anyway.
+ */
+static cpu_t *select_cpu(Process *thread) {
+    if (thread->bound_cpu != SCHED_ANY_CPU) return &cpus[thread->bound_cpu];
+    cpu_t *last = &cpus[thread->cpu];
+    if (cpu_idle(last)) return last;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (cpus[i].online && cpu_idle(&cpus[i])) return &cpus[i];
+    }
+    return last;
+}
+
+/* Maps the NN activation onto a run queue level, centred on the middle one */
+static int priority_from_activation(int activation) {
+    int level = SCHED_PRIORITIES / 2 + activation / 4;
+    if (level < LOWEST_PRIORITY) return LOWEST_PRIORITY;
+    if (level > SCHED_PRIORITIES - 1) return SCHED_PRIORITIES - 1;
+    return level;
+}
+
+static void update_dynamic_priority(Process *thread) {
+    if (thread->is_idle) return;
+    if (thread->consecutive_slices >= SCHED_MAX_CONSECUTIVE_SLICES) {
+        /* Let everything else that is ready go first, as the old loop did */
+        thread->consecutive_slices = 0;
+        thread->dynamic_priority = LOWEST_PRIORITY;
+        return;
+    }
+    thread->dynamic_priority = priority_from_activation(calculate_activation(thread));
+}
+
+/* Preempts cpu's running thread if thread should go first; remote CPUs get an IPI */
+static void resched_cpu(cpu_t *cpu, Process *thread) {
+    Process *running = cpu->current;
+    if (running != cpu->idle && thread->dynamic_priority <= running->dynamic_priority) return;
+    cpu->need_resched = true;
+    if (cpu != this_cpu()) apic_send_ipi(cpu->apic_id, APIC_RESCHEDULE_VECTOR);
+}
+
+/* Queues thread where select_cpu() says; a thread still on a CPU's stack can only go back there */
+static void make_ready(Process *thread) {
+    update_dynamic_priority(thread);
+    cpu_t *cpu = thread->on_cpu ? &cpus[thread->cpu] : select_cpu(thread);
+    enqueue(cpu, thread);
+    resched_cpu(cpu, thread);
+}
+
+/* New threads start here through the iret in irq_common_stub */
+static void thread_start() {
+    current_thread->entry(current_thread->arg);
+    thread_exit();
+}
+
+static void yield_callback(registers_t *regs) {
+    (void) regs;
+    this_cpu()->need_resched = true;
+}
+
+/* The first free slot, zeroed; call with sched_lock held */
+static Process *claim_slot() {
+    for (int slot = 1; slot < MAX_PROCESSES; slot++) {
+        Process *thread = &processes[slot];
+        if (thread->state == THREAD_UNUSED) {
+            memset(thread, 0, sizeof(Process));
+            thread->slot = slot;
+            return thread;
+        }
+    }
+    return 0;
+}
+
+static void become_idle(cpu_t *cpu, Process *idle) {
+    idle->name = "idle";
+    idle->state = THREAD_RUNNING;
+    idle->dynamic_priority = IDLE_PRIORITY;
+    idle->is_idle = true;
+    idle->on_cpu = true;
+    idle->cpu = cpu->id;
+    idle->bound_cpu = cpu->id;
+    cpu->idle = idle;
+    cpu->current = idle;
+    cpu->online = true;
+}
+
+void sched_init() {
+    use_fxsave = cpu_has(CPU_FEATURE_FXSR);
+    fpu_save(initial_fpu_state);
+    if (!use_fxsave) asm volatile("frstor (%0)" : : "r" (initial_fpu_state));
+
+    processes[0].pid = 0;
+    processes[0].slot = 0;
+    become_idle(this_cpu(), &processes[0]);
+
+    set_idt_gate(SCHED_YIELD_VECTOR, (uint32_t) isr48);
+    register_interrupt_handler(SCHED_YIELD_VECTOR, yield_callback);
+    register_interrupt_handler(APIC_RESCHEDULE_VECTOR, yield_callback);
+}
+
+bool sched_init_cpu() {
+    uint32_t flags = irq_save();
+    sched_lock_acquire();
+    Process *idle = claim_slot();
+    if (idle) {
+        idle->pid = next_pid++;
+        become_idle(this_cpu(), idle);
+    }
+    sched_lock_release();
+    irq_restore(flags);
+    return idle != 0;
+}
+
+Process *thread_create(char *name, void (*entry)(void *), void *arg, int priority) {
+    return thread_create_on(name, entry, arg, priority, 0);
+}
+
+Process *thread_create_on(char *name, void (*entry)(void *), void *arg, int priority, int cpu) {
+    if (cpu != SCHED_ANY_CPU && (cpu < 0 || cpu >= SMP_MAX_CPUS || !cpus[cpu].online)) {
+        kprintf(KLOG_ERROR, "thread_create: cpu %d is not online for %s\n", cpu, name);
+        return 0;
+    }
+
+    uint32_t flags = irq_save();
+    sched_lock_acquire();
+    Process *thread = claim_slot();
+    if (thread == 0) {
+        sched_lock_release();
+        irq_restore(flags);
+        kprintf(KLOG_ERROR, "thread_create: no free slot for %s\n", name);
+        return 0;
+    }
+
+    int slot = thread->slot;
+    thread->pid = next_pid++;
+    thread->name = name;
+    thread->bound_cpu = cpu;
+    thread->cpu = cpu == SCHED_ANY_CPU ? (int) this_cpu()->id : cpu;
+    process_table.cpu_time[slot] = 0;
+    process_table.wait_time[slot] = 0;
+    process_table.priority[slot] = priority;
+    process_table.active[slot >> 5] |= 1u << (slot & 31);
+    thread->entry = entry;
+    thread->arg = arg;
+    memcpy(thread->fpu_state, initial_fpu_state, sizeof(initial_fpu_state));
+
+    /* Build the frame irq_common_stub pops: registers_t, then a fake return address */
+    uint32_t *sp = (uint32_t *) (thread_stacks[slot] + THREAD_STACK_SIZE);
+    *--sp = 0;                      /* return address seen by thread_start */
+    *--sp = EFLAGS_IF;              /* eflags */
+    *--sp = KERNEL_CS;              /* cs */
+    *--sp = (uint32_t) thread_start; /* eip */
+    *--sp = 0;                      /* err_code */
+    *--sp = SCHED_YIELD_VECTOR;     /* int_no */
+    for (int i = 0; i < 8; i++) {
+        *--sp = 0;                  /* pusha registers; ebp = 0 ends frame walks */
+    }
+    *--sp = KERNEL_DS;              /* ds */
+    thread->esp = (uint32_t) sp;
+
+    make_ready(thread);
+    sched_lock_release();
+    irq_restore(flags);
+    return thread;
+}
+
+void thread_yield() {
+    asm volatile("int %0" : : "i" (SCHED_YIELD_VECTOR) : "memory");
+}
+
+void thread_exit() {
+    asm volatile("cli");
+    Process *thread = current_thread;
+    sched_lock_acquire();
+    thread->state = THREAD_DEAD;
+    process_table.active[thread->slot >> 5] &= ~(1u << (thread->slot & 31));
+    sched_lock_release();
+    thread_yield();
+    while (1) asm volatile("hlt");
+}
+
+/* The caller yields right after dropping sched_lock; a wake-up in between just requeues it */
+static void mark_blocked(Process *thread) {
+    thread->state = THREAD_BLOCKED;
+    thread->wake_pending = false;
+    thread->consecutive_slices = 0;
+}
+
+void thread_block() {
+    uint32_t flags = irq_save();
+    Process *thread = current_thread;
+    sched_lock_acquire();
+    if (thread->wake_pending) {
+        thread->wake_pending = false;
+        sched_lock_release();
+    } else {
+        mark_blocked(thread);
+        sched_lock_release();
+        thread_yield();
+    }
+    irq_restore(flags);
+}
+
+static void wake_locked(Process *thread) {
+    if (thread->state == THREAD_BLOCKED) {
+        make_ready(thread);
+    } else if (thread->state == THREAD_RUNNING) {
+        thread->wake_pending = true;
+    }
+}
+
+void thread_wake(Process *thread) {
+    uint32_t flags = irq_save();
+    sched_lock_acquire();
+    wake_locked(thread);
+    sched_lock_release();
+    irq_restore(flags);
+}
+
+/* Removes thread from a list linked through wait_next, if it is there */
+static void unlink_waiter(Process **list, Process *thread) {
+    for (Process **link = list; *link != 0; link = &(*link)->wait_next) {
+        if (*link == thread) {
+            *link = thread->wait_next;
+            thread->wait_next = 0;
+            return;
+        }
+    }
+}
+
+static bool can_block(Process *thread) {
+    return thread != 0 && !thread->is_idle;
+}
+
+void wait_queue_sleep_since(wait_queue_t *queue, uint32_t seen) {
+    Process *thread = current_thread;
+    if (!can_block(thread)) {
+        asm volatile("sti; hlt; cli");
+        return;
+    }
+
+    sched_lock_acquire();
+    if (queue->wakeups != seen) {
+        sched_lock_release();
+        return;
+    }
+    if (thread->waiting_on) unlink_waiter(&thread->waiting_on->head, thread);
+    thread->wait_next = queue->head;
+    thread->waiting_on = queue;
+    queue->head = thread;
+    mark_blocked(thread);
+    sched_lock_release();
+    thread_yield();
+}
+
+void wait_queue_sleep(wait_queue_t *queue) {
+    wait_queue_sleep_since(queue, queue->wakeups);
+}
+
+void wake_up(wait_queue_t *queue) {
+    uint32_t flags = irq_save();
+    sched_lock_acquire();
+    queue->wakeups++;
+    Process *thread = queue->head;
+    queue->head = 0;
+    while (thread != 0) {
+        Process *next = thread->wait_next;
+        thread->wait_next = 0;
+        thread->waiting_on = 0;
+        wake_locked(thread);
+        thread = next;
+    }
+    sched_lock_release();
+    irq_restore(flags);
+}
+
+void sleep_until(uint64_t deadline) {
+    uint32_t flags = irq_save();
+    Process *thread = current_thread;
+    bool block = can_block(thread);
+    while (ktime_get() < deadline) {
+        if (block) {
+            sched_lock_acquire();
+            unlink_waiter(&sleepers, thread);
+            Process **link = &sleepers;
+            while (*link != 0 && (*link)->sleep_deadline <= deadline) link = &(*link)->wait_next;
+            thread->sleep_deadline = deadline;
+            thread->wait_next = *link;
+            *link = thread;
+            mark_blocked(thread);
+            sched_lock_release();
+        }
+        clock_request_deadline(deadline);
+        if (block) {
+            thread_yield();
+        } else {
+            asm volatile("sti; hlt; cli");
+        }
+    }
+    if (block) {
+        sched_lock_acquire();
+        unlink_waiter(&sleepers, thread);
+        sched_lock_release();
+    }
+    irq_restore(flags);
+}
+
+void sleep_ticks(uint32_t ticks) {
+    sleep_until(ktime_get() + (uint64_t) ticks * NSEC_PER_TICK);
+}
+
+/* Boot CPU timer interrupt: readies every sleeper whose deadline has passed */
+static void wake_sleepers() {
+    if (sleepers == 0) return;
+    uint64_t now = ktime_get();
+    uint64_t next = NO_DEADLINE;
+    sched_lock_acquire();
+    while (sleepers != 0 && sleepers->sleep_deadline <= now) {
+        Process *thread = sleepers;
+        sleepers = thread->wait_next;
+        thread->wait_next = 0;
+        wake_locked(thread);
+    }
+    if (sleepers != 0) next = sleepers->sleep_deadline;
+    sched_lock_release();
+    if (next != NO_DEADLINE) clock_request_deadline(next);
+}
+
+void preempt_disable() {
+    uint32_t flags = irq_save();
+    if (current_thread) current_thread->preempt_count++;
+    irq_restore(flags);
+}
+
+void preempt_enable() {
+    uint32_t flags = irq_save();
+    Process *thread = current_thread;
+    bool resched = thread != 0 && --thread->preempt_count == 0 && this_cpu()->need_resched;
+    irq_restore(flags);
+
+    /* In interrupt context the switch happens on the way out of irq_handler */
+    if (resched && (flags & EFLAGS_IF)) thread_yield();
+}
+
+/* Threads queued on another CPU that this idle one might steal */
+static bool work_elsewhere(cpu_t *cpu) {
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (&cpus[i] != cpu && cpus[i].online && cpus[i].run_queue.count > 0) return true;
+    }
+    return false;
+}
+
+/*
+ * Charges the ticks elapsed since the last charge, not one per interrupt:
+ * in tickless mode the boot CPU's timer fires at deadlines, which can be
+ * several ticks apart or less than one.
+ */
+void sched_tick() {
+    cpu_t *cpu = this_cpu();
+    Process *thread = cpu->current;
+    if (thread == 0) return;
+    cpu->ticks++;
+    uint32_t now = clock_ticks_now();
+    uint32_t elapsed = now - cpu->charged_tick;
+    cpu->charged_tick = now;
+    if (cpu->id == 0) {
+        wake_sleepers();
+        nn_train_tick();
+    }
+    if (thread == cpu->idle) {
+        if (work_elsewhere(cpu)) cpu->need_resched = true;
+        return;
+    }
+
+    process_table.cpu_time[thread->slot] += elapsed;
+    thread->cpu_ticks += elapsed;
+    if (thread->slice_left > 0 && elapsed > 0) {
+        thread->slice_left = elapsed < thread->slice_left ? thread->slice_left - elapsed : 0;
+        if (thread->slice_left == 0) {
+            thread->consecutive_slices++;
+            cpu->need_resched = true;
+        }
+    }
+}
+
+registers_t *sched_switch(registers_t *frame) {
+    cpu_t *cpu = this_cpu();
+    Process *prev = cpu->current;
+    if (!cpu->need_resched || prev == 0) return frame;
+    if (prev->preempt_count > 0 && prev->state == THREAD_RUNNING) return frame;
+    cpu->need_resched = false;
+
+    sched_lock_acquire();
+    if (prev->state == THREAD_RUNNING && prev != cpu->idle) {
+        update_dynamic_priority(prev);
+        enqueue(cpu, prev);
+    }
+
+    Process *next = dequeue_highest(&cpu->run_queue);
+    if (next == 0) next = steal(cpu);
+    uint32_t now = clock_ticks_now();
+    if (next == 0) {
+        next = cpu->idle;
+    } else {
+        process_table.wait_time[next->slot] += now - next->ready_since;
+        acct_thread_run(next);
+    }
+    next->state = THREAD_RUNNING;
+    next->slice_left = SCHED_TIMESLICE_TICKS;
+    next->cpu = cpu->id;
+    if (next == prev) {
+        sched_lock_release();
+        return frame;
+    }
+
+    /* prev keeps on_cpu until sched_switch_done(): nobody else may resume it before then */
+    prev->esp = (uint32_t) frame;
+    prev->last_ran = system_ticks;
+    if (prev->state != THREAD_DEAD) fpu_save(prev->fpu_state);
+    fpu_restore(next->fpu_state);
+    next->consecutive_slices = 0;
+    next->on_cpu = true;
+    cpu->current = next;
+    cpu->charged_tick = now;
+    cpu->switched_from = prev;
+    sched_lock_release();
+    return (registers_t *) next->esp;
+}
+
+void sched_switch_done() {
+    cpu_t *cpu = this_cpu();
+    Process *prev = cpu->switched_from;
+    if (prev == 0) return;
+    cpu->switched_from = 0;
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    /* Nothing runs on its stack any more, so the slot can be reused */
+    if (prev->state == THREAD_DEAD) __atomic_store_n(&prev->state, THREAD_UNUSED, __ATOMIC_RELEASE);
+}
+
+void sched_report() {
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        cpu_t *cpu = &cpus[i];
+        if (!cpu->online) continue;
+        kprintf(KLOG_CONT, "  cpu%d apic %u: %u ticks, %u steals, %u queued, running %s\n", i,
+                cpu->apic_id, cpu->ticks, cpu->steals, cpu->run_queue.count, cpu->current->name);
+    }
+}
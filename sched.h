@@ -0,0 +1,170 @@
+#pragma once
+
+#include "cpu.h"
+#include "isr.h"
+#include "percpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_PROCESSES 32 /* thread slots, including one idle thread per CPU */
+#define THREAD_STACK_SIZE 8192
+#define SCHED_TIMESLICE_TICKS 2
+/* A thread that uses this many slices in a row drops to the lowest level */
+#define SCHED_MAX_CONSECUTIVE_SLICES 2
+#define SCHED_YIELD_VECTOR 48
+/* Thread may run on any CPU; see thread_create_on() */
+#define SCHED_ANY_CPU (-1)
+/* A thread switched out this recently still has its working set in that CPU's cache */
+#define SCHED_CACHE_HOT_TICKS 2
+/* Buckets in each thread's ready-to-running wait histogram, see acct.h */
+#define ACCT_WAIT_BUCKETS 16
+
+typedef enum {
+    THREAD_UNUSED,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_DEAD
+} thread_state_t;
+
+/* A kernel thread. Its scheduling features live in process_table at index slot. */
+typedef struct Process {
+    int pid;
+    int slot; /* index in processes[] and process_table */
+    uint32_t cpu_ticks;
+
+    thread_state_t state;
+    char *name;
+    int dynamic_priority; /* run queue level */
+    uint32_t slice_left;
+    uint32_t consecutive_slices;
+    uint32_t ready_since; /* system_ticks when last queued */
+    uint64_t ready_tsc;   /* rdtsc when last queued, for the wait histogram */
+    uint64_t cpu_cycles;  /* charged by acct.c */
+    uint32_t wait_histogram[ACCT_WAIT_BUCKETS];
+    bool wake_pending;
+    bool is_idle;         /* a CPU's idle thread, never queued */
+    uint32_t preempt_count;
+    int cpu;              /* the CPU it runs or is queued on, or ran on last */
+    int bound_cpu;        /* SCHED_ANY_CPU, or the only CPU it may run on */
+    volatile bool on_cpu; /* its stack is in use until the switch away completes */
+    uint32_t last_ran;    /* system_ticks when last switched out */
+    uint32_t esp;         /* saved registers_t frame while switched out */
+    void (*entry)(void *);
+    void *arg;
+    struct Process *next; /* run queue links */
+    struct Process *prev;
+    struct Process *wait_next; /* wait queue or sleeper list link */
+    struct wait_queue *waiting_on;
+    uint64_t sleep_deadline; /* ktime ns, while on the sleeper list */
+    uint8_t fpu_state[512] __attribute__((aligned(16)));
+} Process;
+
+/*
+ * Scheduling features in struct-of-arrays form, indexed by thread slot,
+ * so a whole table can be scored four slots per SSE2 instruction.
+ * active has one bit per slot.
+ */
+typedef struct {
+    uint32_t *cpu_time;  /* ticks spent running */
+    uint32_t *wait_time; /* ticks spent ready but not running */
+    int32_t *priority;   /* static priority */
+    uint32_t *active;
+    int count;
+} ProcessTable;
+
+/*
+ * Threads blocked until wake_up(); linked through Process.wait_next.
+ * wakeups counts wake_up() calls so a sleeper can tell one happened
+ * after it last looked, even on another CPU.
+ */
+typedef struct wait_queue {
+    Process *head;
+    volatile uint32_t wakeups;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {0, 0}
+
+extern Process processes[MAX_PROCESSES];
+extern ProcessTable process_table;
+
+/* The thread running on this CPU; 0 before sched_init() */
+#define current_thread (this_cpu()->current)
+
+/* Turns the running boot code into the idle thread and enables switching */
+void sched_init();
+
+/* Same for a secondary CPU's boot code; false if there is no free slot for it */
+bool sched_init_cpu();
+
+/*
+ * Threads start bound to the boot CPU: most of the kernel still assumes
+ * one CPU. Pass SCHED_ANY_CPU to thread_create_on() for threads that
+ * only touch their own data (or take locks), so they can be spread out
+ * and stolen by idle CPUs.
+ */
+Process *thread_create(char *name, void (*entry)(void *), void *arg, int priority);
+
+Process *thread_create_on(char *name, void (*entry)(void *), void *arg, int priority, int cpu);
+
+void thread_yield();
+
+void thread_exit();
+
+/* Sleeps until thread_wake(); returns at once if a wake-up is already pending */
+void thread_block();
+
+/* Safe from interrupt context */
+void thread_wake(Process *thread);
+
+static inline uint32_t wait_queue_wakeups(wait_queue_t *queue) {
+    return __atomic_load_n(&queue->wakeups, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Call with interrupts disabled, after reading wait_queue_wakeups() into
+ * seen and then finding the awaited condition false; returns after a
+ * wake_up() (at once if one came since seen) and the caller checks again.
+ * The idle thread can't block, so it halts with an atomic sti; hlt instead.
+ */
+void wait_queue_sleep_since(wait_queue_t *queue, uint32_t seen);
+
+/* The same when every waker runs on this CPU, where interrupts off is enough */
+void wait_queue_sleep(wait_queue_t *queue);
+
+/* Wakes every waiter; safe from interrupt context */
+void wake_up(wait_queue_t *queue);
+
+/* Sleeps until condition holds; the check can't miss a wake_up() in between */
+#define wait_event(queue, condition) do { \
+        uint32_t wait_flags_ = irq_save(); \
+        uint32_t wait_seen_ = wait_queue_wakeups(queue); \
+        while (!(condition)) { \
+            wait_queue_sleep_since(queue, wait_seen_); \
+            wait_seen_ = wait_queue_wakeups(queue); \
+        } \
+        irq_restore(wait_flags_); \
+    } while (0)
+
+/* Sleeps until ktime_get() reaches deadline (ns) */
+void sleep_until(uint64_t deadline);
+
+void sleep_ticks(uint32_t ticks);
+
+/* Nestable; while disabled the running thread is only switched out if it blocks */
+void preempt_disable();
+
+void preempt_enable();
+
+/* Timer interrupt on any CPU: charges the tick and ends the slice */
+void sched_tick();
+
+/* Called on the way out of irq_handler; returns the frame to resume */
+registers_t *sched_switch(registers_t *frame);
+
+/* Called by switch_context once it runs on the resumed frame's stack */
+void sched_switch_done();
+
+/* Per-CPU tick, steal and run queue counts */
+void sched_report();
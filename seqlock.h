@@ -0,0 +1,61 @@
+#pragma once
+
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sequence lock for small read-mostly data, such as 64-bit values that
+ * i386 can't load in one instruction. Writers serialize on the spinlock
+ * and make the sequence odd while they write; readers never write
+ * anything and retry if the sequence was odd or changed under them:
+ *
+ *     do {
+ *         seq = read_seqbegin(&lock);
+ *         copy = data;
+ *     } while (read_seqretry(&lock, seq));
+ *
+ * A reader that can interrupt a writer on the same CPU would spin
+ * forever, so writers whose data IRQ handlers read use the _irqsave
+ * variants.
+ */
+typedef struct {
+    volatile uint32_t sequence;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INIT(class_) {0, SPINLOCK_INIT(class_)}
+
+static inline uint32_t read_seqbegin(seqlock_t *s) {
+    uint32_t sequence;
+    while ((sequence = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) cpu_relax();
+    return sequence;
+}
+
+static inline bool read_seqretry(seqlock_t *s, uint32_t sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+static inline void write_seqlock(seqlock_t *s) {
+    spin_lock(&s->lock);
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_sequnlock(seqlock_t *s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+    spin_unlock(&s->lock);
+}
+
+static inline uint32_t write_seqlock_irqsave(seqlock_t *s) {
+    uint32_t flags = irq_save();
+    write_seqlock(s);
+    return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock_t *s, uint32_t flags) {
+    write_sequnlock(s);
+    irq_restore(flags);
+}
@@ -0,0 +1,200 @@
+#include "serial.h"
+#include "cpu.h"
+#include "isr.h"
+#include "ports.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* 16550 registers, relative to COM1_PORT */
+#define UART_DATA 0         /* RBR/THR, divisor low byte with DLAB */
+#define UART_IER 1          /* interrupt enable, divisor high byte with DLAB */
+#define UART_IIR_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+
+#define IER_RX_AVAILABLE 0x01
+#define IER_TX_EMPTY 0x02
+
+#define IIR_NO_INTERRUPT 0x01
+#define IIR_ID_MASK 0x0e
+#define IIR_MODEM_STATUS 0x00
+#define IIR_TX_EMPTY 0x02
+#define IIR_RX_AVAILABLE 0x04
+#define IIR_LINE_STATUS 0x06
+#define IIR_RX_TIMEOUT 0x0c
+
+#define LCR_DLAB 0x80
+#define LCR_8N1 0x03
+#define FCR_ENABLE_CLEAR_TRIGGER14 0xc7
+#define MCR_DTR_RTS_OUT2 0x0b
+#define LSR_DATA_READY 0x01
+#define LSR_TX_EMPTY 0x20
+#define LSR_TX_IDLE 0x40 /* holding and shift registers both empty */
+
+#define UART_FIFO_SIZE 16
+#define EFLAGS_IF (1 << 9)
+
+static char tx_buffer[SERIAL_TX_BUFFER_SIZE];
+static volatile uint32_t tx_head = 0;  /* written by serial_write */
+static volatile uint32_t tx_tail = 0;  /* written by the interrupt */
+static volatile bool tx_running = false;
+
+static char rx_buffer[SERIAL_RX_BUFFER_SIZE];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+static volatile uint32_t rx_dropped = 0;
+
+static uint8_t ier = 0;
+static bool serial_ready = false;
+
+/* Move up to one FIFO's worth of queued bytes into the UART */
+static void serial_fill_fifo() {
+    int sent = 0;
+    while (tx_tail != tx_head && sent < UART_FIFO_SIZE) {
+        port_byte_out(COM1_PORT + UART_DATA, tx_buffer[tx_tail & (SERIAL_TX_BUFFER_SIZE - 1)]);
+        tx_tail++;
+        sent++;
+    }
+    if (sent == 0) {
+        tx_running = false;
+        ier &= ~IER_TX_EMPTY;
+        port_byte_out(COM1_PORT + UART_IER, ier);
+    }
+}
+
+static void serial_callback(registers_t *regs) {
+    (void) regs;
+    uint8_t iir;
+    while (!((iir = port_byte_in(COM1_PORT + UART_IIR_FCR)) & IIR_NO_INTERRUPT)) {
+        switch (iir & IIR_ID_MASK) {
+            case IIR_RX_AVAILABLE:
+            case IIR_RX_TIMEOUT:
+                while (port_byte_in(COM1_PORT + UART_LSR) & LSR_DATA_READY) {
+                    char c = port_byte_in(COM1_PORT + UART_DATA);
+                    if (rx_head - rx_tail < SERIAL_RX_BUFFER_SIZE) {
+                        rx_buffer[rx_head & (SERIAL_RX_BUFFER_SIZE - 1)] = c;
+                        rx_head++;
+                    } else {
+                        rx_dropped++;
+                    }
+                }
+                break;
+            case IIR_TX_EMPTY:
+                serial_fill_fifo();
+                break;
+            case IIR_LINE_STATUS:
+                port_byte_in(COM1_PORT + UART_LSR);
+                break;
+            case IIR_MODEM_STATUS:
+                port_byte_in(COM1_PORT + UART_MSR);
+                break;
+        }
+    }
+}
+
+void init_serial() {
+    port_byte_out(COM1_PORT + UART_IER, 0);
+    port_byte_out(COM1_PORT + UART_LCR, LCR_DLAB);
+    port_byte_out(COM1_PORT + UART_DATA, SERIAL_BAUD_DIVISOR & 0xff);
+    port_byte_out(COM1_PORT + UART_IER, SERIAL_BAUD_DIVISOR >> 8);
+    port_byte_out(COM1_PORT + UART_LCR, LCR_8N1);
+    port_byte_out(COM1_PORT + UART_IIR_FCR, FCR_ENABLE_CLEAR_TRIGGER14);
+    port_byte_out(COM1_PORT + UART_MCR, MCR_DTR_RTS_OUT2);
+
+    register_interrupt_handler(IRQ4, serial_callback);
+    ier = IER_RX_AVAILABLE;
+    port_byte_out(COM1_PORT + UART_IER, ier);
+    serial_ready = true;
+}
+
+/* Call with interrupts disabled */
+static void serial_start_tx() {
+    if (!tx_running && tx_head != tx_tail) {
+        /* The UART raises a THR-empty interrupt as soon as this is enabled */
+        tx_running = true;
+        ier |= IER_TX_EMPTY;
+        port_byte_out(COM1_PORT + UART_IER, ier);
+    }
+}
+
+/*
+ * Interrupts are off (IRQ handler or panic) so nothing will drain the
+ * ring: push the queued bytes out by polling, oldest first.
+ */
+static void serial_drain_polled() {
+    while (tx_tail != tx_head) {
+        while (!(port_byte_in(COM1_PORT + UART_LSR) & LSR_TX_EMPTY));
+        port_byte_out(COM1_PORT + UART_DATA, tx_buffer[tx_tail & (SERIAL_TX_BUFFER_SIZE - 1)]);
+        tx_tail++;
+    }
+}
+
+static void serial_put(char c) {
+    uint32_t flags = irq_save();
+    while (tx_head - tx_tail >= SERIAL_TX_BUFFER_SIZE) {
+        if (!(flags & EFLAGS_IF)) {
+            serial_drain_polled();
+            break;
+        }
+        /* Ring full: sleep until the transmit interrupt frees space */
+        serial_start_tx();
+        asm volatile("sti; hlt; cli");
+    }
+    tx_buffer[tx_head & (SERIAL_TX_BUFFER_SIZE - 1)] = c;
+    tx_head++;
+    irq_restore(flags);
+}
+
+static void serial_kick() {
+    uint32_t flags = irq_save();
+    if (flags & EFLAGS_IF) {
+        serial_start_tx();
+    } else {
+        serial_drain_polled();
+    }
+    irq_restore(flags);
+}
+
+void serial_write(const char *data, uint32_t length) {
+    if (!serial_ready) return;
+    for (uint32_t i = 0; i < length; i++) {
+        serial_put(data[i]);
+    }
+    serial_kick();
+}
+
+void serial_print(const char *string) {
+    if (!serial_ready) return;
+    for (; *string != '\0'; string++) {
+        if (*string == '\n') {
+            serial_put('\r');
+        } else if (*string == '\b') {
+            serial_put('\b');
+            serial_put(' ');
+        }
+        serial_put(*string);
+    }
+    serial_kick();
+}
+
+int serial_read_char() {
+    if (rx_tail == rx_head) return -1;
+    char c = rx_buffer[rx_tail & (SERIAL_RX_BUFFER_SIZE - 1)];
+    rx_tail++;
+    return (uint8_t) c;
+}
+
+uint32_t serial_rx_dropped() {
+    return rx_dropped;
+}
+
+void serial_flush() {
+    if (!serial_ready) return;
+    uint32_t flags = irq_save();
+    serial_drain_polled();
+    while (!(port_byte_in(COM1_PORT + UART_LSR) & LSR_TX_IDLE));
+    irq_restore(flags);
+}
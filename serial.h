@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#define COM1_PORT 0x3f8
+
+/* 115200 / divisor; 1 is the fastest rate the 16550 supports */
+#define SERIAL_BAUD_DIVISOR 1
+
+#define SERIAL_TX_BUFFER_SIZE 4096 /* powers of two */
+#define SERIAL_RX_BUFFER_SIZE 256
+
+void init_serial();
+
+/* Queues bytes for IRQ4-driven transmission */
+void serial_write(const char *data, uint32_t length);
+
+/* Console text: translates '\n' to CRLF and '\b' to an erase */
+void serial_print(const char *string);
+
+/* Returns the next received byte, or -1 if none is waiting */
+int serial_read_char();
+
+uint32_t serial_rx_dropped();
+
+/* Waits until every queued byte has left the UART, e.g. before powering off */
+void serial_flush();
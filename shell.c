@@ -0,0 +1,224 @@
+#include "shell.h"
+#include "acct.h"
+#include "ata.h"
+#include "bcache.h"
+#include "display.h"
+#include "initrd.h"
+#include "isr.h"
+#include "keyboard.h"
+#include "klog.h"
+#include "kstring.h"
+#include "memory.h"
+#include "nn.h"
+#include "paging.h"
+#include "pci.h"
+#include "pmm.h"
+#include "profile.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    char *name;
+    char *help;
+    shell_command_t handler;
+} shell_entry_t;
+
+static shell_entry_t commands[SHELL_MAX_COMMANDS];
+static int command_count = 0;
+
+static char line[SHELL_LINE_SIZE + 1];
+static int line_length = 0;
+
+void shell_register_command(char *name, char *help, shell_command_t handler) {
+    if (command_count == SHELL_MAX_COMMANDS) {
+        kprintf(KLOG_ERROR, "shell: no room for command %s\n", name);
+        return;
+    }
+    commands[command_count++] = (shell_entry_t) {name, help, handler};
+}
+
+/* Returns the arguments if line starts with the word name, otherwise 0 */
+static char *match_command(char *text, char *name) {
+    while (*name != '\0') {
+        if (*text++ != *name++) return 0;
+    }
+    if (*text == '\0') return text;
+    if (*text != ' ') return 0;
+    while (*text == ' ') text++;
+    return text;
+}
+
+static void run_line() {
+    line[line_length] = '\0';
+    line_length = 0;
+
+    char *text = line;
+    while (*text == ' ') text++;
+    if (*text == '\0') return;
+
+    for (int i = 0; i < command_count; i++) {
+        char *args = match_command(text, commands[i].name);
+        if (args != 0) {
+            commands[i].handler(args);
+            return;
+        }
+    }
+    kprintf(KLOG_CONT, "unknown command: %s (try help)\n", text);
+}
+
+void shell_poll() {
+    key_event_t event;
+    while (try_read_key(&event)) {
+        if (event.key == '\n') {
+            run_line();
+            kprintf(KLOG_CONT, "> ");
+        } else if (event.key == '\b') {
+            if (line_length > 0) line_length--;
+        } else if (event.key >= ' ' && event.key < 0x7f && line_length < SHELL_LINE_SIZE) {
+            line[line_length++] = event.key;
+        }
+    }
+}
+
+static void help_command(char *args) {
+    (void) args;
+    for (int i = 0; i < command_count; i++) {
+        kprintf(KLOG_CONT, "%8s  %s\n", commands[i].name, commands[i].help);
+    }
+}
+
+static void cpu_command(char *args) {
+    (void) args;
+    acct_report();
+}
+
+static void smp_command(char *args) {
+    (void) args;
+    smp_report();
+}
+
+static void locks_command(char *args) {
+    if (match_command(args, "reset")) {
+        lockstat_reset();
+    } else if (*args == '\0') {
+        lockstat_report();
+    } else {
+        kprintf(KLOG_CONT, "usage: locks [reset]\n");
+    }
+}
+
+static void irq_command(char *args) {
+    (void) args;
+    irq_stats_dump();
+}
+
+static void disk_command(char *args) {
+    (void) args;
+    ata_report();
+    bcache_report();
+}
+
+static void pci_command(char *args) {
+    (void) args;
+    pci_report();
+}
+
+static void ls_command(char *args) {
+    (void) args;
+    initrd_report();
+    for (uint32_t i = 0; i < initrd_file_count(); i++) {
+        const initrd_file_t *file = initrd_file(i);
+        kprintf(KLOG_CONT, "%8u  %s\n", file->size, initrd_path(file));
+    }
+}
+
+/* Prints straight from the image, a line's worth per kprintf */
+static void cat_command(char *args) {
+    const initrd_file_t *file = initrd_open(args);
+    if (!file) {
+        kprintf(KLOG_CONT, "cat: %s: no such file\n", args);
+        return;
+    }
+    char chunk[SHELL_LINE_SIZE + 1];
+    const void *data;
+    uint32_t length;
+    for (uint32_t offset = 0; (length = initrd_read(file, offset, SHELL_LINE_SIZE, &data)) != 0; offset += length) {
+        memcpy(chunk, data, length);
+        chunk[length] = '\0';
+        kprintf(KLOG_CONT, "%s", chunk);
+    }
+}
+
+static void kbd_command(char *args) {
+    (void) args;
+    keyboard_print_stats();
+}
+
+static void mem_command(char *args) {
+    (void) args;
+    print_dynamic_mem();
+    pmm_report();
+    paging_report();
+}
+
+static void nn_command(char *args) {
+    if (match_command(args, "freeze")) nn_freeze(true);
+    else if (match_command(args, "thaw")) nn_freeze(false);
+    else if (match_command(args, "on")) nn_set_training(true);
+    else if (match_command(args, "off")) nn_set_training(false);
+    else if (match_command(args, "save")) nn_snapshot();
+    else if (match_command(args, "load")) nn_restore();
+    else if (*args != '\0') {
+        kprintf(KLOG_CONT, "usage: nn [on|off|freeze|thaw|save|load]\n");
+        return;
+    }
+    nn_print_state();
+}
+
+/* Decimal digits at the start of text; 0 if there are none */
+static uint32_t parse_uint(char *text) {
+    uint32_t value = 0;
+    while (*text >= '0' && *text <= '9') value = value * 10 + (*text++ - '0');
+    return value;
+}
+
+static void prof_command(char *args) {
+    char *rest;
+    if ((rest = match_command(args, "start")) != 0) {
+        uint32_t interval = parse_uint(rest);
+        profile_start(interval ? interval : PROFILE_DEFAULT_INTERVAL);
+    } else if (match_command(args, "stop")) {
+        profile_stop();
+    } else if (match_command(args, "reset")) {
+        profile_reset();
+    } else if (match_command(args, "dump") || *args == '\0') {
+        profile_dump();
+    } else {
+        kprintf(KLOG_CONT, "usage: prof [start [ticks]|stop|reset|dump]\n");
+    }
+}
+
+static void clear_command(char *args) {
+    (void) args;
+    clear_screen();
+}
+
+void init_shell() {
+    shell_register_command("help", "list commands", help_command);
+    shell_register_command("cpu", "CPU time per thread, vector and idle; load averages", cpu_command);
+    shell_register_command("disk", "ATA drives, request queues and block cache statistics", disk_command);
+    shell_register_command("pci", "PCI functions: address, vendor:device, class and IRQ line", pci_command);
+    shell_register_command("irq", "interrupt counts and handler cycles per vector", irq_command);
+    shell_register_command("kbd", "keyboard IRQ statistics", kbd_command);
+    shell_register_command("ls", "files in the initrd", ls_command);
+    shell_register_command("cat", "print an initrd file <path>", cat_command);
+    shell_register_command("mem", "memory map, free frames, heap usage", mem_command);
+    shell_register_command("nn", "scheduler weights and online training [on|off|freeze|thaw|save|load]", nn_command);
+    shell_register_command("smp", "online CPUs, their ticks, steals and run queues", smp_command);
+    shell_register_command("locks", "lock contention, wait and hold times per lock class [reset]", locks_command);
+    shell_register_command("prof", "sampling profiler [start [ticks]|stop|reset|dump]", prof_command);
+    shell_register_command("clear", "clear the screen", clear_command);
+}
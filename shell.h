@@ -0,0 +1,13 @@
+#pragma once
+
+#define SHELL_LINE_SIZE 80
+#define SHELL_MAX_COMMANDS 32
+
+typedef void (*shell_command_t)(char *args);
+
+void init_shell();
+
+void shell_register_command(char *name, char *help, shell_command_t handler);
+
+/* Consumes typed keys and runs complete command lines; call outside interrupt context */
+void shell_poll();
@@ -0,0 +1,92 @@
+#include "smp.h"
+#include "acct.h"
+#include "apic.h"
+#include "clock.h"
+#include "idt.h"
+#include "isr.h"
+#include "klog.h"
+#include "kstring.h"
+#include "percpu.h"
+#include "sched.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+
+static uint8_t ap_stacks[SMP_MAX_CPUS][SMP_STACK_SIZE] __attribute__((aligned(16)));
+static uint32_t cpus_found = 1; /* the boot CPU, then every AP that ran the trampoline */
+
+/* The boot CPU's tick comes from the PIT through clock.c; the others' from their APIC timers */
+static void apic_timer_callback(registers_t *regs) {
+    (void) regs;
+    sched_tick();
+}
+
+/* Called by ap-trampoline.asm with paging on and this CPU's stack */
+void ap_main(uint32_t id) {
+    percpu_init(id);
+    load_idt();
+    /* CR0 and CR4 came from the boot CPU, so cpu_init()'s FPU and SSE setup only needs the reset */
+    asm volatile("fninit");
+    apic_enable();
+    acct_init_cpu();
+    this_cpu()->apic_id = apic_id();
+
+    if (sched_init_cpu()) {
+        apic_timer_start();
+        asm volatile("sti");
+    }
+    while (1) asm volatile("hlt");
+}
+
+static uint32_t online_count() {
+    uint32_t online = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (cpus[i].online) online++;
+    }
+    return online;
+}
+
+void smp_init() {
+    if (!apic_init()) {
+        kprintf(KLOG_INFO, "smp: no local APIC or TSC, running on one CPU\n");
+        return;
+    }
+    this_cpu()->apic_id = apic_id();
+    register_interrupt_handler(APIC_TIMER_VECTOR, apic_timer_callback);
+
+    smp_trampoline_t *trampoline = (smp_trampoline_t *) SMP_TRAMPOLINE_ADDRESS;
+    memcpy(trampoline, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    asm volatile("mov %%cr3, %0" : "=r" (trampoline->cr3));
+    asm volatile("mov %%cr4, %0" : "=r" (trampoline->cr4));
+    asm volatile("mov %%cr0, %0" : "=r" (trampoline->cr0));
+    trampoline->stacks = (uint32_t) ap_stacks;
+    trampoline->entry = (uint32_t) ap_main;
+    trampoline->next_cpu = 1;
+
+    /* INIT, then STARTUP twice: the second only matters to CPUs that missed the first */
+    apic_broadcast_init();
+    udelay(SMP_INIT_DELAY_US);
+    for (int i = 0; i < 2; i++) {
+        apic_broadcast_startup(SMP_TRAMPOLINE_ADDRESS);
+        udelay(SMP_STARTUP_DELAY_US);
+    }
+
+    udelay(SMP_BOOT_DELAY_US);
+    cpus_found = trampoline->next_cpu;
+    uint32_t expected = cpus_found < SMP_MAX_CPUS ? cpus_found : SMP_MAX_CPUS;
+    uint64_t deadline = ktime_get() + (uint64_t) SMP_ONLINE_TIMEOUT_US * 1000;
+    while (online_count() < expected && ktime_get() < deadline) asm volatile("pause");
+    smp_report();
+}
+
+uint32_t smp_cpu_count() {
+    return online_count();
+}
+
+void smp_report() {
+    kprintf(KLOG_INFO, "smp: %u of %u CPUs online\n", online_count(), cpus_found);
+    sched_report();
+}
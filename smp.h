@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Secondary CPU start-up. A STARTUP IPI with vector 0x08 starts every
+ * other CPU in real mode at 0800:0000, where smp_init() has copied
+ * ap-trampoline.asm. Each one takes the next cpus[] index from the
+ * trampoline, switches to protected mode with the boot CPU's paging, and
+ * calls ap_main() on its own stack, where it becomes that CPU's idle
+ * thread.
+ */
+#define SMP_TRAMPOLINE_ADDRESS 0x8000
+#define SMP_STACK_SHIFT 13 /* must match ap-trampoline.asm */
+#define SMP_STACK_SIZE (1 << SMP_STACK_SHIFT)
+
+#define SMP_INIT_DELAY_US 10000
+#define SMP_STARTUP_DELAY_US 200
+#define SMP_BOOT_DELAY_US 20000 /* for every AP to have taken its index */
+#define SMP_ONLINE_TIMEOUT_US 500000
+
+/* Parameters at the start of the trampoline, after its jmp */
+typedef struct {
+    uint32_t jump;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t cr0;
+    uint32_t stacks;   /* SMP_STACK_SIZE per cpus[] index */
+    uint32_t entry;    /* ap_main */
+    volatile uint32_t next_cpu;
+} __attribute__((packed)) smp_trampoline_t;
+
+/* Starts the other CPUs; after sched_init() and paging_init(), with interrupts still off */
+void smp_init();
+
+/* CPUs running the scheduler, the boot CPU included */
+uint32_t smp_cpu_count();
+
+void smp_report();
@@ -0,0 +1,66 @@
+#include "spinlock.h"
+#include "klog.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Classes in the order they were first taken */
+static lock_class_t *classes = 0;
+
+static void lockstat_register(lock_class_t *class) {
+    uint32_t unregistered = 0;
+    if (!atomic_cmpxchg(&class->registered, &unregistered, 1)) return;
+    lock_class_t *head = __atomic_load_n(&classes, __ATOMIC_ACQUIRE);
+    do {
+        class->next = head;
+    } while (!__atomic_compare_exchange_n(&classes, &head, class, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+void lockstat_acquired(lock_class_t *class, uint64_t wait_start, uint64_t *acquired_tsc, bool contended) {
+    uint64_t now = lockstat_now();
+    *acquired_tsc = now;
+    if (class == 0) return;
+    if (atomic_read(&class->registered) == 0) lockstat_register(class);
+
+    class->acquisitions++;
+    if (!contended) return;
+    uint32_t waited = (uint32_t) (now - wait_start);
+    class->contended++;
+    class->wait_cycles += waited;
+    if (waited > class->max_wait) class->max_wait = waited;
+}
+
+void lockstat_released(lock_class_t *class, uint64_t acquired_tsc) {
+    if (class == 0) return;
+    uint32_t held = (uint32_t) (lockstat_now() - acquired_tsc);
+    class->hold_cycles += held;
+    if (held > class->max_hold) class->max_hold = held;
+}
+
+void lockstat_reset() {
+    for (lock_class_t *class = __atomic_load_n(&classes, __ATOMIC_ACQUIRE); class != 0; class = class->next) {
+        class->acquisitions = 0;
+        class->contended = 0;
+        class->wait_cycles = 0;
+        class->hold_cycles = 0;
+        class->max_wait = 0;
+        class->max_hold = 0;
+    }
+}
+
+void lockstat_report() {
+    if (!LOCKSTAT) {
+        kprintf(KLOG_CONT, "lockstat is off; build with LOCKSTAT 1 in spinlock.h\n");
+        return;
+    }
+    kprintf(KLOG_CONT, "lock class: acquired, contended, wait avg/max, hold avg/max (cycles)\n");
+    for (lock_class_t *class = __atomic_load_n(&classes, __ATOMIC_ACQUIRE); class != 0; class = class->next) {
+        uint32_t acquisitions = class->acquisitions;
+        uint32_t contended = class->contended;
+        uint32_t wait = contended ? (uint32_t) udiv64_32(class->wait_cycles, contended) : 0;
+        uint32_t hold = acquisitions ? (uint32_t) udiv64_32(class->hold_cycles, acquisitions) : 0;
+        kprintf(KLOG_CONT, "  %s: %u, %u, %u/%u, %u/%u\n", class->name, acquisitions, contended,
+                wait, class->max_wait, hold, class->max_hold);
+    }
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "atomic.h"
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Locks for data shared between CPUs. Anything an interrupt handler also
+ * takes must be held with the _irqsave variants, or the handler can spin
+ * on a lock its own CPU holds. None of them sleep or disable preemption.
+ *
+ * spinlock_t is a ticket lock: waiters are served in arrival order and
+ * spin on the one word the holder bumps when it lets go. mcs_lock_t
+ * queues each waiter on its own node instead, so a contended lock costs
+ * one cache line transfer per handoff however many CPUs wait; use it
+ * where lockstat shows real contention.
+ *
+ * Every lock names a lock_class_t. With LOCKSTAT set to 1 each class
+ * counts acquisitions, contended acquisitions and rdtsc cycles spent
+ * waiting and holding; the locks shell command prints them. Counters
+ * are updated while holding the lock, so give each lock its own class.
+ */
+#ifndef LOCKSTAT
+#define LOCKSTAT 0
+#endif
+
+typedef struct lock_class {
+    const char *name;
+    uint32_t acquisitions;
+    uint32_t contended;
+    uint64_t wait_cycles;
+    uint64_t hold_cycles;
+    uint32_t max_wait;
+    uint32_t max_hold;
+    atomic_t registered;
+    struct lock_class *next;
+} lock_class_t;
+
+#define LOCK_CLASS(name_) {.name = (name_)}
+
+typedef struct {
+    union {
+        volatile uint32_t tickets;
+        struct {
+            volatile uint16_t owner; /* ticket being served */
+            volatile uint16_t next;  /* next ticket handed out */
+        };
+    };
+    lock_class_t *class;
+#if LOCKSTAT
+    uint64_t acquired_tsc;
+#endif
+} spinlock_t;
+
+#define SPINLOCK_INIT(class_) {.tickets = 0, .class = (class_)}
+
+typedef struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile uint32_t waiting;
+} mcs_node_t;
+
+typedef struct {
+    mcs_node_t *volatile tail; /* last waiter, or the holder; 0 when free */
+    lock_class_t *class;
+#if LOCKSTAT
+    uint64_t acquired_tsc;
+#endif
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT(class_) {.tail = 0, .class = (class_)}
+
+/* lockstat hooks, called with the lock held; see spinlock.c */
+void lockstat_acquired(lock_class_t *class, uint64_t wait_start, uint64_t *acquired_tsc, bool contended);
+
+void lockstat_released(lock_class_t *class, uint64_t acquired_tsc);
+
+/* Every class taken since boot */
+void lockstat_report();
+
+void lockstat_reset();
+
+static inline uint64_t lockstat_now() {
+#if LOCKSTAT
+    return cpu_has(CPU_FEATURE_TSC) ? rdtsc() : 0;
+#else
+    return 0;
+#endif
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint64_t start = lockstat_now();
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+    bool contended = false;
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        contended = true;
+        cpu_relax();
+    }
+#if LOCKSTAT
+    lockstat_acquired(lock->class, start, &lock->acquired_tsc, contended);
+#else
+    (void) start;
+    (void) contended;
+#endif
+}
+
+/* Takes the lock only if nobody holds or waits for it */
+static inline bool spin_trylock(spinlock_t *lock) {
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    uint32_t expected = owner | owner << 16;
+    uint32_t desired = owner | ((owner + 1) & 0xffff) << 16;
+    if (!__atomic_compare_exchange_n(&lock->tickets, &expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+#if LOCKSTAT
+    lockstat_acquired(lock->class, lockstat_now(), &lock->acquired_tsc, false);
+#endif
+    return true;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+#if LOCKSTAT
+    lockstat_released(lock->class, lock->acquired_tsc);
+#endif
+    /* Only the holder writes owner, so a plain increment with release order is enough */
+    __atomic_store_n(&lock->owner, (uint16_t) (lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(spinlock_t *lock) {
+    return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
+/* Interrupts off, then the lock; returns the EFLAGS for spin_unlock_irqrestore */
+static inline uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+/* node belongs to this acquisition until mcs_unlock(); a stack variable does */
+static inline void mcs_lock(mcs_lock_t *lock, mcs_node_t *node) {
+    uint64_t start = lockstat_now();
+    node->next = 0;
+    node->waiting = 1;
+    mcs_node_t *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    bool contended = prev != 0;
+    if (contended) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->waiting, __ATOMIC_ACQUIRE)) cpu_relax();
+    }
+#if LOCKSTAT
+    lockstat_acquired(lock->class, start, &lock->acquired_tsc, contended);
+#else
+    (void) start;
+#endif
+}
+
+static inline void mcs_unlock(mcs_lock_t *lock, mcs_node_t *node) {
+#if LOCKSTAT
+    lockstat_released(lock->class, lock->acquired_tsc);
+#endif
+    mcs_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == 0) {
+        mcs_node_t *expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        /* A waiter swapped itself in but hasn't linked behind us yet */
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == 0) cpu_relax();
+    }
+    __atomic_store_n(&next->waiting, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t mcs_lock_irqsave(mcs_lock_t *lock, mcs_node_t *node) {
+    uint32_t flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *lock, mcs_node_t *node, uint32_t flags) {
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
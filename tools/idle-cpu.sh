@@ -0,0 +1,32 @@
+#!/bin/sh
+# Host CPU used by an idle guest: boots IMAGE headless, lets it settle,
+# then samples the QEMU process's user+system time over a window.
+#
+#   tools/idle-cpu.sh [IMAGE] [SETTLE_SECONDS] [WINDOW_SECONDS]
+#
+# Compare two builds by running it against each image, e.g. one built
+# from the commit before a change and one from after it.
+set -e
+
+image=${1:-os-image.bin}
+settle=${2:-15}
+window=${3:-10}
+memory=${QEMU_MEM:-128M}
+
+qemu-system-i386 -m "$memory" -drive format=raw,file="$image" \
+	-display none -serial null -monitor none -no-reboot &
+pid=$!
+trap 'kill $pid 2>/dev/null' EXIT
+
+# utime + stime in clock ticks, fields 14 and 15 of /proc/PID/stat
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$pid/stat"
+}
+
+sleep "$settle"
+start=$(cpu_ticks)
+sleep "$window"
+end=$(cpu_ticks)
+
+hz=$(getconf CLK_TCK)
+echo "$image: $(( (end - start) * 100 / (hz * window) ))% of one host CPU over ${window}s (idle after ${settle}s)"
@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""Packs a directory into the kernel's initrd image and appends it to a boot image.
+
+    tools/mkinitrd.py pack initrd initrd.img
+    tools/mkinitrd.py attach os-image.bin kernel.map initrd.img
+
+pack writes the layout initrd.h describes. Paths are relative to the
+directory with '/' separators. The path index is a minimal perfect hash:
+FNV-1a of the path (seeded) picks a bucket, and each bucket gets the
+smallest displacement that sends all of its paths to free slots of the
+file table, biggest buckets first. The kernel repeats one hash and one
+finalizer per lookup, so the table is built here once instead.
+
+attach appends the image sector-aligned and patches the kernel header
+(right after the MBR) with its size in sectors and a load address: the
+first page past the kernel's _end, taken from the nm map.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = 0x44524E49
+DATA_ALIGN = 16
+FNV_OFFSET = 0x811C9DC5
+FNV_PRIME = 0x01000193
+MASK = 0xFFFFFFFF
+MAX_DISPLACEMENT = 1 << 20
+MAX_SEEDS = 64
+HEADER = struct.Struct("<8I")
+FILE = struct.Struct("<4I")
+
+SECTOR = 512
+PAGE = 4096
+KERNEL_HEADER = 512  # offset of kernel-entry.asm's header in the boot image
+INITRD_FIELDS = KERNEL_HEADER + 12  # initrd sectors, then load address
+
+
+def path_hash(path, seed):
+    h = FNV_OFFSET ^ seed
+    for byte in path:
+        h = ((h ^ byte) * FNV_PRIME) & MASK
+    return h
+
+
+def slot_for(h, displacement, count):
+    x = h ^ displacement
+    x ^= x >> 16
+    x = (x * 0x85EBCA6B) & MASK
+    x ^= x >> 13
+    x = (x * 0xC2B2AE35) & MASK
+    x ^= x >> 16
+    return x % count
+
+
+def place(hashes, buckets):
+    """Displacements and slot -> path index for one seed, or None if a bucket won't fit."""
+    count = len(hashes)
+    groups = [[] for _ in range(buckets)]
+    for i, h in enumerate(hashes):
+        groups[h & (buckets - 1)].append(i)
+
+    displacements = [0] * buckets
+    slots = [None] * count
+    for bucket in sorted(range(buckets), key=lambda b: -len(groups[b])):
+        members = groups[bucket]
+        if not members:
+            break
+        for displacement in range(MAX_DISPLACEMENT):
+            wanted = [slot_for(hashes[i], displacement, count) for i in members]
+            if len(set(wanted)) == len(wanted) and all(slots[s] is None for s in wanted):
+                break
+        else:
+            return None
+        displacements[bucket] = displacement
+        for i, s in zip(members, wanted):
+            slots[s] = i
+    return displacements, slots
+
+
+def build_index(paths):
+    """Returns (seed, bucket count, displacements, slot -> path index, hashes)."""
+    buckets = 1
+    while buckets < len(paths):
+        buckets *= 2
+
+    for seed in range(MAX_SEEDS):
+        hashes = [path_hash(p, seed) for p in paths]
+        if len(set(hashes)) != len(paths):
+            continue
+        placed = place(hashes, buckets)
+        if placed:
+            return (seed, buckets) + placed + (hashes,)
+    sys.exit("mkinitrd: no perfect hash found for %d paths" % len(paths))
+
+
+def collect(directory):
+    files = []
+    for root, dirs, names in os.walk(directory):
+        dirs.sort()
+        for name in sorted(names):
+            full = os.path.join(root, name)
+            path = os.path.relpath(full, directory).replace(os.sep, "/")
+            with open(full, "rb") as f:
+                files.append((path.encode(), f.read()))
+    return files
+
+
+def bench_files(count):
+    """Synthetic files for the lookup benchmark: 64 B to 4 KB of a fixed pattern each."""
+    files = []
+    for i in range(count):
+        size = 64 << (i % 7)
+        files.append((("bench/%04d" % i).encode(), bytes((i + j) & 0xFF for j in range(size))))
+    return files
+
+
+def align(value, alignment):
+    return (value + alignment - 1) // alignment * alignment
+
+
+def pack(args):
+    files = collect(args.directory) + bench_files(args.bench_files)
+    paths = [path for path, _ in files]
+    if len(set(paths)) != len(paths):
+        sys.exit("mkinitrd: duplicate paths")
+    seed, buckets, displacements, slots, hashes = build_index(paths)
+
+    displacements_offset = HEADER.size
+    files_offset = displacements_offset + 4 * buckets
+    cursor = files_offset + FILE.size * len(files)
+    path_offsets = []
+    for path in paths:
+        path_offsets.append(cursor)
+        cursor += len(path) + 1
+    data_offsets = []
+    for _, data in files:
+        cursor = align(cursor, DATA_ALIGN)
+        data_offsets.append(cursor)
+        cursor += len(data)
+    size = cursor
+
+    image = bytearray(size)
+    HEADER.pack_into(image, 0, MAGIC, size, len(files), buckets, seed,
+                     displacements_offset, files_offset, 0)
+    struct.pack_into("<%dI" % buckets, image, displacements_offset, *displacements)
+    for slot, i in enumerate(slots):
+        FILE.pack_into(image, files_offset + FILE.size * slot,
+                       hashes[i], path_offsets[i], data_offsets[i], len(files[i][1]))
+    for i, (path, data) in enumerate(files):
+        image[path_offsets[i]:path_offsets[i] + len(path)] = path
+        image[data_offsets[i]:data_offsets[i] + len(data)] = data
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("mkinitrd: %s: %d files, %d bytes, seed %d" % (args.output, len(files), size, seed))
+
+
+def kernel_end(map_path):
+    with open(map_path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 3 and fields[2] == "_end":
+                return int(fields[0], 16)
+    sys.exit("mkinitrd: no _end in %s" % map_path)
+
+
+def attach(args):
+    with open(args.initrd, "rb") as f:
+        initrd = f.read()
+    initrd += bytes(align(len(initrd), SECTOR) - len(initrd))
+    address = align(kernel_end(args.map), PAGE)
+
+    with open(args.image, "r+b") as f:
+        f.seek(0, os.SEEK_END)
+        if f.tell() % SECTOR:
+            sys.exit("mkinitrd: %s is not a whole number of sectors" % args.image)
+        f.write(initrd)
+        f.seek(INITRD_FIELDS)
+        f.write(struct.pack("<2I", len(initrd) // SECTOR, address))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    pack_parser = commands.add_parser("pack", help="build an initrd image from a directory")
+    pack_parser.add_argument("directory")
+    pack_parser.add_argument("output")
+    pack_parser.add_argument("--bench-files", type=int, default=0, metavar="N",
+                             help="also add N synthetic files under bench/")
+    pack_parser.set_defaults(run=pack)
+
+    attach_parser = commands.add_parser("attach", help="append an initrd to a boot image")
+    attach_parser.add_argument("image")
+    attach_parser.add_argument("map", help="nm -n listing of the kernel in the image")
+    attach_parser.add_argument("initrd")
+    attach_parser.set_defaults(run=attach)
+
+    args = parser.parse_args()
+    args.run(args)
+
+
+if __name__ == "__main__":
+    main()
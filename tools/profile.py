@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Symbolizes the kernel's "prof dump" output into flat and call-graph profiles.
+
+    make run | tee serial.log          # then: prof start, ..., prof dump
+    tools/profile.py kernel.map serial.log
+
+kernel.map is the `nm -n` listing the Makefile writes next to kernel.elf.
+Each "PROFILE <count> <eip> <return address>..." line is one sampled
+stack, innermost first; return addresses are looked up one byte back so
+they land inside the calling function.
+"""
+
+import argparse
+import bisect
+import collections
+import sys
+
+
+def load_symbols(path):
+    addresses, names = [], []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) != 3 or fields[1] not in "tTwW":
+                continue
+            addresses.append(int(fields[0], 16))
+            names.append(fields[2])
+    return addresses, names
+
+
+def symbolize(symbols, address):
+    addresses, names = symbols
+    i = bisect.bisect_right(addresses, address) - 1
+    return names[i] if i >= 0 else "0x%x" % address
+
+
+def read_samples(stream):
+    header, stacks = None, []
+    for line in stream:
+        line = line.strip()
+        if line.startswith("PROFILE-BEGIN"):
+            header, stacks = line, []  # the last dump in the log wins
+        elif line.startswith("PROFILE "):
+            fields = line.split()
+            stacks.append((int(fields[1]), [int(pc, 16) for pc in fields[2:]]))
+    return header, stacks
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("map", help="nm -n symbol map, e.g. kernel.map")
+    parser.add_argument("log", nargs="?", help="serial log with a prof dump (default stdin)")
+    parser.add_argument("--top", type=int, default=25, help="rows per table")
+    args = parser.parse_args()
+
+    symbols = load_symbols(args.map)
+    stream = open(args.log, errors="replace") if args.log else sys.stdin
+    header, stacks = read_samples(stream)
+    if header is None:
+        sys.exit("no PROFILE-BEGIN in the log; run 'prof dump' in the kernel shell")
+
+    total = sum(count for count, _ in stacks)
+    if total == 0:
+        print(header)
+        print("no samples")
+        return
+    self_counts = collections.Counter()
+    inclusive = collections.Counter()
+    callers = collections.defaultdict(collections.Counter)
+
+    for count, pcs in stacks:
+        frames = [symbolize(symbols, pcs[0])]
+        frames += [symbolize(symbols, pc - 1) for pc in pcs[1:]]
+        self_counts[frames[0]] += count
+        for name in set(frames):
+            inclusive[name] += count
+        for callee, caller in zip(frames, frames[1:]):
+            callers[callee][caller] += count
+
+    print(header)
+    print("\nFlat profile (%d samples)" % total)
+    print("%8s %7s %8s %7s  %s" % ("self", "%", "total", "%", "function"))
+    for name, count in self_counts.most_common(args.top):
+        print("%8d %6.1f%% %8d %6.1f%%  %s" % (count, 100.0 * count / total,
+                                               inclusive[name], 100.0 * inclusive[name] / total, name))
+
+    print("\nCall graph (inclusive samples; callers indented below each function)")
+    for name, count in inclusive.most_common(args.top):
+        print("%8d %6.1f%%  %s" % (count, 100.0 * count / total, name))
+        for caller, edge in callers[name].most_common(5):
+            print("%8d          <- %s" % (edge, caller))
+
+
+if __name__ == "__main__":
+    main()
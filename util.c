@@ -1,11 +1,9 @@
-#include <stdint.h>
+#include "util.h"
 
-void memory_copy(uint8_t *source, uint8_t *dest, uint32_t nbytes) {
-    int i;
-    for (i = 0; i < nbytes; i++) {
-        *(dest + i) = *(source + i);
-    }
-}
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 int string_length(char s[]) {
     int i = 0;
@@ -34,4 +32,129 @@ void int_to_string(int n, char str[]) {
     str[i] = '\0';
 
     reverse(str);
-}
\ No newline at end of file
+}
+static void format_append(char *buffer, size_t size, size_t *length, char c) {
+    if (*length + 1 < size) {
+        buffer[*length] = c;
+    }
+    (*length)++;
+}
+
+static void format_number(char *buffer, size_t size, size_t *length, uint32_t value,
+                          uint32_t base, bool negative, int width, char pad) {
+    char digits[12];
+    int count = 0;
+    do {
+        uint32_t digit = value % base;
+        digits[count++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+    } while (value > 0);
+
+    if (negative) {
+        if (pad == '0') format_append(buffer, size, length, '-');
+        width--;
+    }
+    for (int i = count; i < width; i++) {
+        format_append(buffer, size, length, pad);
+    }
+    if (negative && pad != '0') format_append(buffer, size, length, '-');
+    while (count > 0) {
+        format_append(buffer, size, length, digits[--count]);
+    }
+}
+
+/*
+ * Minimal printf formatting: %d %i %u %x %p %s %c %% with an optional
+ * '0' flag and field width. Always NUL-terminates; returns the length
+ * the full output would have had.
+ */
+int kvsnprintf(char *buffer, size_t size, const char *format, va_list args) {
+    size_t length = 0;
+    for (; *format != '\0'; format++) {
+        if (*format != '%') {
+            format_append(buffer, size, &length, *format);
+            continue;
+        }
+        format++;
+
+        char pad = ' ';
+        int width = 0;
+        if (*format == '0') {
+            pad = '0';
+            format++;
+        }
+        while (*format >= '0' && *format <= '9') {
+            width = width * 10 + (*format++ - '0');
+        }
+        while (*format == 'l') format++;
+
+        switch (*format) {
+            case 'd':
+            case 'i': {
+                int value = va_arg(args, int);
+                uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+                format_number(buffer, size, &length, magnitude, 10, value < 0, width, pad);
+                break;
+            }
+            case 'u':
+                format_number(buffer, size, &length, va_arg(args, uint32_t), 10, false, width, pad);
+                break;
+            case 'x':
+                format_number(buffer, size, &length, va_arg(args, uint32_t), 16, false, width, pad);
+                break;
+            case 'p':
+                format_append(buffer, size, &length, '0');
+                format_append(buffer, size, &length, 'x');
+                format_number(buffer, size, &length, (uint32_t) (uintptr_t) va_arg(args, void *), 16, false, 8, '0');
+                break;
+            case 's': {
+                char *s = va_arg(args, char *);
+                if (s == 0) s = "(null)";
+                int s_length = string_length(s);
+                for (int i = s_length; i < width; i++) format_append(buffer, size, &length, ' ');
+                while (*s) format_append(buffer, size, &length, *s++);
+                break;
+            }
+            case 'c':
+                format_append(buffer, size, &length, (char) va_arg(args, int));
+                break;
+            case '%':
+                format_append(buffer, size, &length, '%');
+                break;
+            case '\0':
+                format--;
+                break;
+            default:
+                format_append(buffer, size, &length, '%');
+                format_append(buffer, size, &length, *format);
+                break;
+        }
+    }
+    if (size > 0) {
+        buffer[length < size ? length : size - 1] = '\0';
+    }
+    return length;
+}
+
+int ksnprintf(char *buffer, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = kvsnprintf(buffer, size, format, args);
+    va_end(args);
+    return length;
+}
+
+/* 64-by-32 bit division without libgcc's __udivdi3 */
+uint64_t udiv64_32(uint64_t dividend, uint32_t divisor) {
+    uint32_t high = (uint32_t) (dividend >> 32);
+    uint32_t low = (uint32_t) dividend;
+    uint32_t quotient_high = high / divisor;
+    uint32_t remainder = high % divisor;
+    uint32_t quotient_low;
+#ifdef HOST_BUILD
+    quotient_low = (uint32_t) ((((uint64_t) remainder << 32) | low) / divisor);
+#else
+    asm("divl %2" : "=a" (quotient_low), "+d" (remainder) : "rm" (divisor), "a" (low));
+#endif
+    return ((uint64_t) quotient_high << 32) | quotient_low;
+}
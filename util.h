@@ -1,14 +1,20 @@
 #pragma once
 
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define low_16(address) (uint16_t)((address) & 0xFFFF)
 #define high_16(address) (uint16_t)(((address) >> 16) & 0xFFFF)
 
-void memory_copy(uint8_t *source, uint8_t *dest, uint32_t nbytes);
-
 int string_length(char s[]);
 
 void reverse(char s[]);
 
-void int_to_string(int n, char str[]);
\ No newline at end of file
+void int_to_string(int n, char str[]);
+
+int kvsnprintf(char *buffer, size_t size, const char *format, va_list args);
+
+int ksnprintf(char *buffer, size_t size, const char *format, ...);
+
+uint64_t udiv64_32(uint64_t dividend, uint32_t divisor);